@@ -39,20 +39,30 @@
 static char *basepath;
 static int debug = 0;
 
-typedef struct _metadatafs
-{
-	pthread_mutex_t lock;
-	pthread_mutex_t debug_lock;
-	sqlite3 *db;
-	char *basepath;
-	pthread_t scanner;
-#if HAVE_INOTIFY
-	pthread_t monitor;
-	int inotify_fd;
-	int inotify_wd;
-#endif
-	Mdfs_Info *info;
-} metadatafs;
+#define METADATAFS_OPT(t, p, v) { t, offsetof(metadatafs, p), v }
+
+static struct fuse_opt metadatafs_opts[] = {
+	METADATAFS_OPT("scan_threads=%u", scan_threads, 0),
+	METADATAFS_OPT("batch_size=%u", batch_size, 0),
+	METADATAFS_OPT("batch_time=%u", batch_time, 0),
+	METADATAFS_OPT("full_verify", full_verify, 1),
+	METADATAFS_OPT("verify_interval=%u", verify_interval, 0),
+	METADATAFS_OPT("checkpoint_interval=%u", checkpoint_interval, 0),
+	METADATAFS_OPT("snapshot_refresh=%u", snapshot_refresh, 0),
+	METADATAFS_OPT("io_uring", io_uring, 1),
+	METADATAFS_OPT("uring_depth=%u", uring_depth, 0),
+	METADATAFS_OPT("scan_rate=%u", scan_rate, 0),
+	METADATAFS_OPT("scan_bandwidth=%u", scan_bandwidth, 0),
+	METADATAFS_OPT("scan_idle", scan_idle, 1),
+	METADATAFS_OPT("scan_yield=%u", scan_yield, 0),
+	METADATAFS_OPT("scan_order=%s", scan_order, 0),
+	METADATAFS_OPT("scan_keep_cache", scan_keep_cache, 1),
+	METADATAFS_OPT("rebuild", rebuild, 1),
+	METADATAFS_OPT("manifest=%s", manifest, 0),
+	METADATAFS_OPT("monitor_delay=%u", monitor_delay, 0),
+	METADATAFS_OPT("monitor=%s", monitor_backend, 0),
+	FUSE_OPT_END
+};
 
 const char *_fields[] = {
 	"Artist",
@@ -139,7 +149,10 @@ static int _path_to_query(char *path, metadatafs_query *q)
 	return 1;
 }
 
-/* FIXME we should fix this function, horrible if's */
+/* FIXME we should fix this function, horrible if's. The values on the path
+ * are left as parameters, ?1 for the artist and so on, the string only
+ * depends on the fields found and the last one
+ */
 static char * _query_to_string(metadatafs_query *q)
 {
 	char str[4096];
@@ -151,7 +164,7 @@ static char * _query_to_string(metadatafs_query *q)
 		sprintf(str, "SELECT DISTINCT %s.name FROM artist AS %s", _fields[FIELD_ARTIST], _fields[FIELD_ARTIST]);
 		if (q->fields & MASK_FILES)
 		{
-			sprintf(str, "%s JOIN album,title,files WHERE album.artist = artist.id AND title.album = album.id and and files.title = title.id", str);
+			sprintf(str, "%s JOIN album,title,files WHERE album.artist = artist.id AND title.album = album.id AND files.title = title.id", str);
 		}
 		else if (q->fields & MASK_TITLE)
 		{
@@ -169,7 +182,7 @@ static char * _query_to_string(metadatafs_query *q)
 		{
 			if (q->fields & MASK_FILES)
 			{
-				sprintf(str, "%s JOIN artist,title,files WHERE artist.id = album.artist = artist.id AND title.album = album.id and and files.title = title.id", str);
+				sprintf(str, "%s JOIN artist,title,files WHERE album.artist = artist.id AND title.album = album.id AND files.title = title.id", str);
 			}
 			else if (q->fields & MASK_TITLE)
 			{
@@ -182,7 +195,7 @@ static char * _query_to_string(metadatafs_query *q)
 		}
 		else if (q->fields & MASK_FILES)
 		{
-			sprintf(str, "%s JOIN title,files WHERE title.album = album.id and and files.title = title.id", str);
+			sprintf(str, "%s JOIN title,files WHERE title.album = album.id AND files.title = title.id", str);
 		}
 		else if (q->fields & MASK_TITLE)
 		{
@@ -243,9 +256,9 @@ static char * _query_to_string(metadatafs_query *q)
 			if (m & (1 << i))
 			{
 				if (i == FIELD_FILES)
-					sprintf(str, "%s AND %s.file = '%s'", str, _fields[i], q->entries[i]);
+					sprintf(str, "%s AND %s.file = ?%d", str, _fields[i], i + 1);
 				else
-					sprintf(str, "%s AND %s.name = '%s'", str, _fields[i], q->entries[i]);
+					sprintf(str, "%s AND %s.name = ?%d", str, _fields[i], i + 1);
 			}
 		}
 	}
@@ -253,6 +266,41 @@ static char * _query_to_string(metadatafs_query *q)
 	return strdup(str);
 }
 
+static int _query_key(metadatafs_query *q)
+{
+	return MDFS_STMT_QUERY + (q->fields << 3 | q->last_field);
+}
+
+/* the statement of the query with the values of the path bound, from the
+ * cache of db
+ */
+static sqlite3_stmt * _query_stmt(sqlite3 *db, metadatafs_query *q)
+{
+	sqlite3_stmt *stmt;
+	metadatafs_mask m;
+	int i;
+
+	stmt = mdfs_stmt_take(db, _query_key(q));
+	if (!stmt)
+	{
+		char *query;
+
+		query = _query_to_string(q);
+		stmt = mdfs_stmt_get(db, _query_key(q), query);
+		free(query);
+		if (!stmt)
+			return NULL;
+	}
+	m = q->fields & ~(1 << q->last_field);
+	for (i = 0; i < FIELDS; i++)
+	{
+		if (m & (1 << i))
+			sqlite3_bind_text(stmt, i + 1, q->entries[i], -1,
+					SQLITE_STATIC);
+	}
+	return stmt;
+}
+
 static void _query_dump(metadatafs_query *q)
 {
 	printf("flags = %08x\n", q->fields);
@@ -300,62 +348,20 @@ again:
 	return prv;
 }
 
-/* the original file has changed on the filesystem, propragate the changes now */
+/* the original file has changed on the filesystem, propragate the changes
+ * through the writer. The tags are read as the scanner does
+ */
 static void _file_update(metadatafs *mdfs, const char *filename)
 {
-	Mdfs_File *file;
-	Mdfs_Artist *artist;
-	Mdfs_Title *title;
-	Mdfs_Album *album;
-	char *str;
-	void *handle;
+	libmetadatafs_tags tags;
 	struct stat st;
-	int artist_changed = 0;
-	int album_changed = 0;
-
-	handle = libmetadatafs_open(filename);
-	if (!handle) return;
-
-	/* first fetch the old file from the database */
-	file = mdfs_file_get_from_path(mdfs->db, filename);
-	title = mdfs_title_get_from_id(mdfs->db, file->title);
-	album = mdfs_album_get_from_id(mdfs->db, title->album);
-	artist = mdfs_artist_get_from_id(mdfs->db, album->artist);
-
-	/* update the artist information */
-	str = libmetadatafs_artist_get(handle);
-	if (strcmp(artist->name, str))
-	{
-		mdfs_artist_free(artist);
-		artist = mdfs_artist_new(mdfs->db, str);
-		artist_changed = 1;
-		/* TODO in case there is no more albums with this artist, remove it */
-	}
-	free(str);
-	/* update the album information */
-	str = libmetadatafs_album_get(handle);
-	if (strcmp(album->name, str) || artist_changed)
-	{
-		mdfs_album_free(album);
-		album = mdfs_album_new(mdfs->db, str, artist->id);
-		album_changed = 1;
-	}
-	free(str);
-	/* update the title information */
-	str = libmetadatafs_title_get(handle);
-	if (strcmp(title->name, str) || album_changed)
-	{
-		mdfs_title_free(title);
-		title = mdfs_title_new(mdfs->db, str, album->id);
-	}
-	free(str);
 
-	/* update the file information */
 	if (stat(filename, &st) < 0)
 		return;
-	mdfs_file_update(file, mdfs->db, filename, st.st_mtime, title->id);
-
-	libmetadatafs_close(handle);
+	if (!libmetadatafs_tags_get(filename, NULL, 0, &tags))
+		return;
+	mdfs_writer_file_add(mdfs->writer, filename, &st, tags.artist,
+			tags.album, tags.title);
 }
 
 static int _file_fields_update(metadatafs *mdfs, Mdfs_File *file, metadatafs_mask mask, metadatafs_query *dst)
@@ -398,42 +404,318 @@ static int _file_fields_update(metadatafs *mdfs, Mdfs_File *file, metadatafs_mas
 /******************************************************************************
  *                                 Database                                   *
  ******************************************************************************/
+/* the statements other threads have on it are finalized too, they must be
+ * done with it already
+ */
 static void db_cleanup(sqlite3 *db)
 {
+	sqlite3_stmt *stmt;
+
+	mdfs_stmt_cache_free(db);
+	while ((stmt = sqlite3_next_stmt(db, NULL)))
+		sqlite3_finalize(stmt);
 	sqlite3_close(db);
 }
 
-static int db_file_changed(sqlite3 *db, const char *file, time_t mtime)
+struct _Mdfs_Reader
+{
+	metadatafs *mdfs;
+	sqlite3 *db;
+	/* whether it reads from the snapshot too */
+	int snapshot;
+	/* whether a thread serves the requests from it */
+	int used;
+	Mdfs_Reader *next;
+};
+
+/* the connections kept for the threads to come, as many as the idle threads
+ * fuse keeps around
+ */
+#define DB_READERS 10
+
+/* a new connection on the list of readers, not used by any thread yet */
+static Mdfs_Reader * db_reader_open(metadatafs *mdfs)
+{
+	Mdfs_Reader *r;
+
+	r = calloc(1, sizeof(Mdfs_Reader));
+	if (sqlite3_open_v2(sqlite3_db_filename(mdfs->rdb, "main"), &r->db,
+			SQLITE_OPEN_READONLY | SQLITE_OPEN_NOMUTEX,
+			NULL) != SQLITE_OK)
+	{
+		sqlite3_close(r->db);
+		free(r);
+		return NULL;
+	}
+	sqlite3_busy_timeout(r->db, 1000);
+	r->mdfs = mdfs;
+	pthread_mutex_lock(&mdfs->lock);
+	r->next = mdfs->readers;
+	mdfs->readers = r;
+	pthread_mutex_unlock(&mdfs->lock);
+	return r;
+}
+
+/* Open the connections of the first threads before the snapshot is held, so
+ * they are on it too
+ */
+static void db_readers_open(metadatafs *mdfs)
+{
+	int i;
+
+	for (i = 0; i < DB_READERS; i++)
+	{
+		if (!db_reader_open(mdfs))
+			break;
+	}
+}
+
+/* The thread is gone, its connection is left for the next one. Its
+ * statements are finalized here as no other thread can touch it
+ */
+static void db_reader_free(void *data)
+{
+	Mdfs_Reader *r = data;
+	Mdfs_Reader **prev;
+	Mdfs_Reader *tmp;
+	int idle = 0;
+
+	mdfs_stmt_cache_free(r->db);
+	pthread_mutex_lock(&r->mdfs->lock);
+	r->used = 0;
+	for (tmp = r->mdfs->readers; tmp; tmp = tmp->next)
+	{
+		if (!tmp->used)
+			idle++;
+	}
+	if (idle <= DB_READERS)
+	{
+		pthread_mutex_unlock(&r->mdfs->lock);
+		return;
+	}
+	for (prev = &r->mdfs->readers; *prev; prev = &(*prev)->next)
+	{
+		if (*prev == r)
+		{
+			*prev = r->next;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&r->mdfs->lock);
+	db_cleanup(r->db);
+	free(r);
+}
+
+/* The connection the calling thread serves the requests from, taken on its
+ * first request from the ones left by other threads or opened then. Only
+ * this thread uses it, so neither it nor its statements are shared with the
+ * rest. Must be called with the snapshot lock held
+ */
+static sqlite3 * db_reader(metadatafs *mdfs)
+{
+	Mdfs_Reader *r;
+	Mdfs_Reader *tmp;
+
+	r = pthread_getspecific(mdfs->reader);
+	if (!r)
+	{
+		/* better one on the snapshot if there is one */
+		pthread_mutex_lock(&mdfs->lock);
+		for (tmp = mdfs->readers; tmp; tmp = tmp->next)
+		{
+			if (tmp->used)
+				continue;
+			if (!r || tmp->snapshot == mdfs->snapshot)
+				r = tmp;
+			if (tmp->snapshot == mdfs->snapshot)
+				break;
+		}
+		if (r)
+			r->used = 1;
+		pthread_mutex_unlock(&mdfs->lock);
+		if (!r)
+		{
+			r = db_reader_open(mdfs);
+			if (!r)
+				return mdfs->rdb;
+			r->used = 1;
+		}
+		pthread_setspecific(mdfs->reader, r);
+	}
+	/* opened once the scan started, it would see it half done */
+	if (mdfs->snapshot && !r->snapshot)
+		return mdfs->rdb;
+	return r->db;
+}
+
+/* Keep serving the catalog as it is right now until db_snapshot_release(),
+ * whatever is written to it meanwhile. With the write ahead log the read
+ * transaction holds no lock against the writer. The threads whose connection
+ * is opened later, once those opened before are taken, share the one of the
+ * snapshot
+ */
+static void db_snapshot_hold(metadatafs *mdfs)
+{
+	Mdfs_Reader *r;
+
+	pthread_rwlock_wrlock(&mdfs->snapshot_lock);
+	/* the snapshot starts on the first read */
+	if (!mdfs->snapshot && sqlite3_exec(mdfs->rdb,
+			"BEGIN; SELECT COUNT(*) FROM info;",
+			NULL, NULL, NULL) == SQLITE_OK)
+	{
+		mdfs->snapshot = 1;
+		pthread_mutex_lock(&mdfs->lock);
+		for (r = mdfs->readers; r; r = r->next)
+		{
+			if (sqlite3_exec(r->db,
+					"BEGIN; SELECT COUNT(*) FROM info;",
+					NULL, NULL, NULL) == SQLITE_OK)
+				r->snapshot = 1;
+		}
+		pthread_mutex_unlock(&mdfs->lock);
+	}
+	pthread_rwlock_unlock(&mdfs->snapshot_lock);
+}
+
+/* serve everything written since the snapshot was taken, at once */
+static void db_snapshot_release(metadatafs *mdfs)
+{
+	Mdfs_Reader *r;
+
+	pthread_rwlock_wrlock(&mdfs->snapshot_lock);
+	if (mdfs->snapshot)
+	{
+		sqlite3_exec(mdfs->rdb, "COMMIT;", NULL, NULL, NULL);
+		pthread_mutex_lock(&mdfs->lock);
+		for (r = mdfs->readers; r; r = r->next)
+		{
+			if (!r->snapshot)
+				continue;
+			sqlite3_exec(r->db, "COMMIT;", NULL, NULL, NULL);
+			r->snapshot = 0;
+		}
+		pthread_mutex_unlock(&mdfs->lock);
+		mdfs->snapshot = 0;
+	}
+	pthread_rwlock_unlock(&mdfs->snapshot_lock);
+}
+
+/* While the snapshot is held the write ahead log can not be restarted and
+ * grows with everything written meanwhile. Moving it to what is cataloged
+ * right now lets the log start again, at the cost of serving the scan half
+ * done
+ */
+void metadatafs_snapshot_refresh(metadatafs *mdfs)
+{
+	if (!mdfs->snapshot)
+		return;
+	db_snapshot_release(mdfs);
+	mdfs_writer_wal_restart(mdfs->writer);
+	db_snapshot_hold(mdfs);
+}
+
+static int db_tables_init(sqlite3 *db)
+{
+	if (!mdfs_artist_init(db)) return 0;
+	if (!mdfs_album_init(db)) return 0;
+	if (!mdfs_title_init(db)) return 0;
+	if (!mdfs_file_init(db)) return 0;
+	if (!mdfs_dir_init(db)) return 0;
+	if (!mdfs_checkpoint_init(db)) return 0;
+	return 1;
+}
+
+/* a new catalog, nothing to migrate */
+static int db_empty(sqlite3 *db)
 {
-	char *str;
+	sqlite3_stmt *stmt;
+	int empty = 1;
+
+	if (sqlite3_prepare_v2(db, "SELECT 1 FROM sqlite_master WHERE "
+			"type = 'table' AND name = 'files';", -1, &stmt,
+			NULL) != SQLITE_OK)
+		return 0;
+	if (sqlite3_step(stmt) == SQLITE_ROW)
+		empty = 0;
+	sqlite3_finalize(stmt);
+	return empty;
+}
+
+/* what the lookups and the joins of the queries go through */
+static int db_indexes_init(sqlite3 *db)
+{
+	if (!mdfs_album_indexes_init(db)) return 0;
+	if (!mdfs_title_indexes_init(db)) return 0;
+	if (!mdfs_file_indexes_init(db)) return 0;
+	return 1;
+}
+
+/* Create a catalog in memory to be filled from scratch. Nothing is journaled
+ * and the indexes are left for db_memory_commit(), if we die it is just lost
+ */
+static sqlite3 * db_memory_setup(metadatafs *mdfs)
+{
+	sqlite3 *db;
 	sqlite3_stmt *stmt;
 	const char *tail;
-	int error;
+	char *str;
+	int page_size = 0;
 
-	str = sqlite3_mprintf("SELECT mtime FROM files WHERE file = '%q'", file);
-	/* check if the file exists if so check the mtime and compare */
-	error = sqlite3_prepare(db, str, -1, &stmt, &tail);
-	sqlite3_free(str);
-	if (error != SQLITE_OK)
+	if (sqlite3_open(":memory:", &db) != SQLITE_OK)
 	{
-		printf("1 error file %s\n", file);
-		return 1;
+		printf("could not open the memory db\n");
+		return NULL;
 	}
-	if (sqlite3_step(stmt) != SQLITE_ROW)
+	/* the backup can not change the page size of the catalog on disk */
+	if (sqlite3_prepare(mdfs->db, "PRAGMA page_size;", -1, &stmt,
+			&tail) == SQLITE_OK)
 	{
-		return 1;
+		if (sqlite3_step(stmt) == SQLITE_ROW)
+			page_size = sqlite3_column_int(stmt, 0);
+		sqlite3_finalize(stmt);
 	}
-	else
+	str = sqlite3_mprintf("PRAGMA page_size=%d; PRAGMA journal_mode=OFF; "
+			"PRAGMA synchronous=OFF;", page_size);
+	sqlite3_exec(db, str, NULL, NULL, NULL);
+	sqlite3_free(str);
+	if (!mdfs_info_init(db) || !db_tables_init(db))
 	{
-		time_t dbtime;
+		db_cleanup(db);
+		return NULL;
+	}
+	return db;
+}
 
-		dbtime = sqlite3_column_int(stmt, 0);
-		sqlite3_finalize(stmt);
-		if (dbtime < mtime)
-			return 1;
-		else
-			return 0;
+/* replace the catalog on disk with the one built on db, on a single
+ * transaction
+ */
+static int db_memory_commit(metadatafs *mdfs, sqlite3 *db)
+{
+	sqlite3_backup *backup;
+	int error;
+
+	if (!db_indexes_init(db))
+		return 0;
+	mdfs_info_update(db, mdfs->info);
+	backup = sqlite3_backup_init(mdfs->db, "main", db, "main");
+	if (!backup)
+	{
+		printf("could not replace the catalog: %s\n",
+				sqlite3_errmsg(mdfs->db));
+		return 0;
+	}
+	while ((error = sqlite3_backup_step(backup, -1)) == SQLITE_BUSY ||
+			error == SQLITE_LOCKED)
+		usleep(1000);
+	sqlite3_backup_finish(backup);
+	if (error != SQLITE_DONE)
+	{
+		printf("could not replace the catalog: %s\n",
+				sqlite3_errmsg(mdfs->db));
+		return 0;
 	}
+	return 1;
 }
 
 static int db_setup(metadatafs *mdfs)
@@ -451,206 +733,307 @@ static int db_setup(metadatafs *mdfs)
 		printf("could not open the db\n");
 		return 0;
 	}
+	/* the readers must not wait for the writer nor the other way around */
+	sqlite3_exec(mdfs->db, "PRAGMA journal_mode=WAL;", NULL, NULL, NULL);
 	if (!mdfs_info_init(mdfs->db)) return 0;
 	mdfs->info = mdfs_info_load(mdfs->db);
 	if (!mdfs->info)
 	{
-		mdfs->info = mdfs_info_new(0, mdfs->basepath);
+		mdfs->info = mdfs_info_new(db_empty(mdfs->db) ?
+				MDFS_SCHEMA_VERSION : 0, mdfs->basepath);
 		mdfs_info_update(mdfs->db, mdfs->info);
 	}
-	/* TODO once the info is loaded handle the migration */
-	if (!mdfs_artist_init(mdfs->db)) return 0;
-	if (!mdfs_album_init(mdfs->db)) return 0;
-	if (!mdfs_title_init(mdfs->db)) return 0;
-	if (!mdfs_file_init(mdfs->db)) return 0;
+	if (!db_tables_init(mdfs->db)) return 0;
+	/* a catalog of a previous version is brought to the current one */
+	if (!mdfs_schema_migrate(mdfs->db, mdfs->info)) return 0;
+	if (!db_indexes_init(mdfs->db)) return 0;
+
+	if (sqlite3_open_v2(dbfilename, &mdfs->rdb, SQLITE_OPEN_READONLY,
+			NULL) != SQLITE_OK)
+	{
+		printf("could not open the db for reading\n");
+		return 0;
+	}
+	sqlite3_busy_timeout(mdfs->rdb, 1000);
 
 	return 1;
 }
 /******************************************************************************
  *                               metadatafs                                   *
  ******************************************************************************/
-static void _scan(metadatafs *mdfs, const char *path)
+/* examine the files of the manifest if we have one or walk the whole tree
+ * otherwise, the manifest is only used once
+ */
+static int _walk(metadatafs *mdfs, int verify)
 {
-	DIR *dp;
-	struct dirent *de;
-
-	dp = opendir(path);
-	if (!dp)
-	{
-		printf("cannot scan dir\n");
-		return;
-	}
-
-	while ((de = readdir(dp)) != NULL)
-	{
-		char realfile[PATH_MAX];
-		struct stat st;
-
-		if (!strcmp(de->d_name, ".") || !strcmp(de->d_name, ".."))
-			continue;
+	int ret;
 
-		/* also check subdirs */
-		strncpy(realfile, path, PATH_MAX);
-		strncat(realfile, "/", PATH_MAX - strlen(de->d_name));
-		strncat(realfile, de->d_name, PATH_MAX - strlen(de->d_name));
+	if (!mdfs->manifest_file)
+		return mdfs_scanner_run(mdfs->scan, mdfs->basepath, verify);
+	printf("reading the files of %s from the manifest %s\n",
+			mdfs->basepath, mdfs->manifest);
+	ret = mdfs_scanner_manifest(mdfs->scan, mdfs->manifest_file, verify);
+	fclose(mdfs->manifest_file);
+	mdfs->manifest_file = NULL;
+	return ret;
+}
 
-		if (stat(realfile, &st) < 0)
-		{
-			printf("err on stat %d %s\n", errno, realfile);
-			continue;
-		}
+/* Build the catalog from scratch on memory and replace the one on disk with
+ * it once done, the load is bounded by the parsing and not by the journal.
+ * An interrupted rebuild is lost, the catalog on disk is left untouched
+ */
+static int _rebuild(metadatafs *mdfs, time_t now)
+{
+	Mdfs_Info old = *mdfs->info;
+	sqlite3 *db;
+	int ret;
 
-		if (S_ISDIR(st.st_mode))
-		{
-			_scan(mdfs, realfile);
-		}
-		else if (S_ISREG(st.st_mode))
-		{
-			Mdfs_Artist *artist;
-			Mdfs_Title *title;
-			Mdfs_File *file;
-			Mdfs_Album *album;
-			int id;
-			char *str;
-			void *handle;
+	db = db_memory_setup(mdfs);
+	if (!db)
+		return 0;
+	mdfs->info->generation++;
+	mdfs->info->verified = now;
+	mdfs_writer_db_set(mdfs->writer, db);
+	mdfs_writer_generation_set(mdfs->writer, mdfs->info->generation);
+	printf("rebuilding the catalog of %s with %u threads\n",
+			mdfs->basepath, mdfs->scan_threads);
+	ret = _walk(mdfs, 1);
+	mdfs_writer_db_set(mdfs->writer, mdfs->db);
+	if (ret)
+		ret = db_memory_commit(mdfs, db);
+	db_cleanup(db);
+	if (!ret)
+	{
+		mdfs->info->generation = old.generation;
+		mdfs->info->verified = old.verified;
+	}
+	return ret;
+}
 
-			//printf("processing file %s\n", realfile);
-			if (!db_file_changed(mdfs->db, realfile, st.st_mtime))
-				continue;
+/* bring the catalog up to date with the source tree as found on mount */
+static void _scan_startup(metadatafs *mdfs)
+{
+	char **paths;
+	unsigned int count;
+	unsigned int i;
+	time_t now;
+	int verify = 0;
+	int ret;
 
-			/* FIXME move all of this into a function */
-			handle = libmetadatafs_open(realfile);
-			if (!handle) continue;
-
-			/* artist */
-			str = libmetadatafs_artist_get(handle);
-			artist = mdfs_artist_new(mdfs->db, str);
-			free(str);
-			if (!artist) goto end_artist;
-			/* album */
-			str = libmetadatafs_album_get(handle);
-			album = mdfs_album_new(mdfs->db, str, artist->id);
-			free(str);
-			if (!album) goto end_album;
-			/* title */
-			str = libmetadatafs_title_get(handle);
-			title = mdfs_title_new(mdfs->db, str, album->id);
-			free(str);
-			if (!title) goto end_title;
-
-			/* file */
-			file = mdfs_file_new(mdfs->db, realfile, st.st_mtime, title->id);
-			mdfs_title_free(title);
-end_title:
-			mdfs_album_free(album);
-end_album:
-			mdfs_artist_free(artist);
-end_artist:
-			libmetadatafs_close(handle);
-		}
+	now = time(NULL);
+	if (mdfs->rebuild)
+	{
+		ret = _rebuild(mdfs, now);
+		goto done;
+	}
+	/* an interrupted scan is continued with its own generation, unless
+	 * we are given the list of files
+	 */
+	paths = NULL;
+	if (!mdfs->manifest_file)
+		paths = mdfs_checkpoint_load(mdfs->db, mdfs->info->generation,
+				&count, &verify);
+	if (paths)
+	{
+		mdfs_writer_generation_set(mdfs->writer, mdfs->info->generation);
+		printf("resuming the scan of %s from %u directories with %u threads%s\n",
+				mdfs->basepath, count, mdfs->scan_threads,
+				verify ? " (full verify)" : "");
+		ret = mdfs_scanner_resume(mdfs->scan, paths, count, verify);
+		for (i = 0; i < count; i++)
+			free(paths[i]);
+		free(paths);
+		goto done;
 	}
-	closedir(dp);
+	/* examine every file from time to time, the directory tracking
+	 * does not catch files modified in place while we were not mounted
+	 */
+	verify = mdfs->full_verify || (mdfs->verify_interval &&
+			!mdfs->manifest_file &&
+			now - mdfs->info->verified >= mdfs->verify_interval);
+	/* everything seen on this scan gets a new generation */
+	mdfs->info->generation++;
+	mdfs_info_update(mdfs->db, mdfs->info);
+	mdfs_writer_generation_set(mdfs->writer, mdfs->info->generation);
+	printf("scanning %s with %u threads%s\n", mdfs->basepath,
+			mdfs->scan_threads, verify ? " (full verify)" : "");
+	ret = _walk(mdfs, verify);
+done:
+	if (ret && verify)
+	{
+		mdfs->info->verified = now;
+		mdfs_info_update(mdfs->db, mdfs->info);
+	}
+	/* whatever the result, the requests are served from the catalog as
+	 * it is from now on, an incomplete scan is finished by the next one
+	 */
+	db_snapshot_release(mdfs);
+	/* the log grew with the whole scan, nobody pins it anymore */
+	mdfs_writer_wal_restart(mdfs->writer);
+}
+
+/* walk the subtrees whose changes might have been missed, on a generation
+ * of their own
+ */
+static void _scan_subtrees(metadatafs *mdfs, char **paths, unsigned int count)
+{
+	mdfs->info->generation++;
+	mdfs_info_update(mdfs->db, mdfs->info);
+	mdfs_writer_generation_set(mdfs->writer, mdfs->info->generation);
+	printf("scanning %u directories of %s again\n", count,
+			mdfs->basepath);
+	mdfs_scanner_subtrees(mdfs->scan, paths, count);
 }
 
 static void * _scanner(void *data)
 {
 	metadatafs *mdfs = data;
 
-	printf("path = %p\n", mdfs->basepath);
-	_scan(mdfs, mdfs->basepath);
+	_scan_startup(mdfs);
+	/* then whatever the monitor asks for, one walk at a time */
+	pthread_mutex_lock(&mdfs->rescan_lock);
+	while (!mdfs->stopping)
+	{
+		char **paths;
+		unsigned int count;
+		unsigned int i;
+
+		if (!mdfs->nrescans)
+		{
+			pthread_cond_wait(&mdfs->rescan_cond, &mdfs->rescan_lock);
+			continue;
+		}
+		paths = mdfs->rescans;
+		count = mdfs->nrescans;
+		mdfs->rescans = NULL;
+		mdfs->nrescans = 0;
+		pthread_mutex_unlock(&mdfs->rescan_lock);
+
+		_scan_subtrees(mdfs, paths, count);
+		for (i = 0; i < count; i++)
+			free(paths[i]);
+		free(paths);
+		pthread_mutex_lock(&mdfs->rescan_lock);
+	}
+	pthread_mutex_unlock(&mdfs->rescan_lock);
 	return NULL;
 }
 
-
-static void metadatafs_scan(metadatafs *mdfs)
+static int _path_under(const char *path, const char *dir)
 {
-	int ret;
-	pthread_attr_t attr;
+	size_t len = strlen(dir);
 
-	ret = pthread_attr_init(&attr);
-	if (ret) {
-		perror("pthread_attr_init");
-		return;
-	}
-
-	ret = pthread_create(&mdfs->scanner, &attr, _scanner, mdfs);
-	if (ret) {
-		perror("pthread_create");
-		return;
-	}
+	return !strncmp(path, dir, len) && (!path[len] || path[len] == '/');
 }
 
-#if HAVE_INOTIFY
-static void * _monitor(void *data)
+/* Walk again a source directory and everything under it once the scanner is
+ * idle, for when its changes might have been missed. A directory already
+ * requested or under one is walked once
+ */
+void metadatafs_rescan(metadatafs *mdfs, const char *path)
 {
-	metadatafs *mfs = data;
+	unsigned int i;
 
-	printf("starting the monitor\n");
-	mfs->inotify_fd = inotify_init();
-	if (mfs->inotify_fd < 0)
+	pthread_mutex_lock(&mdfs->rescan_lock);
+	for (i = 0; i < mdfs->nrescans; i++)
 	{
-		printf("error initializing inotify\n");
-		return NULL;
+		if (_path_under(path, mdfs->rescans[i]))
+			goto done;
 	}
-	mfs->inotify_wd = inotify_add_watch(mfs->inotify_fd, mfs->basepath, IN_MODIFY | IN_CREATE | IN_DELETE);
-	//mfs->inotify_wd = inotify_add_watch(mfs->inotify_fd, mfs->basepath, IN_ALL_EVENTS);
-	if (mfs->inotify_wd < 0)
+	for (i = 0; i < mdfs->nrescans; )
 	{
-		printf("error adding the watch\n");
-		return NULL;
-	}
-	while (1)
-	{
-		char buf[BUF_LEN];
-		int len, i = 0;
-
-		len = read(mfs->inotify_fd, buf, BUF_LEN);
-		while (i < len)
+		if (_path_under(mdfs->rescans[i], path))
 		{
-			struct inotify_event *event;
-
-		        event = (struct inotify_event *) &buf[i];
-			printf("wd=%d mask=%u (%d %d %d) cookie=%u len=%u\n",
-        	        	event->wd, event->mask, IN_MODIFY, IN_CREATE, IN_DELETE,
-	                	event->cookie, event->len);
-
-        		if (event->len)
-		                printf ("name=%s\n", event->name);
-
-		        i += EVENT_SIZE + event->len;
+			free(mdfs->rescans[i]);
+			mdfs->rescans[i] = mdfs->rescans[--mdfs->nrescans];
+			continue;
 		}
+		i++;
 	}
-	//inotify_rm_watch(mfs->inotify_fd, mfs->inotify_wd);
-	//close(mfs->inotify_fd);
+	mdfs->rescans = realloc(mdfs->rescans,
+			sizeof(char *) * (mdfs->nrescans + 1));
+	mdfs->rescans[mdfs->nrescans++] = strdup(path);
+	pthread_cond_signal(&mdfs->rescan_cond);
+done:
+	pthread_mutex_unlock(&mdfs->rescan_lock);
 }
 
-static void metadatafs_monitor(metadatafs *mdfs)
+
+static void metadatafs_scan(metadatafs *mdfs)
 {
 	int ret;
 	pthread_attr_t attr;
 
+	mdfs->scan = mdfs_scanner_new(mdfs, mdfs->scan_threads);
+	if (!mdfs->scan)
+		return;
+
 	ret = pthread_attr_init(&attr);
 	if (ret) {
 		perror("pthread_attr_init");
 		return;
 	}
 
-	ret = pthread_create(&mdfs->monitor, &attr, _monitor, mdfs);
+	ret = pthread_create(&mdfs->scanner, &attr, _scanner, mdfs);
 	if (ret) {
 		perror("pthread_create");
 		return;
 	}
 }
-#endif
 
-static void metadatafs_destroy(metadatafs *mdfs)
+/* unmounted, stop whatever uses the catalog and close it */
+static void metadatafs_destroy(void *data)
 {
-	db_cleanup(mdfs->db);
+	metadatafs *mdfs = data;
+	Mdfs_Reader *r;
+
+	if (!mdfs)
+		return;
+	/* let the scanner stop on its own, it leaves a checkpoint behind */
+	if (mdfs->scanner)
+	{
+		pthread_mutex_lock(&mdfs->rescan_lock);
+		mdfs->stopping = 1;
+		pthread_cond_signal(&mdfs->rescan_cond);
+		pthread_mutex_unlock(&mdfs->rescan_lock);
+		mdfs_scanner_cancel(mdfs->scan);
+		pthread_join(mdfs->scanner, NULL);
+		mdfs->scanner = 0;
+	}
+#if HAVE_INOTIFY
+	if (mdfs->monitor)
+		mdfs_monitor_free(mdfs->monitor);
+	mdfs->monitor = NULL;
+#endif
+	if (mdfs->scan)
+		mdfs_scanner_free(mdfs->scan);
+	mdfs->scan = NULL;
+	if (mdfs->writer)
+		mdfs_writer_free(mdfs->writer);
+	mdfs->writer = NULL;
+	/* the threads still around keep their connection until now */
+	pthread_key_delete(mdfs->reader);
+	while ((r = mdfs->readers))
+	{
+		mdfs->readers = r->next;
+		db_cleanup(r->db);
+		free(r);
+	}
+	if (mdfs->rdb)
+		db_cleanup(mdfs->rdb);
+	mdfs->rdb = NULL;
+	if (mdfs->db)
+		db_cleanup(mdfs->db);
+	mdfs->db = NULL;
+	if (mdfs->info)
+		mdfs_info_free(mdfs->info);
+	mdfs->info = NULL;
 }
 
 static metadatafs * metadatafs_new(char *path)
 {
 	metadatafs *mdfs;
+	size_t len;
 	int ret;
 
 	mdfs = calloc(1, sizeof(metadatafs));
@@ -660,27 +1043,184 @@ static metadatafs * metadatafs_new(char *path)
 		free(mdfs);
 		return NULL;
 	}
+	pthread_rwlock_init(&mdfs->snapshot_lock, NULL);
+	pthread_key_create(&mdfs->reader, db_reader_free);
+	pthread_mutex_init(&mdfs->rescan_lock, NULL);
+	pthread_cond_init(&mdfs->rescan_cond, NULL);
+	/* the paths are built as basepath/name, with no trailing slashes */
 	mdfs->basepath = strdup(path);
+	len = strlen(mdfs->basepath);
+	while (len > 1 && mdfs->basepath[len - 1] == '/')
+		mdfs->basepath[--len] = '\0';
+	/* default options */
+	mdfs->scan_threads = sysconf(_SC_NPROCESSORS_ONLN);
+	mdfs->batch_size = 5000;
+	mdfs->batch_time = 200;
+	mdfs->verify_interval = 7 * 24 * 60 * 60;
+	mdfs->monitor_delay = 500;
+	mdfs->checkpoint_interval = 30;
+	mdfs->uring_depth = 256;
+	mdfs->scan_yield = 5;
 
 	return mdfs;
 }
 
+/* the threads and the catalog are gone with metadatafs_destroy() */
 static void metadatafs_free(metadatafs *mdfs)
 {
-	if (mdfs->scanner)
+	pthread_rwlock_destroy(&mdfs->snapshot_lock);
+	while (mdfs->nrescans)
+		free(mdfs->rescans[--mdfs->nrescans]);
+	free(mdfs->rescans);
+	pthread_mutex_destroy(&mdfs->rescan_lock);
+	pthread_cond_destroy(&mdfs->rescan_cond);
+	free(mdfs->scan_order);
+	free(mdfs->monitor_backend);
+	free(mdfs->manifest);
+	if (mdfs->manifest_file)
+		fclose(mdfs->manifest_file);
+	free(mdfs->basepath);
+	free(mdfs);
+}
+/******************************************************************************
+ *                                 Control                                    *
+ ******************************************************************************/
+/* a hidden directory on the root with virtual files about ourselves */
+#define METADATAFS_CONTROL "/.metadatafs"
+#define METADATAFS_CONTROL_SCAN METADATAFS_CONTROL "/scan"
+#define METADATAFS_CONTROL_HINT METADATAFS_CONTROL "/hint"
+
+/* Scan a source directory before the rest. The path can be relative to the
+ * source directory and if it is a file its directory is used. Nothing is
+ * looked up on the disk unless the scanner is walking
+ */
+static int _control_hint(metadatafs *mdfs, const char *path, int subdirs)
+{
+	char tmp[PATH_MAX];
+	char real[PATH_MAX];
+	char base[PATH_MAX];
+	struct stat st;
+	size_t len;
+
+	if (!mdfs->scan || !mdfs_scanner_walking(mdfs->scan))
+		return 0;
+	if (*path == '/')
+		strncpy(tmp, path, PATH_MAX);
+	else
+		snprintf(tmp, PATH_MAX, "%s/%s", mdfs->basepath, path);
+	tmp[PATH_MAX - 1] = '\0';
+	/* no way out of the source directory through .. or a link */
+	if (!realpath(tmp, real) || !realpath(mdfs->basepath, base))
+		return 0;
+	if (!_path_under(real, base))
+		return 0;
+	if (stat(real, &st) < 0)
+		return 0;
+	len = strlen(real);
+	if (!S_ISDIR(st.st_mode))
 	{
-		pthread_cancel(mdfs->scanner);
-		pthread_join(mdfs->scanner, NULL);
+		char *name;
+
+		name = strrchr(real, '/');
+		if (!name || name == real)
+			return 0;
+		*name = '\0';
+		len = name - real;
 	}
-#if HAVE_INOTIFY
-	if (mdfs->monitor)
+	/* the scanner walks the paths as they are under the source directory */
+	if (len < strlen(base))
+		return 0;
+	snprintf(tmp, PATH_MAX, "%s%s", mdfs->basepath, real + strlen(base));
+	return mdfs_scanner_hint(mdfs->scan, tmp, subdirs);
+}
+
+/* the contents of the scan progress file, one "key: value" per line */
+static char * _control_scan(metadatafs *mdfs)
+{
+	Mdfs_Scanner_Stats s;
+	char str[1024];
+	char eta[32];
+
+	if (!mdfs->scan)
+		return strdup("state: idle\n");
+	mdfs_scanner_stats_get(mdfs->scan, &s);
+	if (s.eta < 0)
+		strcpy(eta, "unknown");
+	else
+		snprintf(eta, sizeof(eta), "%.0f", s.eta);
+	snprintf(str, sizeof(str),
+			"state: %s\n"
+			"elapsed: %.1f\n"
+			"directories: %lu\n"
+			"directories_unchanged: %lu\n"
+			"files: %lu\n"
+			"files_parsed: %lu\n"
+			"files_unchanged: %lu\n"
+			"files_moved: %lu\n"
+			"files_failed: %lu\n"
+			"files_expected: %lu\n"
+			"bytes: %llu\n"
+			"rate: %.1f\n"
+			"eta: %s\n",
+			s.running ? "running" : (s.elapsed > 0 ? "done" : "idle"),
+			s.elapsed, s.directories, s.skipped, s.seen, s.parsed,
+			s.unchanged, s.moved, s.failed, s.expected, s.bytes, s.rate,
+			eta);
+	return strdup(str);
+}
+
+static int _control_getattr(metadatafs *mdfs, const char *path,
+		struct stat *stbuf)
+{
+	char *str;
+
+	if (!strcmp(path, METADATAFS_CONTROL))
 	{
-		pthread_cancel(mdfs->monitor);
-		pthread_join(mdfs->monitor, NULL);
+		stbuf->st_mode = S_IFDIR | 0555;
+		stbuf->st_nlink = 2;
+		return 0;
 	}
-#endif
-	free(mdfs->basepath);
-	free(mdfs);
+	if (!strcmp(path, METADATAFS_CONTROL_SCAN))
+	{
+		str = _control_scan(mdfs);
+		stbuf->st_mode = S_IFREG | 0444;
+		stbuf->st_nlink = 1;
+		stbuf->st_size = strlen(str);
+		free(str);
+		return 0;
+	}
+	if (!strcmp(path, METADATAFS_CONTROL_HINT))
+	{
+		stbuf->st_mode = S_IFREG | 0222;
+		stbuf->st_nlink = 1;
+		return 0;
+	}
+	return -ENOENT;
+}
+
+/* every line written is a path to hint */
+static int _control_hint_write(metadatafs *mdfs, const char *buf, size_t size)
+{
+	const char *end = buf + size;
+
+	while (buf < end)
+	{
+		char path[PATH_MAX];
+		const char *nl;
+		size_t len;
+
+		nl = memchr(buf, '\n', end - buf);
+		len = (nl ? nl : end) - buf;
+		if (len && len < PATH_MAX)
+		{
+			memcpy(path, buf, len);
+			path[len] = '\0';
+			if (!_control_hint(mdfs, path, 1))
+				printf("hint %s not taken\n", path);
+		}
+		buf += len + 1;
+	}
+	return size;
 }
 /******************************************************************************
  *                                   FUSE                                     *
@@ -694,9 +1234,11 @@ static int metadatafs_readlink(const char *path, char *buf, size_t size)
 	size_t len;
 	metadatafs *mdfs;
 	struct fuse_context *ctx;
+	sqlite3 *db;
 
 	ctx = fuse_get_context();
 	mdfs = ctx->private_data;
+	db = db_reader(mdfs);
 
 	/* FIXME get the last entry on the path */
 	for (tmp = path + strlen(path); tmp >= path; tmp--)
@@ -707,12 +1249,14 @@ static int metadatafs_readlink(const char *path, char *buf, size_t size)
 			break;
 		}
 	}
-	file = mdfs_file_get_from_id(mdfs->db, atoi(tmp));
+	file = mdfs_file_get_from_id(db, atoi(tmp));
 	if (!file)
 		return -ENOENT;
 
 	strncpy(buf, file->path, size);
 	buf[size - 1] = '\0';
+	/* whoever follows the link will probably look at its neighbours */
+	_control_hint(mdfs, file->path, 0);
 	mdfs_file_free(file);
 
 	return 0;
@@ -726,10 +1270,18 @@ static int metadatafs_readdir(const char *path, void *buf, fuse_fill_dir_t fille
 	int ret;
 	metadatafs *mdfs;
 	struct fuse_context *ctx;
+	sqlite3 *db;
 
 	ctx = fuse_get_context();
 	mdfs = ctx->private_data;
+	db = db_reader(mdfs);
 
+	if (!strcmp(path, METADATAFS_CONTROL))
+	{
+		filler(buf, "scan", NULL, 0);
+		filler(buf, "hint", NULL, 0);
+		goto end;
+	}
 	tmp = strdup(path);
 	ret = _path_to_query(tmp, &q);
 	free(tmp);
@@ -747,6 +1299,8 @@ static int metadatafs_readdir(const char *path, void *buf, fuse_fill_dir_t fille
 
 		if (q.fields & MASK_FILES)
 			goto end;
+		if (!q.fields)
+			filler(buf, METADATAFS_CONTROL + 1, NULL, 0);
 
 		/* invert the flags found on the path */
 		f = ~q.fields & ((1 << FIELDS) - 1);
@@ -766,21 +1320,16 @@ static int metadatafs_readdir(const char *path, void *buf, fuse_fill_dir_t fille
 	else
 	{
 		sqlite3_stmt *stmt;
-		const char *tail;
-		int error;
-		char *query;
 
-		query = _query_to_string(&q);
-		error = sqlite3_prepare(mdfs->db, query, -1, &stmt, &tail);
-		free(query);
-		if (error != SQLITE_OK)
+		stmt = _query_stmt(db, &q);
+		if (!stmt)
 		{
 			return -ENOENT;
 		}
 		if (sqlite3_step(stmt) != SQLITE_ROW)
 		{
+			mdfs_stmt_put(db, _query_key(&q), stmt);
 			return -ENOENT;
-			sqlite3_finalize(stmt);
 		}
 
 		if (q.last_field == FIELD_FILES)
@@ -807,7 +1356,7 @@ static int metadatafs_readdir(const char *path, void *buf, fuse_fill_dir_t fille
 					break;
 			} while (sqlite3_step(stmt) == SQLITE_ROW);
 		}
-		sqlite3_finalize(stmt);
+		mdfs_stmt_put(db, _query_key(&q), stmt);
 	}
 end:
 	/* add simple '.' and '..' files */
@@ -821,12 +1370,14 @@ static int metadatafs_getattr(const char *path, struct stat *stbuf)
 {
 	struct fuse_context *ctx;
 	metadatafs *mdfs;
+	sqlite3 *db;
 	char *file;
 	int field = 0;
 	int i;
 
 	ctx = fuse_get_context();
 	mdfs = ctx->private_data;
+	db = db_reader(mdfs);
 
 	memset(stbuf, 0, sizeof(struct stat));
 	/* simplest case */
@@ -836,6 +1387,8 @@ static int metadatafs_getattr(const char *path, struct stat *stbuf)
 		stbuf->st_nlink = 2;
 		return 0;
 	}
+	if (!strncmp(path, METADATAFS_CONTROL, strlen(METADATAFS_CONTROL)))
+		return _control_getattr(mdfs, path, stbuf);
 	/* first check if the last entry is a field */
 	file = _get_last_delim(path, path + strlen(path), '/');
 	for (i = 0; i < FIELDS; i++)
@@ -861,7 +1414,7 @@ static int metadatafs_getattr(const char *path, struct stat *stbuf)
 		{
 			Mdfs_File *f;
 
-			f = mdfs_file_get_from_id(mdfs->db, atoi(file));
+			f = mdfs_file_get_from_id(db, atoi(file));
 			if (!f) return -ENOENT;
 			mdfs_file_free(f);
 			stbuf->st_mode = S_IFLNK | 0644;
@@ -872,7 +1425,7 @@ static int metadatafs_getattr(const char *path, struct stat *stbuf)
 		case FIELD_ALBUM:
 		{
 			Mdfs_Album *album;
-			album = mdfs_album_get_from_name(mdfs->db, file);
+			album = mdfs_album_get_from_name(db, file);
 			if (!album) return -ENOENT;
 			mdfs_album_free(album);
 		}
@@ -881,7 +1434,7 @@ static int metadatafs_getattr(const char *path, struct stat *stbuf)
 		case FIELD_ARTIST:
 		{
 			Mdfs_Artist *artist;
-			artist = mdfs_artist_get(mdfs->db, file);
+			artist = mdfs_artist_get(db, file);
 			if (!artist) return -ENOENT;
 			mdfs_artist_free(artist);
 		}
@@ -893,7 +1446,7 @@ static int metadatafs_getattr(const char *path, struct stat *stbuf)
 		case FIELD_TITLE:
 		{
 			Mdfs_Title *title;
-			title = mdfs_title_get_from_name(mdfs->db, file);
+			title = mdfs_title_get_from_name(db, file);
 			if (!title) return -ENOENT;
 			mdfs_title_free(title);
 		}
@@ -908,12 +1461,73 @@ static int metadatafs_getattr(const char *path, struct stat *stbuf)
 
 static int metadatafs_open(const char *path, struct fuse_file_info *fi)
 {
+	struct fuse_context *ctx;
+	metadatafs *mdfs;
+
+	ctx = fuse_get_context();
+	mdfs = ctx->private_data;
+
+	fi->fh = 0;
+	if (!strcmp(path, METADATAFS_CONTROL_SCAN))
+	{
+		if ((fi->flags & O_ACCMODE) != O_RDONLY)
+			return -EACCES;
+		/* keep what was opened, every open gets a new snapshot */
+		fi->fh = (uintptr_t)_control_scan(mdfs);
+		fi->direct_io = 1;
+	}
+	else if (!strcmp(path, METADATAFS_CONTROL_HINT))
+	{
+		if ((fi->flags & O_ACCMODE) != O_WRONLY)
+			return -EACCES;
+		fi->direct_io = 1;
+	}
 	return 0;
 }
 
 static int metadatafs_read(const char *path, char *buf, size_t size, off_t offset,
 		struct fuse_file_info *fi)
 {
+	const char *str = (const char *)(uintptr_t)fi->fh;
+	size_t len;
+
+	if (!str)
+		return 0;
+	len = strlen(str);
+	if (offset >= len)
+		return 0;
+	if (size > len - offset)
+		size = len - offset;
+	memcpy(buf, str + offset, size);
+	return size;
+}
+
+static int metadatafs_write(const char *path, const char *buf, size_t size,
+		off_t offset, struct fuse_file_info *fi)
+{
+	struct fuse_context *ctx;
+	metadatafs *mdfs;
+
+	ctx = fuse_get_context();
+	mdfs = ctx->private_data;
+
+	if (!strcmp(path, METADATAFS_CONTROL_HINT))
+		return _control_hint_write(mdfs, buf, size);
+	return -EACCES;
+}
+
+/* only needed for the shell redirections on the control files */
+static int metadatafs_truncate(const char *path, off_t size)
+{
+	if (!strcmp(path, METADATAFS_CONTROL_HINT))
+		return 0;
+	return -EACCES;
+}
+
+static int metadatafs_release(const char *path, struct fuse_file_info *fi)
+{
+	free((char *)(uintptr_t)fi->fh);
+	fi->fh = 0;
 	return 0;
 }
 
@@ -945,46 +1559,28 @@ int metadatafs_mkdir(const char *name, mode_t mode)
 	switch (query.last_field)
 	{
 		case FIELD_ARTIST:
-		{
-			Mdfs_Artist *artist;
-
-			artist = mdfs_artist_new(mdfs->db, query.entries[FIELD_ARTIST]);
-			mdfs_artist_free(artist);
-		}
+		ret = mdfs_writer_category_add(mdfs->writer,
+				query.entries[FIELD_ARTIST], NULL, NULL);
 		break;
 
 		case FIELD_ALBUM:
-		{
-			Mdfs_Album *album;
-			Mdfs_Artist *artist;
-
-			if (!(query.fields & MASK_ARTIST)) return -EINVAL;
-			artist = mdfs_artist_get(mdfs->db, query.entries[FIELD_ARTIST]);
-			if (!artist) return -EINVAL;
-			album = mdfs_album_new(mdfs->db, query.entries[FIELD_ALBUM], artist->id);
-			mdfs_artist_free(artist);
-			mdfs_album_free(album);
-		}
+		if (!(query.fields & MASK_ARTIST)) return -EINVAL;
+		ret = mdfs_writer_category_add(mdfs->writer,
+				query.entries[FIELD_ARTIST],
+				query.entries[FIELD_ALBUM], NULL);
 		break;
 
 		case FIELD_TITLE:
-		{
-			Mdfs_Album *album;
-			Mdfs_Title *title;
-
-			if (!(query.fields & MASK_ALBUM)) return -EINVAL;
-			album = mdfs_album_get_from_name(mdfs->db, query.entries[FIELD_ALBUM]);
-			if (!album) return -EINVAL;
-			title = mdfs_title_new(mdfs->db, query.entries[FIELD_TITLE], album->id);
-			mdfs_album_free(album);
-			mdfs_title_free(title);
-		}
+		if (!(query.fields & MASK_ALBUM)) return -EINVAL;
+		ret = mdfs_writer_category_add(mdfs->writer, NULL,
+				query.entries[FIELD_ALBUM],
+				query.entries[FIELD_TITLE]);
 		break;
 
 		default:
 		return -EINVAL;
 	}
-	return 0;
+	return ret ? 0 : -EINVAL;
 }
 
 /**
@@ -992,10 +1588,13 @@ int metadatafs_mkdir(const char *name, mode_t mode)
  */
 int metadatafs_rename(const char *orig, const char *dest)
 {
-	Mdfs_File *fsrc, *fdst;
+	Mdfs_File *file;
+	Mdfs_File **files = NULL;
+	unsigned int nfiles = 0;
 	metadatafs_mask new_mask = 0;
 	metadatafs_query src;
 	metadatafs_query dst;
+	sqlite3 *db;
 	char *tmp;
 	int ret;
 	int i;
@@ -1031,54 +1630,56 @@ int metadatafs_rename(const char *orig, const char *dest)
 				strcmp(src.entries[i], dst.entries[i]))
 			new_mask |= (1 << i);
 	}
-	/* now we can update the metadata */
+	/* the files are looked up first, their tags are written without the
+	 * snapshot held
+	 */
+	pthread_rwlock_rdlock(&mdfs->snapshot_lock);
+	db = db_reader(mdfs);
 	/* get the specific file */
 	if (src.last_field == FIELD_FILES)
 	{
-		Mdfs_File *file;
-		int id;
-
-		id = atoi(src.entries[FIELD_FILES]);
-		file = mdfs_file_get_from_id(mdfs->db, id);
-		_file_fields_update(mdfs, file, new_mask, &dst);
-		mdfs_file_free(file);
+		file = mdfs_file_get_from_id(db, atoi(src.entries[FIELD_FILES]));
+		if (file)
+		{
+			files = malloc(sizeof(Mdfs_File *));
+			files[nfiles++] = file;
+		}
 	}
 	/* get all the files */
 	else
 	{
 		sqlite3_stmt *stmt;
-		const char *tail;
-		int error;
-		char *query;
 
 		/* add to the query the files so we can fetch all the files matching the src query */
 		src.last_field = FIELD_FILES;
 		src.last_is_field = 1;
 
-		query = _query_to_string(&src);
-		error = sqlite3_prepare(mdfs->db, query, -1, &stmt, &tail);
-		free(query);
-		if (error != SQLITE_OK)
+		stmt = _query_stmt(db, &src);
+		while (stmt && sqlite3_step(stmt) == SQLITE_ROW)
 		{
-			return -ENOENT;
-		}
-		if (sqlite3_step(stmt) != SQLITE_ROW)
-		{
-			return -ENOENT;
-			sqlite3_finalize(stmt);
+			file = mdfs_file_get_from_id(db,
+					sqlite3_column_int(stmt, 0));
+			if (!file)
+				continue;
+			files = realloc(files, sizeof(Mdfs_File *) *
+					(nfiles + 1));
+			files[nfiles++] = file;
 		}
-		do
-		{
-				Mdfs_File *file;
-				int id;
-
-				id = sqlite3_column_int(stmt, 0);
-				file = mdfs_file_get_from_id(mdfs->db, id);
-				_file_fields_update(mdfs, file, new_mask, &dst);
-				mdfs_file_free(file);
-		} while (sqlite3_step(stmt) == SQLITE_ROW);
-		sqlite3_finalize(stmt);
+		if (stmt)
+			mdfs_stmt_put(db, _query_key(&src), stmt);
+	}
+	pthread_rwlock_unlock(&mdfs->snapshot_lock);
+	if (!nfiles)
+		return -ENOENT;
+	/* now we can update the metadata */
+	for (i = 0; i < nfiles; i++)
+	{
+		_file_fields_update(mdfs, files[i], new_mask, &dst);
+		mdfs_file_free(files[i]);
 	}
+	free(files);
+	/* the catalog has the new tags once we are done */
+	mdfs_writer_flush(mdfs->writer);
 	return 0;
 }
 
@@ -1098,25 +1699,84 @@ static void * metadatafs_init(struct fuse_conn_info *conn)
 		printf("impossible to create/read the database\n");
 		return NULL;
 	}
+	/* all the catalog updates go through the writer */
+	mdfs->writer = mdfs_writer_new(mdfs->db, mdfs->batch_size, mdfs->batch_time);
+	if (!mdfs->writer)
+		return NULL;
+	/* what the scanner reads of the files is not kept on the page cache */
+	libmetadatafs_cache_drop_set(!mdfs->scan_keep_cache);
+	/* whatever was cataloged before is served until the scan is done */
+	db_readers_open(mdfs);
+	if (mdfs->info->generation)
+		db_snapshot_hold(mdfs);
 	/* update the database */
 	metadatafs_scan(mdfs);
 	/* monitor file changes */
 #if HAVE_INOTIFY
-	metadatafs_monitor(mdfs);
+	mdfs->monitor = mdfs_monitor_new(mdfs);
 #endif
 	return mdfs;
 }
 
+/* The lookups on the catalog are counted while they are being served, so the
+ * scanner can slow down and leave the database and the disks to them. They
+ * also keep the snapshot they read from until they are done
+ */
+static int metadatafs_request_getattr(const char *path, struct stat *stbuf)
+{
+	metadatafs *mdfs = fuse_get_context()->private_data;
+	int ret;
+
+	__atomic_add_fetch(&mdfs->requests, 1, __ATOMIC_RELAXED);
+	pthread_rwlock_rdlock(&mdfs->snapshot_lock);
+	ret = metadatafs_getattr(path, stbuf);
+	pthread_rwlock_unlock(&mdfs->snapshot_lock);
+	__atomic_sub_fetch(&mdfs->requests, 1, __ATOMIC_RELAXED);
+	return ret;
+}
+
+static int metadatafs_request_readlink(const char *path, char *buf,
+		size_t size)
+{
+	metadatafs *mdfs = fuse_get_context()->private_data;
+	int ret;
+
+	__atomic_add_fetch(&mdfs->requests, 1, __ATOMIC_RELAXED);
+	pthread_rwlock_rdlock(&mdfs->snapshot_lock);
+	ret = metadatafs_readlink(path, buf, size);
+	pthread_rwlock_unlock(&mdfs->snapshot_lock);
+	__atomic_sub_fetch(&mdfs->requests, 1, __ATOMIC_RELAXED);
+	return ret;
+}
+
+static int metadatafs_request_readdir(const char *path, void *buf,
+		fuse_fill_dir_t filler, off_t offset, struct fuse_file_info *fi)
+{
+	metadatafs *mdfs = fuse_get_context()->private_data;
+	int ret;
+
+	__atomic_add_fetch(&mdfs->requests, 1, __ATOMIC_RELAXED);
+	pthread_rwlock_rdlock(&mdfs->snapshot_lock);
+	ret = metadatafs_readdir(path, buf, filler, offset, fi);
+	pthread_rwlock_unlock(&mdfs->snapshot_lock);
+	__atomic_sub_fetch(&mdfs->requests, 1, __ATOMIC_RELAXED);
+	return ret;
+}
+
 static struct fuse_operations metadatafs_ops = {
-	.getattr  = metadatafs_getattr,
-	.readlink = metadatafs_readlink,
-	.readdir  = metadatafs_readdir,
+	.getattr  = metadatafs_request_getattr,
+	.readlink = metadatafs_request_readlink,
+	.readdir  = metadatafs_request_readdir,
 	.open     = metadatafs_open,
 	.read     = metadatafs_read,
+	.write    = metadatafs_write,
+	.truncate = metadatafs_truncate,
+	.release  = metadatafs_release,
 	.statfs   = metadatafs_statfs,
 	.mkdir    = metadatafs_mkdir,
 	.rename   = metadatafs_rename,
 	.init     = metadatafs_init,
+	.destroy  = metadatafs_destroy,
 };
 
 /*============================================================================*
@@ -1141,8 +1801,31 @@ int main(int argc, char **argv)
 	args.argv = argv + 1;
 	args.allocated = 0;
 
-	//fuse_opt_match(args,
-	fuse_main(argc - 1, argv + 1, &metadatafs_ops, mdfs);
+	/* our own options, the rest are passed to fuse */
+	if (fuse_opt_parse(&args, mdfs, metadatafs_opts, NULL) < 0)
+	{
+		metadatafs_free(mdfs);
+		free(basepath);
+		return 1;
+	}
+	/* open it now, once daemonized the standard input is gone */
+	if (mdfs->manifest)
+	{
+		if (!strcmp(mdfs->manifest, "-"))
+			mdfs->manifest_file = fdopen(dup(0), "r");
+		else
+			mdfs->manifest_file = fopen(mdfs->manifest, "r");
+		if (!mdfs->manifest_file)
+		{
+			perror(mdfs->manifest);
+			fuse_opt_free_args(&args);
+			metadatafs_free(mdfs);
+			free(basepath);
+			return 1;
+		}
+	}
+	fuse_main(args.argc, args.argv, &metadatafs_ops, mdfs);
+	fuse_opt_free_args(&args);
 	metadatafs_free(mdfs);
 	free(basepath);
 
@@ -25,6 +25,8 @@
 
 #define FUSE_USE_VERSION 26
 #include <fuse.h>
+#include <stddef.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -39,6 +41,11 @@
 #include <sys/types.h>
 #include <pwd.h>
 
+#if HAVE_IO_URING
+#include <linux/io_uring.h>
+#include <linux/stat.h>
+#endif
+
 #if HAVE_INOTIFY
 #include <sys/inotify.h>
 /* size of the event structure, not counting name */
@@ -52,11 +59,143 @@ typedef struct _Mdfs_Artist Mdfs_Artist;
 typedef struct _Mdfs_Title Mdfs_Title;
 typedef struct _Mdfs_File Mdfs_File;
 typedef struct _Mdfs_Info Mdfs_Info;
+typedef struct _Mdfs_Dir Mdfs_Dir;
+typedef struct _Mdfs_Scanner Mdfs_Scanner;
+typedef struct _Mdfs_Writer Mdfs_Writer;
+typedef struct _Mdfs_Index Mdfs_Index;
+typedef struct _Mdfs_Uring Mdfs_Uring;
+typedef struct _Mdfs_Monitor Mdfs_Monitor;
+typedef struct _Mdfs_Reader Mdfs_Reader;
+
+typedef void (*Mdfs_Writer_Cb)(sqlite3 *db, void *data);
+
+/* the version of the schema of the catalog, see metadatafs_schema.c */
+#define MDFS_SCHEMA_VERSION 1
+
+/* the queries of the paths on the mount point, one per combination of the
+ * fields found on the path and the last one
+ */
+#define MDFS_STMT_QUERIES 256
+
+/* the statements kept prepared on every connection */
+typedef enum _Mdfs_Stmt_Key
+{
+	MDFS_STMT_ARTIST_GET,
+	MDFS_STMT_ARTIST_GET_FROM_ID,
+	MDFS_STMT_ARTIST_NEW,
+	MDFS_STMT_ALBUM_GET,
+	MDFS_STMT_ALBUM_GET_FROM_ID,
+	MDFS_STMT_ALBUM_GET_FROM_NAME,
+	MDFS_STMT_ALBUM_NEW,
+	MDFS_STMT_TITLE_GET,
+	MDFS_STMT_TITLE_GET_FROM_ID,
+	MDFS_STMT_TITLE_GET_FROM_NAME,
+	MDFS_STMT_TITLE_NEW,
+	MDFS_STMT_FILE_GET,
+	MDFS_STMT_FILE_GET_FROM_ID,
+	MDFS_STMT_FILE_GET_FROM_PATH,
+	MDFS_STMT_FILE_GET_FROM_IDENTITY,
+	MDFS_STMT_FILE_NEW,
+	MDFS_STMT_FILE_TOUCH,
+	MDFS_STMT_FILE_TOUCH_IDENTITY,
+	MDFS_STMT_FILE_UPDATE,
+	MDFS_STMT_FILE_MOVE,
+	MDFS_STMT_FILE_LINK,
+	MDFS_STMT_DIR_GET_FROM_PATH,
+	MDFS_STMT_DIR_NEW,
+	MDFS_STMT_DIR_TOUCH,
+	MDFS_STMT_QUERY,
+	MDFS_STMTS = MDFS_STMT_QUERY + MDFS_STMT_QUERIES
+} Mdfs_Stmt_Key;
+
+typedef struct _Mdfs_Scanner_Stats
+{
+	int running;
+	/* directories walked and those found unchanged */
+	unsigned long directories;
+	unsigned long skipped;
+	/* files found, parsed, unchanged since the last walk, moved from
+	 * another cataloged path and failed
+	 */
+	unsigned long seen;
+	unsigned long parsed;
+	unsigned long unchanged;
+	unsigned long moved;
+	unsigned long failed;
+	/* what was read of the parsed files */
+	unsigned long long bytes;
+	/* the files on the catalog when the walk started */
+	unsigned long expected;
+	double elapsed;
+	/* files per second, and seconds left or negative if unknown */
+	double rate;
+	double eta;
+} Mdfs_Scanner_Stats;
+
+typedef struct _metadatafs
+{
+	pthread_mutex_t lock;
+	pthread_mutex_t debug_lock;
+	sqlite3 *db;
+	/* the connection the requests are served from while a scan runs, it
+	 * keeps reading the catalog as it was before the scan
+	 */
+	sqlite3 *rdb;
+	pthread_rwlock_t snapshot_lock;
+	int snapshot;
+	/* every thread serving requests reads from a connection of its own,
+	 * the lock protects the list of them
+	 */
+	pthread_key_t reader;
+	Mdfs_Reader *readers;
+	char *basepath;
+	pthread_t scanner;
+	Mdfs_Scanner *scan;
+	Mdfs_Writer *writer;
+#if HAVE_INOTIFY
+	Mdfs_Monitor *monitor;
+#endif
+	Mdfs_Info *info;
+	/* options */
+	unsigned int scan_threads;
+	unsigned int batch_size;
+	unsigned int batch_time;
+	int full_verify;
+	unsigned int verify_interval;
+	unsigned int checkpoint_interval;
+	unsigned int snapshot_refresh;
+	int io_uring;
+	unsigned int uring_depth;
+	unsigned int scan_rate;
+	unsigned int scan_bandwidth;
+	int scan_idle;
+	unsigned int scan_yield;
+	char *scan_order;
+	int scan_keep_cache;
+	int rebuild;
+	char *manifest;
+	FILE *manifest_file;
+	unsigned int monitor_delay;
+	char *monitor_backend;
+	/* the requests being served right now */
+	int requests;
+	/* the source directories to walk again once the scanner is idle */
+	pthread_mutex_t rescan_lock;
+	pthread_cond_t rescan_cond;
+	char **rescans;
+	unsigned int nrescans;
+	int stopping;
+} metadatafs;
+
+void metadatafs_rescan(metadatafs *mdfs, const char *path);
+void metadatafs_snapshot_refresh(metadatafs *mdfs);
 
 struct _Mdfs_Info
 {
 	int version;
 	char *basepath;
+	time_t verified;
+	unsigned int generation;
 };
 
 struct _Mdfs_Artist
@@ -84,9 +223,24 @@ struct _Mdfs_File
 	unsigned int id;
 	char *path;
 	time_t mtime;
+	off_t size;
 	unsigned int title;
 };
 
+struct _Mdfs_Dir
+{
+	unsigned int id;
+	char *path;
+	time_t mtime;
+	time_t ctime;
+	unsigned int children;
+	/* the scan generation it was last seen on and the one its files
+	 * were last examined on
+	 */
+	unsigned int gen;
+	unsigned int examined;
+};
+
 /* album model */
 Mdfs_Album * mdfs_album_get_from_id(sqlite3 *db, unsigned int id);
 Mdfs_Album * mdfs_album_get_from_name(sqlite3 *db, const char *name);
@@ -94,6 +248,7 @@ Mdfs_Album * mdfs_album_get(sqlite3 *db, const char *name, unsigned int artist);
 Mdfs_Album * mdfs_album_new(sqlite3 *db, const char *name, unsigned int artist);
 void mdfs_album_free(Mdfs_Album *album);
 int mdfs_album_init(sqlite3 *db);
+int mdfs_album_indexes_init(sqlite3 *db);
 
 /* title model */
 Mdfs_Title * mdfs_title_get_from_id(sqlite3 *db, unsigned int id);
@@ -102,13 +257,28 @@ Mdfs_Title * mdfs_title_get(sqlite3 *db, const char *name, unsigned int album);
 Mdfs_Title * mdfs_title_new(sqlite3 *db, const char *name, unsigned int album);
 void mdfs_title_free(Mdfs_Title *title);
 int mdfs_title_init(sqlite3 *db);
+int mdfs_title_indexes_init(sqlite3 *db);
 
 /* file model */
 Mdfs_File * mdfs_file_get_from_id(sqlite3 *db, unsigned int id);
+Mdfs_File * mdfs_file_get_from_path(sqlite3 *db, const char *path);
 Mdfs_File * mdfs_file_get(sqlite3 *db, const char *path, time_t mtime, unsigned int title);
-Mdfs_File * mdfs_file_new(sqlite3 *db, const char *path, time_t mtime, unsigned int title);
+Mdfs_File * mdfs_file_get_from_identity(sqlite3 *db, dev_t dev, ino_t ino,
+		time_t mtime, off_t size);
+Mdfs_File * mdfs_file_new(sqlite3 *db, const char *path, time_t mtime,
+		off_t size, dev_t dev, ino_t ino, unsigned int title,
+		unsigned int gen);
+void mdfs_file_touch(sqlite3 *db, const char *path, dev_t dev, ino_t ino,
+		unsigned int gen);
+void mdfs_file_move(Mdfs_File *file, sqlite3 *db, const char *path,
+		unsigned int gen);
+void mdfs_file_link(Mdfs_File *file, sqlite3 *db, const char *path,
+		unsigned int gen);
 void mdfs_file_free(Mdfs_File *file);
+void mdfs_file_update(Mdfs_File *file, sqlite3 *db, const char *path,
+		time_t mtime, off_t size, unsigned int title);
 int mdfs_file_init(sqlite3 *db);
+int mdfs_file_indexes_init(sqlite3 *db);
 
 /* artist model */
 Mdfs_Artist * mdfs_artist_get_from_id(sqlite3 *db, unsigned int id);
@@ -117,9 +287,119 @@ Mdfs_Artist * mdfs_artist_new(sqlite3 *db, const char *name);
 void mdfs_artist_free(Mdfs_Artist *artist);
 int mdfs_artist_init(sqlite3 *db);
 
+/* dir model */
+Mdfs_Dir * mdfs_dir_get_from_path(sqlite3 *db, const char *path);
+Mdfs_Dir * mdfs_dir_new(sqlite3 *db, const char *path, time_t mtime,
+		time_t ctime, unsigned int children, unsigned int gen);
+void mdfs_dir_touch(sqlite3 *db, const char *path, unsigned int gen);
+void mdfs_dir_free(Mdfs_Dir *dir);
+int mdfs_dir_init(sqlite3 *db);
+
+/* checkpoint */
+void mdfs_checkpoint_save(sqlite3 *db, char **paths, unsigned int count,
+		unsigned int gen, int verify);
+char ** mdfs_checkpoint_load(sqlite3 *db, unsigned int gen,
+		unsigned int *count, int *verify);
+void mdfs_checkpoint_clear(sqlite3 *db);
+int mdfs_checkpoint_init(sqlite3 *db);
+
 /* info */
+Mdfs_Info * mdfs_info_new(int version, char *basepath);
+void mdfs_info_free(Mdfs_Info *info);
 void mdfs_info_update(sqlite3 *db, Mdfs_Info *info);
 Mdfs_Info * mdfs_info_load(sqlite3 *db);
+int mdfs_info_init(sqlite3 *db);
+
+/* schema */
+int mdfs_schema_migrate(sqlite3 *db, Mdfs_Info *info);
+
+/* prepared statements */
+sqlite3_stmt * mdfs_stmt_take(sqlite3 *db, int key);
+sqlite3_stmt * mdfs_stmt_get(sqlite3 *db, int key, const char *sql);
+void mdfs_stmt_put(sqlite3 *db, int key, sqlite3_stmt *stmt);
+void mdfs_stmt_cache_free(sqlite3 *db);
+
+/* scanner */
+Mdfs_Scanner * mdfs_scanner_new(metadatafs *mdfs, unsigned int workers);
+int mdfs_scanner_run(Mdfs_Scanner *thiz, const char *path, int verify);
+int mdfs_scanner_resume(Mdfs_Scanner *thiz, char **paths, unsigned int count,
+		int verify);
+int mdfs_scanner_subtrees(Mdfs_Scanner *thiz, char **paths,
+		unsigned int count);
+int mdfs_scanner_manifest(Mdfs_Scanner *thiz, FILE *manifest, int verify);
+int mdfs_scanner_hint(Mdfs_Scanner *thiz, const char *path, int subdirs);
+int mdfs_scanner_walking(Mdfs_Scanner *thiz);
+void mdfs_scanner_stats_get(Mdfs_Scanner *thiz, Mdfs_Scanner_Stats *stats);
+void mdfs_scanner_cancel(Mdfs_Scanner *thiz);
+void mdfs_scanner_free(Mdfs_Scanner *thiz);
+
+/* index */
+Mdfs_Index * mdfs_index_new(sqlite3 *db);
+int mdfs_index_changed(Mdfs_Index *thiz, const char *path, time_t mtime,
+		off_t size);
+int mdfs_index_dir_changed(Mdfs_Index *thiz, const char *path, time_t mtime,
+		time_t ctime, unsigned int *children);
+uint64_t mdfs_index_hash(const char *path);
+int mdfs_index_identity_known(Mdfs_Index *thiz, dev_t dev, ino_t ino,
+		time_t mtime, off_t size);
+unsigned int mdfs_index_files_count(Mdfs_Index *thiz);
+void mdfs_index_free(Mdfs_Index *thiz);
+
+#if HAVE_IO_URING
+/* io_uring engine */
+typedef void (*Mdfs_Uring_Cb)(void *data, unsigned long id, int res);
+
+Mdfs_Uring * mdfs_uring_new(unsigned int entries);
+unsigned int mdfs_uring_entries(Mdfs_Uring *thiz);
+int mdfs_uring_statx(Mdfs_Uring *thiz, int dirfd, const char *name,
+		struct statx *stx, unsigned int mask, unsigned long id);
+int mdfs_uring_openat(Mdfs_Uring *thiz, int dirfd, const char *name,
+		int flags, unsigned long id);
+int mdfs_uring_read(Mdfs_Uring *thiz, int fd, void *buf, size_t len,
+		off_t offset, unsigned long id);
+int mdfs_uring_close(Mdfs_Uring *thiz, int fd, unsigned long id);
+int mdfs_uring_fadvise(Mdfs_Uring *thiz, int fd, off_t offset, off_t len,
+		int advice, unsigned long id);
+void mdfs_uring_link(Mdfs_Uring *thiz);
+int mdfs_uring_complete(Mdfs_Uring *thiz, Mdfs_Uring_Cb cb, void *data);
+void mdfs_uring_free(Mdfs_Uring *thiz);
+#endif
+
+#if HAVE_INOTIFY
+/* monitor */
+Mdfs_Monitor * mdfs_monitor_new(metadatafs *mdfs);
+void mdfs_monitor_free(Mdfs_Monitor *thiz);
+#endif
+
+/* writer */
+Mdfs_Writer * mdfs_writer_new(sqlite3 *db, unsigned int batch_size,
+		unsigned int batch_time);
+void mdfs_writer_push(Mdfs_Writer *thiz, Mdfs_Writer_Cb cb, void *data);
+void mdfs_writer_file_add(Mdfs_Writer *thiz, const char *path,
+		struct stat *st, char *artist, char *album, char *title);
+void mdfs_writer_file_remove(Mdfs_Writer *thiz, const char *path);
+int mdfs_writer_category_add(Mdfs_Writer *thiz, const char *artist,
+		const char *album, const char *title);
+void mdfs_writer_file_rename(Mdfs_Writer *thiz, const char *from,
+		const char *to);
+void mdfs_writer_file_touch(Mdfs_Writer *thiz, const char *path,
+		struct stat *st);
+void mdfs_writer_file_move(Mdfs_Writer *thiz, const char *path,
+		struct stat *st);
+void mdfs_writer_dir_add(Mdfs_Writer *thiz, const char *path, time_t mtime,
+		time_t ctime, unsigned int children);
+void mdfs_writer_dir_touch(Mdfs_Writer *thiz, const char *path);
+void mdfs_writer_dirs_touch(Mdfs_Writer *thiz);
+void mdfs_writer_checkpoint(Mdfs_Writer *thiz, char **paths,
+		unsigned int count, int verify);
+void mdfs_writer_generation_set(Mdfs_Writer *thiz, unsigned int generation);
+sqlite3 * mdfs_writer_db_get(Mdfs_Writer *thiz);
+void mdfs_writer_db_set(Mdfs_Writer *thiz, sqlite3 *db);
+unsigned long mdfs_writer_sweep(Mdfs_Writer *thiz, char **roots,
+		unsigned int count);
+void mdfs_writer_flush(Mdfs_Writer *thiz);
+void mdfs_writer_wal_restart(Mdfs_Writer *thiz);
+void mdfs_writer_free(Mdfs_Writer *thiz);
 
 
 #endif
@@ -37,100 +37,85 @@ static Mdfs_Album * mdfs_album_new_internal(unsigned int id, const char *name,
  *============================================================================*/
 Mdfs_Album * mdfs_album_get_from_id(sqlite3 *db, unsigned int id)
 {
-	Mdfs_Album *album;
-	char *str;
+	Mdfs_Album *album = NULL;
 	sqlite3_stmt *stmt;
-	const char *tail;
-	int error;
 	unsigned int artist;
 	const unsigned char *name;
 
-	str = sqlite3_mprintf("SELECT name,artist FROM album WHERE id = %d;",
-			id);
-	error = sqlite3_prepare(db, str, -1, &stmt, &tail);
-	sqlite3_free(str);
-	if (error != SQLITE_OK)
+	stmt = mdfs_stmt_get(db, MDFS_STMT_ALBUM_GET_FROM_ID,
+			"SELECT name,artist FROM album WHERE id = ?;");
+	if (!stmt)
 		return NULL;
-	if (sqlite3_step(stmt) != SQLITE_ROW)
-		return NULL;
-	name = sqlite3_column_text(stmt, 0);
-	artist = sqlite3_column_int(stmt, 1);
-
-	album = mdfs_album_new_internal(id, name, artist);
-	sqlite3_finalize(stmt);
+	sqlite3_bind_int(stmt, 1, id);
+	if (sqlite3_step(stmt) == SQLITE_ROW)
+	{
+		name = sqlite3_column_text(stmt, 0);
+		artist = sqlite3_column_int(stmt, 1);
+		album = mdfs_album_new_internal(id, name, artist);
+	}
+	mdfs_stmt_put(db, MDFS_STMT_ALBUM_GET_FROM_ID, stmt);
 
-	return album; 
+	return album;
 }
 
 Mdfs_Album * mdfs_album_get_from_name(sqlite3 *db, const char *name)
 {
-	Mdfs_Album *album;
-	char *str;
+	Mdfs_Album *album = NULL;
 	sqlite3_stmt *stmt;
-	const char *tail;
-	int error;
 	int id;
 	unsigned int artist;
 
-	str = sqlite3_mprintf("SELECT id,artist FROM album WHERE name = '%q';",
-			name);
-	error = sqlite3_prepare(db, str, -1, &stmt, &tail);
-	sqlite3_free(str);
-	if (error != SQLITE_OK)
+	stmt = mdfs_stmt_get(db, MDFS_STMT_ALBUM_GET_FROM_NAME,
+			"SELECT id,artist FROM album WHERE name = ?;");
+	if (!stmt)
 		return NULL;
-	if (sqlite3_step(stmt) != SQLITE_ROW)
-		return NULL;
-	id = sqlite3_column_int(stmt, 0);
-	artist = sqlite3_column_int(stmt, 1);
-	sqlite3_step(stmt);
-	sqlite3_finalize(stmt);
+	sqlite3_bind_text(stmt, 1, name, -1, SQLITE_STATIC);
+	if (sqlite3_step(stmt) == SQLITE_ROW)
+	{
+		id = sqlite3_column_int(stmt, 0);
+		artist = sqlite3_column_int(stmt, 1);
+		album = mdfs_album_new_internal(id, name, artist);
+	}
+	mdfs_stmt_put(db, MDFS_STMT_ALBUM_GET_FROM_NAME, stmt);
 
-	album = mdfs_album_new_internal(id, name, artist);
-	return album; 
+	return album;
 }
 
 
 Mdfs_Album * mdfs_album_get(sqlite3 *db, const char *name, unsigned int artist)
 {
-	Mdfs_Album *album;
-	char *str;
+	Mdfs_Album *album = NULL;
 	sqlite3_stmt *stmt;
-	const char *tail;
-	int error;
 	int id;
 
-	str = sqlite3_mprintf("SELECT id FROM album WHERE name = '%q' AND artist = %d;",
-			name, artist);
-	error = sqlite3_prepare(db, str, -1, &stmt, &tail);
-	sqlite3_free(str);
-	if (error != SQLITE_OK)
-		return NULL;
-	if (sqlite3_step(stmt) != SQLITE_ROW)
+	stmt = mdfs_stmt_get(db, MDFS_STMT_ALBUM_GET,
+			"SELECT id FROM album WHERE name = ? AND artist = ?;");
+	if (!stmt)
 		return NULL;
-	id = sqlite3_column_int(stmt, 0);
-	sqlite3_step(stmt);
-	sqlite3_finalize(stmt);
+	sqlite3_bind_text(stmt, 1, name, -1, SQLITE_STATIC);
+	sqlite3_bind_int(stmt, 2, artist);
+	if (sqlite3_step(stmt) == SQLITE_ROW)
+	{
+		id = sqlite3_column_int(stmt, 0);
+		album = mdfs_album_new_internal(id, name, artist);
+	}
+	mdfs_stmt_put(db, MDFS_STMT_ALBUM_GET, stmt);
 
-	album = mdfs_album_new_internal(id, name, artist);
-	return album; 
+	return album;
 }
 
 Mdfs_Album * mdfs_album_new(sqlite3 *db, const char *name, unsigned int artist)
 {
-	char *str;
 	sqlite3_stmt *stmt;
-	const char *tail;
-	int error;
-	int id = -1;
 
-	str = sqlite3_mprintf("INSERT OR IGNORE INTO album (name, artist) VALUES ('%q',%d);",
-			name, artist);
-	error = sqlite3_prepare(db, str, -1, &stmt, &tail);
-	sqlite3_free(str);
-	if (error != SQLITE_OK)
+	stmt = mdfs_stmt_get(db, MDFS_STMT_ALBUM_NEW,
+			"INSERT OR IGNORE INTO album (name, artist) VALUES (?,?);");
+	if (!stmt)
 		return NULL;
+	sqlite3_bind_text(stmt, 1, name, -1, SQLITE_STATIC);
+	sqlite3_bind_int(stmt, 2, artist);
 	sqlite3_step(stmt);
-	sqlite3_finalize(stmt);
+	mdfs_stmt_put(db, MDFS_STMT_ALBUM_NEW, stmt);
 
 	return mdfs_album_get(db, name, artist);
 }
@@ -151,6 +136,7 @@ int mdfs_album_init(sqlite3 *db)
 	error = sqlite3_prepare(db,
 			"CREATE TABLE IF NOT EXISTS "
 			"album(id INTEGER PRIMARY KEY AUTOINCREMENT, name TEXT, artist INTEGER, "
+			"UNIQUE (name, artist), "
 			"FOREIGN KEY (artist) REFERENCES artist (id));",
 			-1, &stmt, &tail);
 	if (error != SQLITE_OK)
@@ -164,3 +150,15 @@ int mdfs_album_init(sqlite3 *db)
 	return 1;
 }
 
+/* as the ones of the files, created once a bulk load is done */
+int mdfs_album_indexes_init(sqlite3 *db)
+{
+	/* to join the artists with their albums */
+	if (sqlite3_exec(db, "CREATE INDEX IF NOT EXISTS album_artist ON album (artist, name);",
+			NULL, NULL, NULL) != SQLITE_OK)
+	{
+		printf("error album indexes\n");
+		return 0;
+	}
+	return 1;
+}
@@ -35,70 +35,58 @@ static Mdfs_Artist * mdfs_artist_new_internal(unsigned int id, const char *name)
  *============================================================================*/
 Mdfs_Artist * mdfs_artist_get(sqlite3 *db, const char *name)
 {
-	Mdfs_Artist *artist;
-	char *str;
+	Mdfs_Artist *artist = NULL;
 	sqlite3_stmt *stmt;
-	const char *tail;
-	int error;
 	unsigned int id;
 
-	str = sqlite3_mprintf("SELECT id FROM artist WHERE name = '%q';",
-			name);
-	error = sqlite3_prepare(db, str, -1, &stmt, &tail);
-	sqlite3_free(str);
-	if (error != SQLITE_OK)
+	stmt = mdfs_stmt_get(db, MDFS_STMT_ARTIST_GET,
+			"SELECT id FROM artist WHERE name = ?;");
+	if (!stmt)
 		return NULL;
-	if (sqlite3_step(stmt) != SQLITE_ROW)
-		return NULL;
-	id = sqlite3_column_int(stmt, 0);
-	sqlite3_finalize(stmt);
+	sqlite3_bind_text(stmt, 1, name, -1, SQLITE_STATIC);
+	if (sqlite3_step(stmt) == SQLITE_ROW)
+	{
+		id = sqlite3_column_int(stmt, 0);
+		artist = mdfs_artist_new_internal(id, name);
+	}
+	mdfs_stmt_put(db, MDFS_STMT_ARTIST_GET, stmt);
 
-	artist = mdfs_artist_new_internal(id, name);
 	return artist;
 }
 
 Mdfs_Artist * mdfs_artist_get_from_id(sqlite3 *db, unsigned int id)
 {
-	Mdfs_Artist *artist;
-	char *str;
+	Mdfs_Artist *artist = NULL;
 	sqlite3_stmt *stmt;
-	const char *tail;
-	int error;
 	const unsigned char *name;
 
-	str = sqlite3_mprintf("SELECT name FROM artist WHERE id = %d",
-			id);
-	error = sqlite3_prepare(db, str, -1, &stmt, &tail);
-	sqlite3_free(str);
-	if (error != SQLITE_OK)
+	stmt = mdfs_stmt_get(db, MDFS_STMT_ARTIST_GET_FROM_ID,
+			"SELECT name FROM artist WHERE id = ?;");
+	if (!stmt)
 		return NULL;
-	if (sqlite3_step(stmt) != SQLITE_ROW)
-		return NULL;
-	name = sqlite3_column_text(stmt, 0);
-
-	artist = mdfs_artist_new_internal(id, name);
-	sqlite3_finalize(stmt);
+	sqlite3_bind_int(stmt, 1, id);
+	if (sqlite3_step(stmt) == SQLITE_ROW)
+	{
+		name = sqlite3_column_text(stmt, 0);
+		artist = mdfs_artist_new_internal(id, name);
+	}
+	mdfs_stmt_put(db, MDFS_STMT_ARTIST_GET_FROM_ID, stmt);
 
 	return artist;
 }
 
 Mdfs_Artist * mdfs_artist_new(sqlite3 *db, const char *name)
 {
-	Mdfs_Artist *artist;
-	char *str;
 	sqlite3_stmt *stmt;
-	const char *tail;
-	int error;
 
 	/* insert the new artist */
-	str = sqlite3_mprintf("INSERT OR IGNORE INTO artist (name) VALUES ('%q');",
-			name);
-	error = sqlite3_prepare(db, str, -1, &stmt, &tail);
-	sqlite3_free(str);
-	if (error != SQLITE_OK)
+	stmt = mdfs_stmt_get(db, MDFS_STMT_ARTIST_NEW,
+			"INSERT OR IGNORE INTO artist (name) VALUES (?);");
+	if (!stmt)
 		return NULL;
+	sqlite3_bind_text(stmt, 1, name, -1, SQLITE_STATIC);
 	sqlite3_step(stmt);
-	sqlite3_finalize(stmt);
+	mdfs_stmt_put(db, MDFS_STMT_ARTIST_NEW, stmt);
 
 	return mdfs_artist_get(db, name);
 }
@@ -0,0 +1,110 @@
+/* MetadataFS -
+ * Copyright (C) 2010 Jorge Luis Zapata
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library.
+ * If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * The directories a scan still has to walk, saved from time to time so an
+ * interrupted scan can be resumed on the next mount instead of starting
+ * again from the top. A checkpoint only makes sense for the scan generation
+ * it was taken on.
+ */
+#include "metadatafs.h"
+/*============================================================================*
+ *                                 Global                                     *
+ *============================================================================*/
+/* replace the checkpoint with the given directories */
+void mdfs_checkpoint_save(sqlite3 *db, char **paths, unsigned int count,
+		unsigned int gen, int verify)
+{
+	unsigned int i;
+
+	sqlite3_exec(db, "DELETE FROM checkpoint;", NULL, NULL, NULL);
+	for (i = 0; i < count; i++)
+	{
+		char *str;
+
+		str = sqlite3_mprintf("INSERT INTO checkpoint (path, gen, verify) VALUES ('%q',%u,%d);",
+				paths[i], gen, verify);
+		sqlite3_exec(db, str, NULL, NULL, NULL);
+		sqlite3_free(str);
+	}
+}
+
+/* Get the directories left to walk by the scan of generation gen. Returns
+ * NULL if there is no checkpoint for it
+ */
+char ** mdfs_checkpoint_load(sqlite3 *db, unsigned int gen,
+		unsigned int *count, int *verify)
+{
+	char **paths = NULL;
+	char *str;
+	sqlite3_stmt *stmt;
+	const char *tail;
+	unsigned int size = 0;
+	int error;
+
+	*count = 0;
+	str = sqlite3_mprintf("SELECT path,verify FROM checkpoint WHERE gen = %u;",
+			gen);
+	error = sqlite3_prepare(db, str, -1, &stmt, &tail);
+	sqlite3_free(str);
+	if (error != SQLITE_OK)
+		return NULL;
+	while (sqlite3_step(stmt) == SQLITE_ROW)
+	{
+		const char *path;
+
+		path = (const char *)sqlite3_column_text(stmt, 0);
+		if (!path) continue;
+		if (*count == size)
+		{
+			size = size ? size * 2 : 64;
+			paths = realloc(paths, sizeof(char *) * size);
+		}
+		paths[(*count)++] = strdup(path);
+		*verify = sqlite3_column_int(stmt, 1);
+	}
+	sqlite3_finalize(stmt);
+
+	return paths;
+}
+
+void mdfs_checkpoint_clear(sqlite3 *db)
+{
+	sqlite3_exec(db, "DELETE FROM checkpoint;", NULL, NULL, NULL);
+}
+
+int mdfs_checkpoint_init(sqlite3 *db)
+{
+	sqlite3_stmt *stmt;
+	const char *tail;
+	int error;
+
+	error = sqlite3_prepare(db,
+			"CREATE TABLE IF NOT EXISTS "
+			"checkpoint(path TEXT, gen INTEGER, verify INTEGER);",
+			-1, &stmt, &tail);
+	if (error != SQLITE_OK)
+	{
+		printf("error checkpoint\n");
+		return 0;
+	}
+	sqlite3_step(stmt);
+	sqlite3_finalize(stmt);
+
+	return 1;
+}
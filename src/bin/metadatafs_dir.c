@@ -0,0 +1,141 @@
+/* MetadataFS -
+ * Copyright (C) 2010 Jorge Luis Zapata
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library.
+ * If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "metadatafs.h"
+/*============================================================================*
+ *                                  Local                                     *
+ *============================================================================*/
+static Mdfs_Dir * mdfs_dir_new_internal(unsigned int id, const char *path,
+		time_t mtime, time_t ctime, unsigned int children,
+		unsigned int gen, unsigned int examined)
+{
+	Mdfs_Dir *thiz;
+
+	thiz = calloc(1, sizeof(Mdfs_Dir));
+	if (!thiz) return NULL;
+	thiz->id = id;
+	thiz->path = strdup(path);
+	thiz->mtime = mtime;
+	thiz->ctime = ctime;
+	thiz->children = children;
+	thiz->gen = gen;
+	thiz->examined = examined;
+
+	return thiz;
+}
+/*============================================================================*
+ *                                 Global                                     *
+ *============================================================================*/
+Mdfs_Dir * mdfs_dir_get_from_path(sqlite3 *db, const char *path)
+{
+	Mdfs_Dir *dir = NULL;
+	sqlite3_stmt *stmt;
+	unsigned int id;
+	time_t mtime;
+	time_t ctime;
+	unsigned int children;
+	unsigned int gen;
+	unsigned int examined;
+
+	stmt = mdfs_stmt_get(db, MDFS_STMT_DIR_GET_FROM_PATH,
+			"SELECT id,mtime,ctime,children,gen,examined FROM dirs WHERE path = ?;");
+	if (!stmt)
+		return NULL;
+	sqlite3_bind_text(stmt, 1, path, -1, SQLITE_STATIC);
+	if (sqlite3_step(stmt) == SQLITE_ROW)
+	{
+		id = sqlite3_column_int(stmt, 0);
+		mtime = sqlite3_column_int64(stmt, 1);
+		ctime = sqlite3_column_int64(stmt, 2);
+		children = sqlite3_column_int(stmt, 3);
+		gen = sqlite3_column_int(stmt, 4);
+		examined = sqlite3_column_int(stmt, 5);
+		dir = mdfs_dir_new_internal(id, path, mtime, ctime, children,
+				gen, examined);
+	}
+	mdfs_stmt_put(db, MDFS_STMT_DIR_GET_FROM_PATH, stmt);
+
+	return dir;
+}
+
+/* store the state of a source directory whose files have been examined on
+ * the scan generation gen, replacing the previous one
+ */
+Mdfs_Dir * mdfs_dir_new(sqlite3 *db, const char *path, time_t mtime,
+		time_t ctime, unsigned int children, unsigned int gen)
+{
+	sqlite3_stmt *stmt;
+
+	stmt = mdfs_stmt_get(db, MDFS_STMT_DIR_NEW,
+			"INSERT OR REPLACE INTO dirs (path, mtime, ctime, children, gen, examined) VALUES (?,?,?,?,?,?);");
+	if (!stmt)
+		return NULL;
+	sqlite3_bind_text(stmt, 1, path, -1, SQLITE_STATIC);
+	sqlite3_bind_int64(stmt, 2, mtime);
+	sqlite3_bind_int64(stmt, 3, ctime);
+	sqlite3_bind_int(stmt, 4, children);
+	sqlite3_bind_int(stmt, 5, gen);
+	sqlite3_bind_int(stmt, 6, gen);
+	sqlite3_step(stmt);
+	mdfs_stmt_put(db, MDFS_STMT_DIR_NEW, stmt);
+
+	return mdfs_dir_get_from_path(db, path);
+}
+
+/* mark the directory as seen on the scan generation gen */
+void mdfs_dir_touch(sqlite3 *db, const char *path, unsigned int gen)
+{
+	sqlite3_stmt *stmt;
+
+	stmt = mdfs_stmt_get(db, MDFS_STMT_DIR_TOUCH,
+			"UPDATE dirs SET gen = ? WHERE path = ?;");
+	if (!stmt)
+		return;
+	sqlite3_bind_int(stmt, 1, gen);
+	sqlite3_bind_text(stmt, 2, path, -1, SQLITE_STATIC);
+	sqlite3_step(stmt);
+	mdfs_stmt_put(db, MDFS_STMT_DIR_TOUCH, stmt);
+}
+
+void mdfs_dir_free(Mdfs_Dir *dir)
+{
+	free(dir->path);
+	free(dir);
+}
+
+int mdfs_dir_init(sqlite3 *db)
+{
+	sqlite3_stmt *stmt;
+	const char *tail;
+	int error;
+
+	error = sqlite3_prepare(db,
+			"CREATE TABLE IF NOT EXISTS "
+			"dirs(id INTEGER PRIMARY KEY AUTOINCREMENT, path TEXT UNIQUE, "
+			"mtime INTEGER, ctime INTEGER, children INTEGER, "
+			"gen INTEGER DEFAULT 0, examined INTEGER DEFAULT 0);",
+			-1, &stmt, &tail);
+	if (error != SQLITE_OK)
+	{
+		printf("error dir\n");
+		return 0;
+	}
+	sqlite3_step(stmt);
+	sqlite3_finalize(stmt);
+
+	return 1;
+}
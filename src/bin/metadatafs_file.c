@@ -20,7 +20,7 @@
  *                                  Local                                     *
  *============================================================================*/
 static Mdfs_File * mdfs_file_new_internal(unsigned int id, const char *path,
-		time_t mtime, unsigned int title)
+		time_t mtime, off_t size, unsigned int title)
 {
 	Mdfs_File *thiz;
 
@@ -28,6 +28,7 @@ static Mdfs_File * mdfs_file_new_internal(unsigned int id, const char *path,
 	if (!thiz) return NULL;
 	thiz->id = id;
 	thiz->mtime = mtime;
+	thiz->size = size;
 	thiz->path = strdup(path);
 	thiz->title = title;
 
@@ -38,138 +39,246 @@ static Mdfs_File * mdfs_file_new_internal(unsigned int id, const char *path,
  *============================================================================*/
 Mdfs_File * mdfs_file_get_from_id(sqlite3 *db, unsigned int id)
 {
-	Mdfs_File *file;
-	char *str;
+	Mdfs_File *file = NULL;
 	sqlite3_stmt *stmt;
-	const char *tail;
-	int error;
 	const unsigned char *path;
 	time_t mtime;
+	off_t size;
 	unsigned int title;
 
-	str = sqlite3_mprintf("SELECT file, mtime, title FROM files WHERE id = %d", id);
-	error = sqlite3_prepare(db, str, -1, &stmt, &tail);
-	sqlite3_free(str);
-	if (error != SQLITE_OK)
-		return NULL;
-	if (sqlite3_step(stmt) != SQLITE_ROW)
+	stmt = mdfs_stmt_get(db, MDFS_STMT_FILE_GET_FROM_ID,
+			"SELECT file, mtime, title, size FROM files WHERE id = ?;");
+	if (!stmt)
 		return NULL;
-
-	path = sqlite3_column_text(stmt, 0);
-	mtime = sqlite3_column_int(stmt, 1);
-	title = sqlite3_column_int(stmt, 2);
-
-	file = mdfs_file_new_internal(id, path, mtime, title);
-	sqlite3_finalize(stmt);
+	sqlite3_bind_int(stmt, 1, id);
+	if (sqlite3_step(stmt) == SQLITE_ROW)
+	{
+		path = sqlite3_column_text(stmt, 0);
+		mtime = sqlite3_column_int64(stmt, 1);
+		title = sqlite3_column_int(stmt, 2);
+		size = sqlite3_column_int64(stmt, 3);
+		file = mdfs_file_new_internal(id, path, mtime, size, title);
+	}
+	mdfs_stmt_put(db, MDFS_STMT_FILE_GET_FROM_ID, stmt);
 
 	return file;
 }
 
 Mdfs_File * mdfs_file_get_from_path(sqlite3 *db, const char *path)
 {
-	Mdfs_File *file;
-	char *str;
+	Mdfs_File *file = NULL;
 	sqlite3_stmt *stmt;
-	const char *tail;
-	int error;
 	int id;
 	time_t mtime;
+	off_t size;
 	unsigned int title;
 
-	str = sqlite3_mprintf("SELECT id,mtime,title FROM files WHERE file = '%q';",
-			path);
-	error = sqlite3_prepare(db, str, -1, &stmt, &tail);
-	sqlite3_free(str);
-	if (error != SQLITE_OK)
-		return NULL;
-	if (sqlite3_step(stmt) != SQLITE_ROW)
+	stmt = mdfs_stmt_get(db, MDFS_STMT_FILE_GET_FROM_PATH,
+			"SELECT id,mtime,title,size FROM files WHERE file = ?;");
+	if (!stmt)
 		return NULL;
-	id = sqlite3_column_int(stmt, 0);
-	mtime = sqlite3_column_int(stmt, 1);
-	title = sqlite3_column_int(stmt, 2);
-	sqlite3_step(stmt);
-	sqlite3_finalize(stmt);
+	sqlite3_bind_text(stmt, 1, path, -1, SQLITE_STATIC);
+	if (sqlite3_step(stmt) == SQLITE_ROW)
+	{
+		id = sqlite3_column_int(stmt, 0);
+		mtime = sqlite3_column_int64(stmt, 1);
+		title = sqlite3_column_int(stmt, 2);
+		size = sqlite3_column_int64(stmt, 3);
+		file = mdfs_file_new_internal(id, path, mtime, size, title);
+	}
+	mdfs_stmt_put(db, MDFS_STMT_FILE_GET_FROM_PATH, stmt);
 
-	return mdfs_file_new_internal(id, path, mtime, title);
+	return file;
 }
 
 Mdfs_File * mdfs_file_get(sqlite3 *db, const char *path, time_t mtime, unsigned int title)
 {
-	Mdfs_File *file;
-	char *str;
+	Mdfs_File *file = NULL;
 	sqlite3_stmt *stmt;
-	const char *tail;
-	int error;
 	int id;
+	off_t size;
 
-	str = sqlite3_mprintf("SELECT id FROM file WHERE file = '%q' AND mtime = %d AND title = %d;",
-			path, mtime, title);
-	error = sqlite3_prepare(db, str, -1, &stmt, &tail);
-	sqlite3_free(str);
-	if (error != SQLITE_OK)
+	stmt = mdfs_stmt_get(db, MDFS_STMT_FILE_GET,
+			"SELECT id,size FROM files WHERE file = ? AND mtime = ? AND title = ?;");
+	if (!stmt)
 		return NULL;
-	if (sqlite3_step(stmt) != SQLITE_ROW)
+	sqlite3_bind_text(stmt, 1, path, -1, SQLITE_STATIC);
+	sqlite3_bind_int64(stmt, 2, mtime);
+	sqlite3_bind_int(stmt, 3, title);
+	if (sqlite3_step(stmt) == SQLITE_ROW)
+	{
+		id = sqlite3_column_int(stmt, 0);
+		size = sqlite3_column_int64(stmt, 1);
+		file = mdfs_file_new_internal(id, path, mtime, size, title);
+	}
+	mdfs_stmt_put(db, MDFS_STMT_FILE_GET, stmt);
+
+	return file;
+}
+
+/* get the file whose source has the same identity (device and inode) and
+ * the same contents (modification time and size) than the given one
+ */
+Mdfs_File * mdfs_file_get_from_identity(sqlite3 *db, dev_t dev, ino_t ino,
+		time_t mtime, off_t size)
+{
+	sqlite3_stmt *stmt;
+	const unsigned char *path;
+	int id;
+	unsigned int title;
+	Mdfs_File *file = NULL;
+
+	stmt = mdfs_stmt_get(db, MDFS_STMT_FILE_GET_FROM_IDENTITY,
+			"SELECT id,file,title FROM files WHERE ino = ? AND dev = ? AND mtime = ? AND size = ?;");
+	if (!stmt)
 		return NULL;
-	id = sqlite3_column_int(stmt, 0);
-	sqlite3_step(stmt);
-	sqlite3_finalize(stmt);
+	sqlite3_bind_int64(stmt, 1, ino);
+	sqlite3_bind_int64(stmt, 2, dev);
+	sqlite3_bind_int64(stmt, 3, mtime);
+	sqlite3_bind_int64(stmt, 4, size);
+	if (sqlite3_step(stmt) == SQLITE_ROW)
+	{
+		id = sqlite3_column_int(stmt, 0);
+		path = sqlite3_column_text(stmt, 1);
+		title = sqlite3_column_int(stmt, 2);
+		file = mdfs_file_new_internal(id, (const char *)path, mtime,
+				size, title);
+	}
+	mdfs_stmt_put(db, MDFS_STMT_FILE_GET_FROM_IDENTITY, stmt);
 
-	return mdfs_file_new_internal(id, path, mtime, title);
+	return file;
 }
 
-Mdfs_File * mdfs_file_new(sqlite3 *db, const char *path, time_t mtime, unsigned int title)
+Mdfs_File * mdfs_file_new(sqlite3 *db, const char *path, time_t mtime,
+		off_t size, dev_t dev, ino_t ino, unsigned int title,
+		unsigned int gen)
 {
 	Mdfs_File *file;
-	char *str;
 	sqlite3_stmt *stmt;
-	const char *tail;
-	int error;
-	int id;
 
-	str = sqlite3_mprintf("INSERT OR IGNORE INTO files (file, mtime, title) VALUES ('%q',%d,%d);",
-			path, mtime, title);
-	error = sqlite3_prepare(db, str, -1, &stmt, &tail);
-	sqlite3_free(str);
-	if (error != SQLITE_OK)
+	stmt = mdfs_stmt_get(db, MDFS_STMT_FILE_NEW,
+			"INSERT OR IGNORE INTO files (file, mtime, size, dev, ino, title, gen) VALUES (?,?,?,?,?,?,?);");
+	if (!stmt)
 		return NULL;
+	sqlite3_bind_text(stmt, 1, path, -1, SQLITE_STATIC);
+	sqlite3_bind_int64(stmt, 2, mtime);
+	sqlite3_bind_int64(stmt, 3, size);
+	sqlite3_bind_int64(stmt, 4, dev);
+	sqlite3_bind_int64(stmt, 5, ino);
+	sqlite3_bind_int(stmt, 6, title);
+	sqlite3_bind_int(stmt, 7, gen);
 	sqlite3_step(stmt);
-	sqlite3_finalize(stmt);
+	mdfs_stmt_put(db, MDFS_STMT_FILE_NEW, stmt);
 
 	file = mdfs_file_get(db, path, mtime, title);
 	return file;
 }
 
+/* mark the file as seen on the scan generation gen, the identity is stored
+ * too for the files cataloged before it was
+ */
+void mdfs_file_touch(sqlite3 *db, const char *path, dev_t dev, ino_t ino,
+		unsigned int gen)
+{
+	sqlite3_stmt *stmt;
+	int key;
+
+	/* without an inode keep the identity we have */
+	if (ino)
+	{
+		key = MDFS_STMT_FILE_TOUCH_IDENTITY;
+		stmt = mdfs_stmt_get(db, key,
+				"UPDATE files SET gen = ?1, dev = ?3, ino = ?4 WHERE file = ?2;");
+		if (!stmt)
+			return;
+		sqlite3_bind_int64(stmt, 3, dev);
+		sqlite3_bind_int64(stmt, 4, ino);
+	}
+	else
+	{
+		key = MDFS_STMT_FILE_TOUCH;
+		stmt = mdfs_stmt_get(db, key,
+				"UPDATE files SET gen = ? WHERE file = ?;");
+		if (!stmt)
+			return;
+	}
+	sqlite3_bind_int(stmt, 1, gen);
+	sqlite3_bind_text(stmt, 2, path, -1, SQLITE_STATIC);
+	sqlite3_step(stmt);
+	mdfs_stmt_put(db, key, stmt);
+}
+
 void mdfs_file_free(Mdfs_File *file)
 {
 	free(file->path);
 	free(file);
 }
 
-void mdfs_file_update(Mdfs_File *file, sqlite3 *db, const char *path, time_t mtime, unsigned int title)
+void mdfs_file_update(Mdfs_File *file, sqlite3 *db, const char *path,
+		time_t mtime, off_t size, unsigned int title)
 {
-	char *str;
 	sqlite3_stmt *stmt;
-	const char *tail;
-	int error;
-	int id;
 
-	str = sqlite3_mprintf("UPDATE files SET file='%q', mtime=%d, title=%d WHERE id = %d",
-			path, mtime, title, file->id);
-	error = sqlite3_prepare(db, str, -1, &stmt, &tail);
-	sqlite3_free(str);
-	if (error != SQLITE_OK)
-		return NULL;
+	stmt = mdfs_stmt_get(db, MDFS_STMT_FILE_UPDATE,
+			"UPDATE files SET file = ?, mtime = ?, size = ?, title = ? WHERE id = ?;");
+	if (!stmt)
+		return;
+	sqlite3_bind_text(stmt, 1, path, -1, SQLITE_STATIC);
+	sqlite3_bind_int64(stmt, 2, mtime);
+	sqlite3_bind_int64(stmt, 3, size);
+	sqlite3_bind_int(stmt, 4, title);
+	sqlite3_bind_int(stmt, 5, file->id);
 	sqlite3_step(stmt);
-	sqlite3_finalize(stmt);
+	mdfs_stmt_put(db, MDFS_STMT_FILE_UPDATE, stmt);
 	if (strcmp(file->path, path))
 	{
 		free(file->path);
 		file->path = strdup(path);
 	}
 	file->mtime = mtime;
+	file->size = size;
 	file->title = title;
 }
 
+/* the source file has been moved to path, keep its tags */
+void mdfs_file_move(Mdfs_File *file, sqlite3 *db, const char *path,
+		unsigned int gen)
+{
+	sqlite3_stmt *stmt;
+
+	stmt = mdfs_stmt_get(db, MDFS_STMT_FILE_MOVE,
+			"UPDATE files SET file = ?, gen = ? WHERE id = ?;");
+	if (!stmt)
+		return;
+	sqlite3_bind_text(stmt, 1, path, -1, SQLITE_STATIC);
+	sqlite3_bind_int(stmt, 2, gen);
+	sqlite3_bind_int(stmt, 3, file->id);
+	sqlite3_step(stmt);
+	mdfs_stmt_put(db, MDFS_STMT_FILE_MOVE, stmt);
+	free(file->path);
+	file->path = strdup(path);
+}
+
+/* the source file is also reachable from path (a hard link), catalog it
+ * there too with the same tags
+ */
+void mdfs_file_link(Mdfs_File *file, sqlite3 *db, const char *path,
+		unsigned int gen)
+{
+	sqlite3_stmt *stmt;
+
+	stmt = mdfs_stmt_get(db, MDFS_STMT_FILE_LINK,
+			"INSERT INTO files (file, mtime, size, dev, ino, title, gen) "
+			"SELECT ?, mtime, size, dev, ino, title, ? FROM files WHERE id = ?;");
+	if (!stmt)
+		return;
+	sqlite3_bind_text(stmt, 1, path, -1, SQLITE_STATIC);
+	sqlite3_bind_int(stmt, 2, gen);
+	sqlite3_bind_int(stmt, 3, file->id);
+	sqlite3_step(stmt);
+	mdfs_stmt_put(db, MDFS_STMT_FILE_LINK, stmt);
+}
+
 int mdfs_file_init(sqlite3 *db)
 {
 	sqlite3_stmt *stmt;
@@ -178,8 +287,10 @@ int mdfs_file_init(sqlite3 *db)
 
 	error = sqlite3_prepare(db,
 			"CREATE TABLE IF NOT EXISTS "
-			"files(id INTEGER PRIMARY KEY AUTOINCREMENT, file TEXT, dbfile TEXT, "
-			"mtime INTEGER, title INTEGER, "
+			"files(id INTEGER PRIMARY KEY AUTOINCREMENT, file TEXT UNIQUE, dbfile TEXT, "
+			"mtime INTEGER, size INTEGER DEFAULT 0, title INTEGER, "
+			"gen INTEGER DEFAULT 0, dev INTEGER DEFAULT 0, "
+			"ino INTEGER DEFAULT 0, "
 			"FOREIGN KEY (title) REFERENCES title (id));",
 			-1, &stmt, &tail);
 	if (error != SQLITE_OK)
@@ -192,3 +303,25 @@ int mdfs_file_init(sqlite3 *db)
 
 	return 1;
 }
+
+/* the indexes are created apart from the table, a bulk load is faster
+ * without them and creates them once done
+ */
+int mdfs_file_indexes_init(sqlite3 *db)
+{
+	/* to find a moved file by its identity */
+	if (sqlite3_exec(db, "CREATE INDEX IF NOT EXISTS files_identity ON files (ino, dev);",
+			NULL, NULL, NULL) != SQLITE_OK)
+	{
+		printf("error file indexes\n");
+		return 0;
+	}
+	/* to join the titles with their files */
+	if (sqlite3_exec(db, "CREATE INDEX IF NOT EXISTS files_title ON files (title);",
+			NULL, NULL, NULL) != SQLITE_OK)
+	{
+		printf("error file indexes\n");
+		return 0;
+	}
+	return 1;
+}
@@ -0,0 +1,271 @@
+/* MetadataFS -
+ * Copyright (C) 2010 Jorge Luis Zapata
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library.
+ * If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * In memory snapshot of the files and directories on the catalog used by the
+ * scanner to know if something has changed. It is loaded once with a single
+ * query per table and is never modified afterwards, so every scanner worker
+ * can read it without locking. The paths are not stored, only a 64 bit hash
+ * of them on an open addressing table with linear probing. The files are
+ * also indexed by the identity of their source (device and inode) so a moved
+ * or renamed file can be recognized without parsing it again.
+ */
+#include "metadatafs.h"
+#include <stdint.h>
+/*============================================================================*
+ *                                  Local                                     *
+ *============================================================================*/
+typedef struct _Mdfs_Index_Entry
+{
+	uint64_t hash;
+	int64_t mtime;
+	int64_t ctime;
+	/* the number of entries for directories */
+	int64_t size;
+} Mdfs_Index_Entry;
+
+typedef struct _Mdfs_Index_Table
+{
+	Mdfs_Index_Entry *entries;
+	/* always a power of two */
+	unsigned int size;
+	unsigned int count;
+} Mdfs_Index_Table;
+
+struct _Mdfs_Index
+{
+	Mdfs_Index_Table files;
+	Mdfs_Index_Table dirs;
+	/* the files keyed by "dev:ino" */
+	Mdfs_Index_Table ids;
+};
+
+/* FNV-1a, zero is reserved for the empty slots */
+static uint64_t _hash(const char *str)
+{
+	uint64_t h = 14695981039346656037ULL;
+
+	while (*str)
+	{
+		h ^= (unsigned char)*str++;
+		h *= 1099511628211ULL;
+	}
+	return h ? h : 1;
+}
+
+static Mdfs_Index_Entry * _lookup(Mdfs_Index_Table *t, uint64_t hash)
+{
+	unsigned int mask = t->size - 1;
+	unsigned int i;
+
+	for (i = hash & mask; t->entries[i].hash; i = (i + 1) & mask)
+	{
+		if (t->entries[i].hash == hash)
+			break;
+	}
+	return &t->entries[i];
+}
+
+static int _grow(Mdfs_Index_Table *t)
+{
+	Mdfs_Index_Entry *old = t->entries;
+	unsigned int size = t->size;
+	unsigned int i;
+
+	t->entries = calloc(size * 2, sizeof(Mdfs_Index_Entry));
+	if (!t->entries)
+	{
+		t->entries = old;
+		return 0;
+	}
+	t->size = size * 2;
+	for (i = 0; i < size; i++)
+	{
+		if (old[i].hash)
+			*_lookup(t, old[i].hash) = old[i];
+	}
+	free(old);
+	return 1;
+}
+
+static int _count(sqlite3 *db, const char *sql)
+{
+	sqlite3_stmt *stmt;
+	const char *tail;
+	int count = 0;
+
+	if (sqlite3_prepare(db, sql, -1, &stmt, &tail) != SQLITE_OK)
+		return 0;
+	if (sqlite3_step(stmt) == SQLITE_ROW)
+		count = sqlite3_column_int(stmt, 0);
+	sqlite3_finalize(stmt);
+	return count;
+}
+
+static uint64_t _identity_hash(dev_t dev, ino_t ino)
+{
+	char str[48];
+
+	snprintf(str, sizeof(str), "%lld:%lld", (long long)dev, (long long)ino);
+	return _hash(str);
+}
+
+/* load the (path, mtime, size, ctime) rows returned by sql */
+static int _table_load(Mdfs_Index_Table *t, sqlite3 *db, int count,
+		const char *sql)
+{
+	sqlite3_stmt *stmt;
+	const char *tail;
+
+	/* keep the load factor under one half */
+	t->size = 16;
+	while (t->size < (unsigned int)count * 2)
+		t->size <<= 1;
+	t->entries = calloc(t->size, sizeof(Mdfs_Index_Entry));
+	if (!t->entries)
+		return 0;
+
+	if (sqlite3_prepare(db, sql, -1, &stmt, &tail) != SQLITE_OK)
+		return 1;
+	while (sqlite3_step(stmt) == SQLITE_ROW)
+	{
+		Mdfs_Index_Entry *e;
+		const char *path;
+		uint64_t hash;
+
+		/* the table might have grown since we counted it */
+		if (t->count >= t->size / 2 && !_grow(t))
+			break;
+		path = (const char *)sqlite3_column_text(stmt, 0);
+		if (!path) continue;
+		hash = _hash(path);
+		e = _lookup(t, hash);
+		/* with duplicated rows keep the newest */
+		if (e->hash && e->mtime >= sqlite3_column_int64(stmt, 1))
+			continue;
+		if (!e->hash) t->count++;
+		e->hash = hash;
+		e->mtime = sqlite3_column_int64(stmt, 1);
+		e->size = sqlite3_column_int64(stmt, 2);
+		e->ctime = sqlite3_column_int64(stmt, 3);
+	}
+	sqlite3_finalize(stmt);
+	return 1;
+}
+/*============================================================================*
+ *                                 Global                                     *
+ *============================================================================*/
+Mdfs_Index * mdfs_index_new(sqlite3 *db)
+{
+	Mdfs_Index *thiz;
+
+	thiz = calloc(1, sizeof(Mdfs_Index));
+	if (!thiz) return NULL;
+
+	if (!_table_load(&thiz->files, db,
+			_count(db, "SELECT COUNT(*) FROM files;"),
+			"SELECT file,mtime,size,0 FROM files;"))
+		goto files_err;
+	if (!_table_load(&thiz->dirs, db,
+			_count(db, "SELECT COUNT(*) FROM dirs;"),
+			"SELECT path,mtime,children,ctime FROM dirs;"))
+		goto dirs_err;
+	/* same format as _identity_hash(), files cataloged before the
+	 * identity was stored have no inode
+	 */
+	if (!_table_load(&thiz->ids, db,
+			_count(db, "SELECT COUNT(*) FROM files WHERE ino != 0;"),
+			"SELECT dev || ':' || ino,mtime,size,0 FROM files WHERE ino != 0;"))
+		goto ids_err;
+
+	return thiz;
+ids_err:
+	free(thiz->dirs.entries);
+dirs_err:
+	free(thiz->files.entries);
+files_err:
+	free(thiz);
+	return NULL;
+}
+
+/* the hash used to identify the paths */
+uint64_t mdfs_index_hash(const char *path)
+{
+	return _hash(path);
+}
+
+/* check if a file is not on the catalog or has changed since it was stored */
+int mdfs_index_changed(Mdfs_Index *thiz, const char *path, time_t mtime,
+		off_t size)
+{
+	Mdfs_Index_Entry *e;
+
+	e = _lookup(&thiz->files, _hash(path));
+	if (!e->hash)
+		return 1;
+	/* catalogs created before the size was stored have it as zero */
+	if (e->size && e->size != size)
+		return 1;
+	return e->mtime < mtime;
+}
+
+/* check if the source file with the given identity is already on the catalog
+ * with the same contents, no matter its path
+ */
+int mdfs_index_identity_known(Mdfs_Index *thiz, dev_t dev, ino_t ino,
+		time_t mtime, off_t size)
+{
+	Mdfs_Index_Entry *e;
+
+	if (!ino)
+		return 0;
+	e = _lookup(&thiz->ids, _identity_hash(dev, ino));
+	if (!e->hash)
+		return 0;
+	return e->mtime == mtime && e->size == size;
+}
+
+/* check if a directory is new or an entry has been added, removed or renamed
+ * on it since it was stored. On return children has the number of entries
+ * it had back then
+ */
+int mdfs_index_dir_changed(Mdfs_Index *thiz, const char *path, time_t mtime,
+		time_t ctime, unsigned int *children)
+{
+	Mdfs_Index_Entry *e;
+
+	e = _lookup(&thiz->dirs, _hash(path));
+	if (!e->hash)
+		return 1;
+	*children = e->size;
+	return e->mtime != mtime || e->ctime != ctime;
+}
+
+/* the number of files on the catalog when the index was loaded */
+unsigned int mdfs_index_files_count(Mdfs_Index *thiz)
+{
+	return thiz->files.count;
+}
+
+void mdfs_index_free(Mdfs_Index *thiz)
+{
+	free(thiz->files.entries);
+	free(thiz->dirs.entries);
+	free(thiz->ids.entries);
+	free(thiz);
+}
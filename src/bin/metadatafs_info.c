@@ -32,7 +32,7 @@ void mdfs_info_update(sqlite3 *db, Mdfs_Info *info)
 
 	/* the basepath */
 	str = sqlite3_mprintf("INSERT OR REPLACE INTO info (variable, value) VALUES\
-			('basepath','%s');", info->basepath);
+			('basepath','%q');", info->basepath);
 	error = sqlite3_prepare(db, str, -1, &stmt, &tail);
 	sqlite3_free(str);
 	if (error != SQLITE_OK)
@@ -52,13 +52,35 @@ void mdfs_info_update(sqlite3 *db, Mdfs_Info *info)
 	if (sqlite3_step(stmt) != SQLITE_DONE)
 		return;
 	sqlite3_finalize(stmt);
+
+	/* the last scan generation */
+	str = sqlite3_mprintf("INSERT OR REPLACE INTO info (variable, value) VALUES\
+			('generation','%u');", info->generation);
+	error = sqlite3_prepare(db, str, -1, &stmt, &tail);
+	sqlite3_free(str);
+	if (error != SQLITE_OK)
+		return;
+	if (sqlite3_step(stmt) != SQLITE_DONE)
+		return;
+	sqlite3_finalize(stmt);
+
+	/* the last time the whole tree was verified */
+	str = sqlite3_mprintf("INSERT OR REPLACE INTO info (variable, value) VALUES\
+			('verified','%lld');", (long long)info->verified);
+	error = sqlite3_prepare(db, str, -1, &stmt, &tail);
+	sqlite3_free(str);
+	if (error != SQLITE_OK)
+		return;
+	if (sqlite3_step(stmt) != SQLITE_DONE)
+		return;
+	sqlite3_finalize(stmt);
 }
 
 Mdfs_Info * mdfs_info_new(int version, char *basepath)
 {
 	Mdfs_Info *info;
 
-	info = malloc(sizeof(Mdfs_Info));
+	info = calloc(1, sizeof(Mdfs_Info));
 	info->version = version;
 	info->basepath = strdup(basepath);
 
@@ -91,19 +113,25 @@ Mdfs_Info * mdfs_info_load(sqlite3 *db)
 	}
 	else
 	{
-		info = malloc(sizeof(Mdfs_Info));
+		info = calloc(1, sizeof(Mdfs_Info));
 		do
 		{
-			char *variable;
-			char *value;
+			const char *variable;
+			const char *value;
 
-			variable = sqlite3_column_text(stmt, 0);
-			value = sqlite3_column_text(stmt, 1);
-			if (!strcmp(variable, "path"))
+			variable = (const char *)sqlite3_column_text(stmt, 0);
+			value = (const char *)sqlite3_column_text(stmt, 1);
+			if (!variable || !value)
+				continue;
+			if (!strcmp(variable, "basepath"))
 				info->basepath = strdup(value);
 			else if (!strcmp(variable, "version"))
 				info->version = atoi(value);
-		} while (sqlite3_step(stmt) != SQLITE_ROW);
+			else if (!strcmp(variable, "verified"))
+				info->verified = atoll(value);
+			else if (!strcmp(variable, "generation"))
+				info->generation = strtoul(value, NULL, 10);
+		} while (sqlite3_step(stmt) == SQLITE_ROW);
 	}
 end:
 	sqlite3_finalize(stmt);
@@ -0,0 +1,1120 @@
+/* MetadataFS -
+ * Copyright (C) 2010 Jorge Luis Zapata
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library.
+ * If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Keeps the catalog in sync with the source tree while mounted. There are two
+ * ways of getting the events. With fanotify a single mark on the filesystem
+ * of the base path reports the changes on every directory, whatever their
+ * number, the directory and the name of each event are resolved to a path
+ * and the ones outside the base path dropped. It needs CAP_SYS_ADMIN, without
+ * it every directory under the base path is watched through inotify, the new
+ * ones as soon as they appear. The events only mark a path as changed, once
+ * no event has arrived for it during the debounce delay its current state is
+ * looked up and sent to the writer: parsed if it is a file, removed with
+ * everything under it if it is gone. A file being copied produces dozens of
+ * events but is parsed once, and the writer groups the updates of a whole
+ * burst on its transactions.
+ *
+ * A rename comes as a pair of events with the same cookie, or as a single
+ * event with both paths on fanotify. Once paired it is applied as a rewrite
+ * of the paths on the catalog, of every file under it for a directory, so
+ * nothing is parsed again. A half with no pair is a file moved out of or into
+ * the tree, a removal or a new file.
+ *
+ * When the kernel queue overflows the events are lost, the directories with
+ * recent events are watched and walked again by the scanner. The same goes
+ * for the directories that could not be watched, retried from time to time.
+ */
+#include "metadatafs.h"
+#include "libmetadatafs.h"
+#include <poll.h>
+#include <time.h>
+
+#if HAVE_INOTIFY
+#if HAVE_FANOTIFY
+#include <sys/fanotify.h>
+#endif
+/*============================================================================*
+ *                                  Local                                     *
+ *============================================================================*/
+#define MONITOR_MASK (IN_CREATE | IN_MODIFY | IN_CLOSE_WRITE | IN_DELETE | \
+		IN_MOVED_FROM | IN_MOVED_TO | IN_ONLYDIR | IN_DONT_FOLLOW | \
+		IN_EXCL_UNLINK)
+/* the whole filesystem is marked, every write on it would be an event so
+ * only the closes are asked for
+ */
+#define MONITOR_FAN_MASK (FAN_CREATE | FAN_DELETE | FAN_CLOSE_WRITE | \
+		FAN_ONDIR)
+#define MONITOR_TABLE_INITIAL_SIZE 64
+/* how long the first half of a rename waits for its pair, both are
+ * generated together so it only needs to cover a split read
+ */
+#define MONITOR_MOVE_WAIT 0.05
+/* on an overflow the directories with events this recent are walked again,
+ * older ones are forgotten
+ */
+#define MONITOR_ACTIVE_WINDOW 10
+/* seconds between the retries of the directories that could not be
+ * watched
+ */
+#define MONITOR_RETRY 60
+
+typedef struct _Mdfs_Monitor_Change Mdfs_Monitor_Change;
+
+struct _Mdfs_Monitor_Change
+{
+	char *path;
+	uint64_t hash;
+	/* when the last event for it arrived */
+	double last;
+	Mdfs_Monitor_Change *next;
+};
+
+/* the paths and when their last event arrived, chained by the hash of the
+ * path
+ */
+typedef struct _Mdfs_Monitor_Table
+{
+	Mdfs_Monitor_Change **buckets;
+	unsigned int size;
+	unsigned int count;
+} Mdfs_Monitor_Table;
+
+typedef struct _Mdfs_Monitor_Move
+{
+	uint32_t cookie;
+	char *path;
+	int dir;
+	double time;
+} Mdfs_Monitor_Move;
+
+struct _Mdfs_Monitor
+{
+	metadatafs *mdfs;
+	pthread_t thread;
+	int running;
+	/* the inotify or the fanotify descriptor */
+	int fd;
+	int fanotify;
+	/* to open the directories of the fanotify events and the real path
+	 * of the base path they are found on
+	 */
+	int mount_fd;
+	char *root;
+	size_t root_len;
+	/* written to stop the thread */
+	int wake[2];
+	/* every watched directory, indexed by its watch */
+	char **watches;
+	int watches_size;
+	/* the paths with events not handled yet */
+	Mdfs_Monitor_Table changes;
+	/* the directories with events and when the old ones were dropped */
+	Mdfs_Monitor_Table active;
+	double expired;
+	/* the renames waiting for their destination */
+	Mdfs_Monitor_Move *moves;
+	unsigned int moves_count;
+	unsigned int moves_size;
+	/* the watch limit has been reached, the directories that could not
+	 * be watched and when they are retried
+	 */
+	int exhausted;
+	char **unwatched;
+	unsigned int unwatched_count;
+	double retry;
+};
+
+static double _now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1000000000.0;
+}
+
+static void _table_grow(Mdfs_Monitor_Table *t)
+{
+	Mdfs_Monitor_Change **old = t->buckets;
+	unsigned int size = t->size;
+	unsigned int i;
+
+	t->size = size ? size * 2 : MONITOR_TABLE_INITIAL_SIZE;
+	t->buckets = calloc(t->size, sizeof(Mdfs_Monitor_Change *));
+	for (i = 0; i < size; i++)
+	{
+		Mdfs_Monitor_Change *c = old[i];
+
+		while (c)
+		{
+			Mdfs_Monitor_Change *next = c->next;
+			unsigned int b = c->hash & (t->size - 1);
+
+			c->next = t->buckets[b];
+			t->buckets[b] = c;
+			c = next;
+		}
+	}
+	free(old);
+}
+
+/* set when the last event for a path arrived, unless a later one did */
+static void _table_set(Mdfs_Monitor_Table *t, const char *path, double last)
+{
+	Mdfs_Monitor_Change *c;
+	uint64_t hash;
+	unsigned int b;
+
+	if (t->count >= t->size / 2 * 3)
+		_table_grow(t);
+	hash = mdfs_index_hash(path);
+	b = hash & (t->size - 1);
+	for (c = t->buckets[b]; c; c = c->next)
+	{
+		if (c->hash == hash && !strcmp(c->path, path))
+		{
+			if (last > c->last)
+				c->last = last;
+			return;
+		}
+	}
+	c = malloc(sizeof(Mdfs_Monitor_Change));
+	c->path = strdup(path);
+	c->hash = hash;
+	c->last = last;
+	c->next = t->buckets[b];
+	t->buckets[b] = c;
+	t->count++;
+}
+
+static void _table_free(Mdfs_Monitor_Table *t)
+{
+	unsigned int i;
+
+	for (i = 0; i < t->size; i++)
+	{
+		Mdfs_Monitor_Change *c = t->buckets[i];
+
+		while (c)
+		{
+			Mdfs_Monitor_Change *next = c->next;
+
+			free(c->path);
+			free(c);
+			c = next;
+		}
+	}
+	free(t->buckets);
+}
+
+/* drop the paths whose last event arrived before since */
+static void _table_expire(Mdfs_Monitor_Table *t, double since)
+{
+	unsigned int i;
+
+	for (i = 0; i < t->size && t->count; i++)
+	{
+		Mdfs_Monitor_Change **prev = &t->buckets[i];
+		Mdfs_Monitor_Change *c;
+
+		while ((c = *prev))
+		{
+			if (c->last >= since)
+			{
+				prev = &c->next;
+				continue;
+			}
+			*prev = c->next;
+			t->count--;
+			free(c->path);
+			free(c);
+		}
+	}
+}
+
+static int _path_under(const char *path, const char *dir, size_t len)
+{
+	return !strncmp(path, dir, len) && (!path[len] || path[len] == '/');
+}
+
+/* mark a path as changed at time last, the debounce starts again if it
+ * already was
+ */
+static void _change_at(Mdfs_Monitor *thiz, const char *path, double last)
+{
+	_table_set(&thiz->changes, path, last);
+}
+
+static void _change(Mdfs_Monitor *thiz, const char *path)
+{
+	_change_at(thiz, path, _now());
+}
+
+/* the changes under a renamed path follow it */
+static void _changes_rename(Mdfs_Monitor *thiz, const char *from,
+		const char *to)
+{
+	Mdfs_Monitor_Change *moved = NULL;
+	size_t len = strlen(from);
+	unsigned int i;
+
+	for (i = 0; i < thiz->changes.size && thiz->changes.count; i++)
+	{
+		Mdfs_Monitor_Change **prev = &thiz->changes.buckets[i];
+		Mdfs_Monitor_Change *c;
+
+		while ((c = *prev))
+		{
+			if (!_path_under(c->path, from, len))
+			{
+				prev = &c->next;
+				continue;
+			}
+			*prev = c->next;
+			thiz->changes.count--;
+			c->next = moved;
+			moved = c;
+		}
+	}
+	while (moved)
+	{
+		Mdfs_Monitor_Change *c = moved;
+		char *path;
+
+		moved = c->next;
+		path = malloc(strlen(to) + strlen(c->path + len) + 1);
+		sprintf(path, "%s%s", to, c->path + len);
+		_change_at(thiz, path, c->last);
+		free(path);
+		free(c->path);
+		free(c);
+	}
+}
+
+/* look at the current state of a path with no recent events */
+static void _change_apply(Mdfs_Monitor *thiz, const char *path)
+{
+	metadatafs *mdfs = thiz->mdfs;
+	libmetadatafs_tags tags;
+	struct stat st;
+
+	if (lstat(path, &st) < 0)
+	{
+		if (errno == ENOENT || errno == ENOTDIR)
+			mdfs_writer_file_remove(mdfs->writer, path);
+		return;
+	}
+	/* the files of a new directory are changes on their own */
+	if (!S_ISREG(st.st_mode))
+		return;
+	if (!libmetadatafs_tags_get(path, NULL, 0, &tags))
+	{
+		printf("monitor: cannot parse %s\n", path);
+		return;
+	}
+	mdfs_writer_file_add(mdfs->writer, path, &st, tags.artist,
+			tags.album, tags.title);
+}
+
+/* apply the changes whose debounce is over, with force all of them.
+ * Returns the milliseconds until the next one is due or -1 if there is none
+ */
+static int _changes_apply(Mdfs_Monitor *thiz, int force)
+{
+	double delay = thiz->mdfs->monitor_delay / 1000.0;
+	double now = _now();
+	double next = -1;
+	unsigned int i;
+
+	for (i = 0; i < thiz->changes.size && thiz->changes.count; i++)
+	{
+		Mdfs_Monitor_Change **prev = &thiz->changes.buckets[i];
+		Mdfs_Monitor_Change *c;
+
+		while ((c = *prev))
+		{
+			double due = c->last + delay;
+
+			if (!force && due > now)
+			{
+				if (next < 0 || due < next)
+					next = due;
+				prev = &c->next;
+				continue;
+			}
+			*prev = c->next;
+			thiz->changes.count--;
+			_change_apply(thiz, c->path);
+			free(c->path);
+			free(c);
+		}
+	}
+	if (next < 0)
+		return -1;
+	return (next - now) * 1000 + 1;
+}
+
+static void _watch_set(Mdfs_Monitor *thiz, int wd, const char *path)
+{
+	if (wd >= thiz->watches_size)
+	{
+		int size = thiz->watches_size;
+
+		while (thiz->watches_size <= wd)
+			thiz->watches_size = thiz->watches_size ?
+					thiz->watches_size * 2 : 256;
+		thiz->watches = realloc(thiz->watches,
+				sizeof(char *) * thiz->watches_size);
+		memset(thiz->watches + size, 0, sizeof(char *) *
+				(thiz->watches_size - size));
+	}
+	/* the same directory watched again */
+	free(thiz->watches[wd]);
+	thiz->watches[wd] = strdup(path);
+}
+
+static void _watch_unset(Mdfs_Monitor *thiz, int wd)
+{
+	if (wd < 0 || wd >= thiz->watches_size)
+		return;
+	free(thiz->watches[wd]);
+	thiz->watches[wd] = NULL;
+}
+
+/* stop watching a directory and everything under it */
+static void _watch_remove_tree(Mdfs_Monitor *thiz, const char *path)
+{
+	size_t len = strlen(path);
+	int i;
+
+	for (i = 0; i < thiz->watches_size; i++)
+	{
+		char *w = thiz->watches[i];
+
+		if (!w || !_path_under(w, path, len))
+			continue;
+		inotify_rm_watch(thiz->fd, i);
+		_watch_unset(thiz, i);
+	}
+}
+
+/* the watches follow a renamed directory, only their paths change */
+static void _watch_rename_tree(Mdfs_Monitor *thiz, const char *from,
+		const char *to)
+{
+	size_t len = strlen(from);
+	int i;
+
+	for (i = 0; i < thiz->watches_size; i++)
+	{
+		char *w = thiz->watches[i];
+		char *path;
+
+		if (!w || !_path_under(w, from, len))
+			continue;
+		path = malloc(strlen(to) + strlen(w + len) + 1);
+		sprintf(path, "%s%s", to, w + len);
+		free(w);
+		thiz->watches[i] = path;
+	}
+}
+
+/* the watched directory an event on path comes from */
+static char * _parent(Mdfs_Monitor *thiz, const char *path)
+{
+	const char *basepath = thiz->mdfs->basepath;
+	size_t len = strlen(basepath);
+	const char *end;
+
+	if (!_path_under(path, basepath, len) || !path[len])
+		return strdup(basepath);
+	end = strrchr(path + len, '/');
+	if (end == path + len)
+		return strdup(basepath);
+	return strndup(path, end - path);
+}
+
+/* keep track of where the events happen, the old ones are of no use */
+static void _active(Mdfs_Monitor *thiz, const char *path)
+{
+	double now = _now();
+	char *dir;
+
+	if (now >= thiz->expired + MONITOR_ACTIVE_WINDOW)
+	{
+		_table_expire(&thiz->active, now - MONITOR_ACTIVE_WINDOW);
+		thiz->expired = now;
+	}
+	dir = _parent(thiz, path);
+	_table_set(&thiz->active, dir, now);
+	free(dir);
+}
+
+/* keep a directory that could not be watched to retry it later */
+static void _unwatched_add(Mdfs_Monitor *thiz, const char *path)
+{
+	thiz->unwatched = realloc(thiz->unwatched,
+			sizeof(char *) * (thiz->unwatched_count + 1));
+	thiz->unwatched[thiz->unwatched_count++] = strdup(path);
+	if (!thiz->retry)
+		thiz->retry = _now() + MONITOR_RETRY;
+}
+
+/* add the watch of a single directory, returns whether it can be walked */
+static int _watch_add(Mdfs_Monitor *thiz, const char *path, int changed)
+{
+	int wd;
+
+	wd = inotify_add_watch(thiz->fd, path, MONITOR_MASK);
+	if (wd < 0)
+	{
+		if (errno != ENOSPC)
+			return 0;
+		if (!thiz->exhausted)
+		{
+			printf("monitor: out of watches, raise "
+					"fs.inotify.max_user_watches\n");
+			thiz->exhausted = 1;
+		}
+		/* what is under it is only found by walking it */
+		_unwatched_add(thiz, path);
+		if (changed)
+			metadatafs_rescan(thiz->mdfs, path);
+		return 0;
+	}
+	_watch_set(thiz, wd, path);
+	return 1;
+}
+
+/* Watch a directory and everything under it. With changed every supported
+ * file found is marked as changed, they might have been created before the
+ * watch was in place. On fanotify everything is watched already, the
+ * directory is only walked
+ */
+static void _watch_tree(Mdfs_Monitor *thiz, const char *path, int changed)
+{
+	struct dirent *de;
+	DIR *dp;
+	size_t plen;
+	char *sub;
+
+	if (!thiz->fanotify && !_watch_add(thiz, path, changed))
+		return;
+	dp = opendir(path);
+	if (!dp) return;
+	plen = strlen(path);
+	sub = malloc(plen + NAME_MAX + 2);
+	memcpy(sub, path, plen);
+	sub[plen] = '/';
+	while ((de = readdir(dp)))
+	{
+		if (!strcmp(de->d_name, ".") || !strcmp(de->d_name, ".."))
+			continue;
+		strcpy(sub + plen + 1, de->d_name);
+		if (de->d_type == DT_DIR)
+			_watch_tree(thiz, sub, changed);
+		else if (de->d_type == DT_UNKNOWN)
+		{
+			struct stat st;
+
+			if (lstat(sub, &st) < 0)
+				continue;
+			if (S_ISDIR(st.st_mode))
+				_watch_tree(thiz, sub, changed);
+			else if (changed && libmetadatafs_supported(sub))
+				_change(thiz, sub);
+		}
+		else if (changed && libmetadatafs_supported(sub))
+			_change(thiz, sub);
+	}
+	free(sub);
+	closedir(dp);
+}
+
+/* the source of a rename went out of the tree */
+static void _move_lost(Mdfs_Monitor *thiz, const char *path, int dir)
+{
+	if (dir)
+	{
+		_watch_remove_tree(thiz, path);
+		_change(thiz, path);
+	}
+	else if (libmetadatafs_supported(path))
+		_change(thiz, path);
+}
+
+/* the destination of a rename came from outside the tree */
+static void _move_found(Mdfs_Monitor *thiz, const char *path, int dir)
+{
+	if (dir)
+		_watch_tree(thiz, path, 1);
+	else if (libmetadatafs_supported(path))
+		_change(thiz, path);
+}
+
+/* both paths of a rename are known */
+static void _moved(Mdfs_Monitor *thiz, const char *from, const char *to,
+		int dir)
+{
+	metadatafs *mdfs = thiz->mdfs;
+
+	if (dir)
+	{
+		_watch_rename_tree(thiz, from, to);
+		_changes_rename(thiz, from, to);
+		mdfs_writer_file_rename(mdfs->writer, from, to);
+	}
+	/* a file renamed to or from something we do not parse */
+	else if (!libmetadatafs_supported(to))
+	{
+		if (libmetadatafs_supported(from))
+			_change(thiz, from);
+	}
+	else if (!libmetadatafs_supported(from))
+		_change(thiz, to);
+	else
+	{
+		_changes_rename(thiz, from, to);
+		mdfs_writer_file_rename(mdfs->writer, from, to);
+	}
+}
+
+/* give up on the renames with no pair after a while, with force on all of
+ * them. Returns the milliseconds until the next one expires or -1
+ */
+static int _moves_expire(Mdfs_Monitor *thiz, int force)
+{
+	double now = _now();
+	unsigned int i = 0;
+
+	while (i < thiz->moves_count)
+	{
+		Mdfs_Monitor_Move *m = &thiz->moves[i];
+
+		if (!force && m->time + MONITOR_MOVE_WAIT > now)
+		{
+			i++;
+			continue;
+		}
+		_move_lost(thiz, m->path, m->dir);
+		free(m->path);
+		thiz->moves[i] = thiz->moves[--thiz->moves_count];
+	}
+	if (!thiz->moves_count)
+		return -1;
+	return MONITOR_MOVE_WAIT * 1000 + 1;
+}
+
+static void _move_from(Mdfs_Monitor *thiz, uint32_t cookie, const char *path,
+		int dir)
+{
+	Mdfs_Monitor_Move *m;
+
+	if (thiz->moves_count == thiz->moves_size)
+	{
+		thiz->moves_size = thiz->moves_size ? thiz->moves_size * 2 : 16;
+		thiz->moves = realloc(thiz->moves,
+				sizeof(Mdfs_Monitor_Move) * thiz->moves_size);
+	}
+	m = &thiz->moves[thiz->moves_count++];
+	m->cookie = cookie;
+	m->path = strdup(path);
+	m->dir = dir;
+	m->time = _now();
+}
+
+static void _move_to(Mdfs_Monitor *thiz, uint32_t cookie, const char *path,
+		int dir)
+{
+	Mdfs_Monitor_Move m;
+	unsigned int i;
+
+	for (i = 0; i < thiz->moves_count; i++)
+	{
+		if (thiz->moves[i].cookie == cookie)
+			break;
+	}
+	if (i == thiz->moves_count)
+	{
+		_move_found(thiz, path, dir);
+		return;
+	}
+	m = thiz->moves[i];
+	thiz->moves[i] = thiz->moves[--thiz->moves_count];
+	_moved(thiz, m.path, path, m.dir);
+	free(m.path);
+}
+
+/* some events were lost, the directories created meanwhile have no watch
+ * and their files were never seen
+ */
+static void _lost(Mdfs_Monitor *thiz, const char *path)
+{
+	if (!thiz->fanotify)
+		_watch_tree(thiz, path, 0);
+	metadatafs_rescan(thiz->mdfs, path);
+}
+
+/* some events were lost, watch and walk again the directories where things
+ * were going on, or everything if we have no clue. They are walked from now
+ * on so the table starts empty
+ */
+static void _overflow(Mdfs_Monitor *thiz)
+{
+	double since = _now() - MONITOR_ACTIVE_WINDOW;
+	int found = 0;
+	unsigned int i;
+
+	for (i = 0; i < thiz->active.size && thiz->active.count; i++)
+	{
+		Mdfs_Monitor_Change *c;
+
+		while ((c = thiz->active.buckets[i]))
+		{
+			thiz->active.buckets[i] = c->next;
+			thiz->active.count--;
+			if (c->last >= since)
+			{
+				_lost(thiz, c->path);
+				found = 1;
+			}
+			free(c->path);
+			free(c);
+		}
+	}
+	if (!found)
+		_lost(thiz, thiz->mdfs->basepath);
+	printf("monitor: events lost, walking again where they happened\n");
+}
+
+/* try again to watch the directories we could not, they are walked again
+ * either way since nobody has been looking at them
+ */
+static void _unwatched_retry(Mdfs_Monitor *thiz)
+{
+	char **paths = thiz->unwatched;
+	unsigned int count = thiz->unwatched_count;
+	unsigned int i;
+
+	thiz->unwatched = NULL;
+	thiz->unwatched_count = 0;
+	thiz->retry = 0;
+	thiz->exhausted = 0;
+	for (i = 0; i < count; i++)
+	{
+		_watch_tree(thiz, paths[i], 0);
+		metadatafs_rescan(thiz->mdfs, paths[i]);
+		free(paths[i]);
+	}
+	free(paths);
+}
+
+/* an event on a path of the tree, described with the inotify mask. A move
+ * with no cookie can not be paired
+ */
+static void _event(Mdfs_Monitor *thiz, uint32_t mask, uint32_t cookie,
+		const char *path)
+{
+	int dir = !!(mask & IN_ISDIR);
+
+	_active(thiz, path);
+	if (mask & IN_MOVED_FROM)
+	{
+		if (cookie)
+			_move_from(thiz, cookie, path, dir);
+		else
+			_move_lost(thiz, path, dir);
+	}
+	else if (mask & IN_MOVED_TO)
+		_move_to(thiz, cookie, path, dir);
+	else if (dir)
+	{
+		if (mask & IN_DELETE)
+		{
+			_watch_remove_tree(thiz, path);
+			_change(thiz, path);
+		}
+		if (mask & IN_CREATE)
+			_watch_tree(thiz, path, 1);
+	}
+	else if (libmetadatafs_supported(path))
+		_change(thiz, path);
+}
+
+static void _inotify_read(Mdfs_Monitor *thiz, char *buf, ssize_t len)
+{
+	ssize_t i;
+
+	for (i = 0; i < len; )
+	{
+		struct inotify_event *ev;
+		char *parent;
+		char *path;
+
+		ev = (struct inotify_event *)&buf[i];
+		i += EVENT_SIZE + ev->len;
+		if (ev->mask & IN_Q_OVERFLOW)
+		{
+			_overflow(thiz);
+			continue;
+		}
+		if (ev->mask & IN_IGNORED)
+		{
+			_watch_unset(thiz, ev->wd);
+			continue;
+		}
+		/* only the entries of the watched directories are of interest */
+		if (!ev->len || ev->wd < 0 || ev->wd >= thiz->watches_size)
+			continue;
+		parent = thiz->watches[ev->wd];
+		if (!parent)
+			continue;
+		path = malloc(strlen(parent) + strlen(ev->name) + 2);
+		sprintf(path, "%s/%s", parent, ev->name);
+		_event(thiz, ev->mask, ev->cookie, path);
+		free(path);
+	}
+}
+
+#if HAVE_FANOTIFY
+/* The path of a directory and a name reported by fanotify, the directory is
+ * opened by its handle to know where it is now. NULL if it is gone, outside
+ * the base path or with filter a file we do not parse
+ */
+static char * _fanotify_path(Mdfs_Monitor *thiz,
+		struct fanotify_event_info_fid *fid, int filter)
+{
+	struct file_handle *fh = (struct file_handle *)fid->handle;
+	const char *name = (const char *)fh->f_handle + fh->handle_bytes;
+	const char *basepath = thiz->mdfs->basepath;
+	char link[32];
+	char dir[PATH_MAX];
+	char *path;
+	ssize_t len;
+	int fd;
+
+	/* most of the events on the filesystem are none of our business,
+	 * avoid looking up their directory
+	 */
+	if (filter && !libmetadatafs_supported(name))
+		return NULL;
+	fd = open_by_handle_at(thiz->mount_fd, fh, O_PATH | O_CLOEXEC);
+	if (fd < 0)
+		return NULL;
+	sprintf(link, "/proc/self/fd/%d", fd);
+	len = readlink(link, dir, sizeof(dir) - 1);
+	close(fd);
+	if (len < 0)
+		return NULL;
+	dir[len] = '\0';
+	if (!_path_under(dir, thiz->root, thiz->root_len))
+		return NULL;
+	/* the same path but under the base path as it was given */
+	path = malloc(strlen(basepath) + len - thiz->root_len +
+			strlen(name) + 2);
+	sprintf(path, "%s%s/%s", basepath, dir + thiz->root_len, name);
+	return path;
+}
+
+static void _fanotify_event(Mdfs_Monitor *thiz,
+		struct fanotify_event_metadata *md)
+{
+	char *ptr = (char *)(md + 1);
+	char *end = (char *)md + md->event_len;
+	char *from = NULL;
+	char *to = NULL;
+	uint32_t mask = 0;
+	int dir = !!(md->mask & FAN_ONDIR);
+	int rename = 0;
+
+	if (md->mask & FAN_Q_OVERFLOW)
+	{
+		_overflow(thiz);
+		return;
+	}
+#ifdef FAN_RENAME
+	rename = !!(md->mask & FAN_RENAME);
+#endif
+	while (ptr + sizeof(struct fanotify_event_info_header) <= end)
+	{
+		struct fanotify_event_info_header *h = (void *)ptr;
+		struct fanotify_event_info_fid *fid = (void *)ptr;
+
+		if (!h->len)
+			break;
+		ptr += h->len;
+		switch (h->info_type)
+		{
+			case FAN_EVENT_INFO_TYPE_DFID_NAME:
+			if (!to)
+				to = _fanotify_path(thiz, fid, !dir);
+			break;
+#ifdef FAN_RENAME
+			/* a file renamed from or to something we do not
+			 * parse still matters
+			 */
+			case FAN_EVENT_INFO_TYPE_OLD_DFID_NAME:
+			if (!from)
+				from = _fanotify_path(thiz, fid, 0);
+			break;
+
+			case FAN_EVENT_INFO_TYPE_NEW_DFID_NAME:
+			if (!to)
+				to = _fanotify_path(thiz, fid, 0);
+			break;
+#endif
+			default:
+			break;
+		}
+	}
+	if (rename)
+	{
+		if (from && to)
+		{
+			_active(thiz, to);
+			_moved(thiz, from, to, dir);
+		}
+		else if (from)
+			_event(thiz, IN_MOVED_FROM | (dir ? IN_ISDIR : 0), 0, from);
+		else if (to)
+			_event(thiz, IN_MOVED_TO | (dir ? IN_ISDIR : 0), 0, to);
+	}
+	else if (to)
+	{
+		if (md->mask & FAN_CREATE)
+			mask |= IN_CREATE;
+		if (md->mask & FAN_DELETE)
+			mask |= IN_DELETE;
+		if (md->mask & FAN_CLOSE_WRITE)
+			mask |= IN_CLOSE_WRITE;
+		if (md->mask & FAN_MOVED_FROM)
+			mask |= IN_MOVED_FROM;
+		if (md->mask & FAN_MOVED_TO)
+			mask |= IN_MOVED_TO;
+		if (dir)
+			mask |= IN_ISDIR;
+		_event(thiz, mask, 0, to);
+	}
+	free(from);
+	free(to);
+}
+
+static void _fanotify_read(Mdfs_Monitor *thiz, char *buf, ssize_t len)
+{
+	struct fanotify_event_metadata *md;
+
+	for (md = (struct fanotify_event_metadata *)buf; FAN_EVENT_OK(md, len);
+			md = FAN_EVENT_NEXT(md, len))
+	{
+		_fanotify_event(thiz, md);
+		/* no descriptor comes along when the fids are reported */
+		if (md->fd >= 0)
+			close(md->fd);
+	}
+}
+
+/* Mark the whole filesystem of the base path, returns whether fanotify can
+ * be used. The directory events need the filesystem mark, a mount mark does
+ * not get them
+ */
+static int _fanotify_init(Mdfs_Monitor *thiz)
+{
+	const char *basepath = thiz->mdfs->basepath;
+	int ret = -1;
+	int fd;
+
+	fd = fanotify_init(FAN_CLASS_NOTIF | FAN_CLOEXEC | FAN_REPORT_DFID_NAME,
+			O_RDONLY | O_LARGEFILE | O_CLOEXEC);
+	if (fd < 0)
+	{
+		printf("monitor: cannot use fanotify (%d), watching every "
+				"directory with inotify\n", errno);
+		return 0;
+	}
+#ifdef FAN_RENAME
+	/* both paths of a rename on a single event, since linux 5.17 */
+	ret = fanotify_mark(fd, FAN_MARK_ADD | FAN_MARK_FILESYSTEM,
+			MONITOR_FAN_MASK | FAN_RENAME, AT_FDCWD, basepath);
+#endif
+	if (ret < 0)
+		ret = fanotify_mark(fd, FAN_MARK_ADD | FAN_MARK_FILESYSTEM,
+				MONITOR_FAN_MASK | FAN_MOVED_FROM |
+				FAN_MOVED_TO, AT_FDCWD, basepath);
+	if (ret < 0)
+	{
+		printf("monitor: cannot mark %s with fanotify (%d), watching "
+				"every directory with inotify\n", basepath,
+				errno);
+		goto mark_err;
+	}
+	thiz->mount_fd = open(basepath, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (thiz->mount_fd < 0)
+		goto mark_err;
+	thiz->root = realpath(basepath, NULL);
+	if (!thiz->root)
+		goto root_err;
+	thiz->root_len = strlen(thiz->root);
+	thiz->fd = fd;
+	thiz->fanotify = 1;
+	return 1;
+root_err:
+	close(thiz->mount_fd);
+	thiz->mount_fd = -1;
+mark_err:
+	close(fd);
+	return 0;
+}
+#endif
+
+static void * _monitor_run(void *data)
+{
+	Mdfs_Monitor *thiz = data;
+	char buf[BUF_LEN] __attribute__((aligned(8)));
+	int timeout = -1;
+	int expire;
+
+	printf("monitor: watching %s%s\n", thiz->mdfs->basepath,
+			thiz->fanotify ? " through fanotify" : "");
+	if (!thiz->fanotify)
+		_watch_tree(thiz, thiz->mdfs->basepath, 0);
+	for (;;)
+	{
+		struct pollfd fds[2];
+		ssize_t len;
+
+		fds[0].fd = thiz->fd;
+		fds[0].events = POLLIN;
+		fds[1].fd = thiz->wake[0];
+		fds[1].events = POLLIN;
+		if (poll(fds, 2, timeout) < 0 && errno != EINTR)
+			break;
+		if (fds[1].revents)
+			break;
+		if (fds[0].revents & POLLIN)
+		{
+			len = read(thiz->fd, buf, sizeof(buf));
+#if HAVE_FANOTIFY
+			if (thiz->fanotify)
+				_fanotify_read(thiz, buf, len);
+			else
+#endif
+				_inotify_read(thiz, buf, len);
+		}
+		if (thiz->retry && thiz->retry <= _now())
+			_unwatched_retry(thiz);
+		expire = _moves_expire(thiz, 0);
+		timeout = _changes_apply(thiz, 0);
+		if (expire >= 0 && (timeout < 0 || expire < timeout))
+			timeout = expire;
+		if (thiz->retry)
+		{
+			expire = (thiz->retry - _now()) * 1000 + 1;
+			if (timeout < 0 || expire < timeout)
+				timeout = expire;
+		}
+	}
+	/* whatever is pending is applied, the writer is still there */
+	_moves_expire(thiz, 1);
+	_changes_apply(thiz, 1);
+	return NULL;
+}
+/*============================================================================*
+ *                                 Global                                     *
+ *============================================================================*/
+Mdfs_Monitor * mdfs_monitor_new(metadatafs *mdfs)
+{
+	Mdfs_Monitor *thiz;
+	const char *backend = mdfs->monitor_backend;
+
+	thiz = calloc(1, sizeof(Mdfs_Monitor));
+	if (!thiz) return NULL;
+	thiz->mdfs = mdfs;
+	thiz->mount_fd = -1;
+	if (backend && strcmp(backend, "auto") &&
+			strcmp(backend, "fanotify") && strcmp(backend, "inotify"))
+		printf("unknown monitor backend %s, using auto\n", backend);
+#if HAVE_FANOTIFY
+	if (!backend || strcmp(backend, "inotify"))
+		_fanotify_init(thiz);
+#else
+	if (backend && !strcmp(backend, "fanotify"))
+		printf("monitor: built without fanotify, watching every "
+				"directory with inotify\n");
+#endif
+	if (!thiz->fanotify)
+		thiz->fd = inotify_init1(IN_CLOEXEC);
+	if (thiz->fd < 0)
+	{
+		printf("monitor: error initializing inotify (%d)\n", errno);
+		goto init_err;
+	}
+	if (pipe(thiz->wake) < 0)
+		goto pipe_err;
+	_table_grow(&thiz->changes);
+	_table_grow(&thiz->active);
+	if (pthread_create(&thiz->thread, NULL, _monitor_run, thiz))
+	{
+		perror("pthread_create");
+		goto thread_err;
+	}
+	thiz->running = 1;
+	return thiz;
+thread_err:
+	_table_free(&thiz->changes);
+	_table_free(&thiz->active);
+	close(thiz->wake[0]);
+	close(thiz->wake[1]);
+pipe_err:
+	close(thiz->fd);
+	if (thiz->mount_fd >= 0)
+		close(thiz->mount_fd);
+	free(thiz->root);
+init_err:
+	free(thiz);
+	return NULL;
+}
+
+/* stop monitoring, the changes not applied yet are sent to the writer */
+void mdfs_monitor_free(Mdfs_Monitor *thiz)
+{
+	int i;
+
+	if (thiz->running)
+	{
+		if (write(thiz->wake[1], "", 1) < 0)
+			perror("write");
+		pthread_join(thiz->thread, NULL);
+	}
+	for (i = 0; i < thiz->watches_size; i++)
+		free(thiz->watches[i]);
+	free(thiz->watches);
+	for (i = 0; i < (int)thiz->unwatched_count; i++)
+		free(thiz->unwatched[i]);
+	free(thiz->unwatched);
+	_table_free(&thiz->changes);
+	_table_free(&thiz->active);
+	free(thiz->moves);
+	close(thiz->wake[0]);
+	close(thiz->wake[1]);
+	close(thiz->fd);
+	if (thiz->mount_fd >= 0)
+		close(thiz->mount_fd);
+	free(thiz->root);
+	free(thiz);
+}
+#endif
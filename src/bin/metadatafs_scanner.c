@@ -0,0 +1,1800 @@
+/* MetadataFS -
+ * Copyright (C) 2010 Jorge Luis Zapata
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library.
+ * If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * The scanner walks the source directory with a pool of workers. Every worker
+ * has its own deque of pending directories, new subdirectories are pushed on
+ * the tail and popped from the tail again (depth first, so the dentries stay
+ * warm), while idle workers steal from the head of the other deques (the
+ * oldest entries, which usually are the biggest subtrees).
+ */
+#include "metadatafs.h"
+#include "libmetadatafs.h"
+#include <time.h>
+#include <sys/sysmacros.h>
+#include <sys/syscall.h>
+#include <sys/resource.h>
+#if HAVE_FIEMAP
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+#include <linux/fiemap.h>
+#endif
+/*============================================================================*
+ *                                  Local                                     *
+ *============================================================================*/
+#define DEQUE_INITIAL_SIZE 64
+
+/* what the tag parser reads at least from every file it parses, used to
+ * account the bandwidth when the actual reads are not known
+ */
+#define BUDGET_READ_SIZE 4096
+/* the longest a worker sleeps before checking if it has been cancelled */
+#define BUDGET_SLEEP_MAX 0.1
+
+#ifndef IOPRIO_WHO_PROCESS
+#define IOPRIO_WHO_PROCESS 1
+#endif
+#ifndef IOPRIO_CLASS_IDLE
+#define IOPRIO_CLASS_IDLE 3
+#endif
+#ifndef IOPRIO_CLASS_SHIFT
+#define IOPRIO_CLASS_SHIFT 13
+#endif
+
+#if HAVE_IO_URING
+/* how much of every file is read ahead of the tag parsing */
+#define URING_HEADER_SIZE 16384
+/* the operations whose result nobody waits for */
+#define URING_IGNORE (1UL << (sizeof(unsigned long) * 8 - 1))
+#endif
+
+/* the order in which the entries of a directory are examined */
+typedef enum _Mdfs_Scanner_Order
+{
+	MDFS_SCANNER_ORDER_READDIR,
+	MDFS_SCANNER_ORDER_INODE,
+	MDFS_SCANNER_ORDER_EXTENT,
+} Mdfs_Scanner_Order;
+
+/* a directory entry batched to be examined later */
+typedef struct _Mdfs_Scanner_Entry
+{
+	char *name;
+	int supported;
+	int changed;
+	/* where the entry is, to examine them in disk order */
+	ino_t ino;
+	uint64_t physical;
+	struct stat st;
+#if HAVE_IO_URING
+	int fd;
+	int res;
+	/* what was read of the header */
+	size_t len;
+	struct statx stx;
+#endif
+} Mdfs_Scanner_Entry;
+
+typedef struct _Mdfs_Scanner_Hint
+{
+	char *path;
+	/* scan the subdirectories too */
+	int subdirs;
+} Mdfs_Scanner_Hint;
+
+typedef struct _Mdfs_Scanner_Worker
+{
+	Mdfs_Scanner *scanner;
+	pthread_t thread;
+	unsigned int index;
+	int running;
+	/* the directory being scanned */
+	char *current;
+	/* the directory being scanned was hinted */
+	int hinted;
+	int hinted_subdirs;
+	/* the deque of pending directories */
+	pthread_mutex_t lock;
+	char **dirs;
+	unsigned int size;
+	unsigned int head;
+	unsigned int count;
+	/* the path of the entry being scanned */
+	char *path;
+	size_t path_size;
+	/* the last line read from the manifest */
+	char *line;
+	size_t line_size;
+	/* the entries batched to be examined at once */
+	Mdfs_Scanner_Entry *batch;
+	unsigned int nbatch;
+	unsigned int batch_size;
+#if HAVE_IO_URING
+	/* the io_uring engine and the headers read by it */
+	Mdfs_Uring *uring;
+	char *headers;
+	/* we are allowed to open without updating the access time */
+	int noatime;
+#endif
+	/* statistics, only the worker writes them but they are read at any
+	 * time by whoever asks for the progress
+	 */
+	unsigned long seen;
+	unsigned long files;
+	unsigned long unchanged;
+	unsigned long moved;
+	unsigned long failed;
+	unsigned long long bytes;
+	unsigned long directories;
+	unsigned long skipped;
+	struct timespec start;
+	struct timespec end;
+} Mdfs_Scanner_Worker;
+
+struct _Mdfs_Scanner
+{
+	metadatafs *mdfs;
+	Mdfs_Index *index;
+	Mdfs_Scanner_Worker *workers;
+	unsigned int nworkers;
+	/* directories queued on any deque and directories queued or being
+	 * scanned, once the later reaches zero the walk is done
+	 */
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	/* signaled once the walk is done or cancelled */
+	pthread_cond_t done;
+	int queued;
+	int pending;
+	int cancel;
+	/* taken for writing to get a consistent view of the directories
+	 * left to walk
+	 */
+	pthread_rwlock_t walk_lock;
+	/* some directory or manifest line could not be read, the entries
+	 * might still exist and must not be swept
+	 */
+	int incomplete;
+	/* examine every file, even on unchanged directories */
+	int verify;
+	/* only some subtrees are walked, not the whole tree */
+	int partial;
+	/* the list of files read instead of walking the tree */
+	FILE *manifest;
+	pthread_mutex_t manifest_lock;
+	unsigned long manifest_line;
+	Mdfs_Scanner_Order order;
+	/* the directories hinted by the users, scanned before anything else */
+	Mdfs_Scanner_Hint *hints;
+	unsigned int nhints;
+	unsigned int hints_size;
+	/* hash of the directories whose files have been examined on this
+	 * walk, a directory might be reached by both a hint and the walk
+	 */
+	uint64_t *claimed;
+	unsigned int claimed_size;
+	unsigned int claimed_count;
+	/* progress of the current or last walk */
+	int running;
+	unsigned long expected;
+	struct timespec start;
+	struct timespec end;
+	/* the last sample taken to compute the current rate */
+	struct timespec sample_time;
+	unsigned long sample_seen;
+	double rate;
+	/* the budget shared by every worker, the time at which the next file
+	 * can be examined and the next byte read
+	 */
+	pthread_mutex_t budget_lock;
+	double budget_files;
+	double budget_bytes;
+};
+
+/* the statistics are updated on the hot loop of the workers, each counter
+ * has a single writer so a relaxed store is enough for the readers to never
+ * see a torn value
+ */
+#define STAT_ADD(c, n) __atomic_store_n(&(c), (c) + (n), __ATOMIC_RELAXED)
+#define STAT_GET(c) __atomic_load_n(&(c), __ATOMIC_RELAXED)
+
+static double _timespec_diff(struct timespec *start, struct timespec *end)
+{
+	return (end->tv_sec - start->tv_sec) +
+			(end->tv_nsec - start->tv_nsec) / 1000000000.0;
+}
+
+static double _now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1000000000.0;
+}
+
+/* reserve amount units on a budget of rate units per second, returns how long
+ * to wait before using them
+ */
+static double _budget_take(double *next, double now, unsigned long long amount,
+		double rate)
+{
+	/* nothing is saved for later, an idle budget starts again from now */
+	if (*next < now)
+		*next = now;
+	*next += amount / rate;
+	return *next - amount / rate - now;
+}
+
+/* Account the files examined and the bytes read by a worker on the scanner
+ * budget, and sleep until they fit on it. While lookups on the mount point
+ * are being served the worker also waits a bit, to leave the catalog and the
+ * disks to them
+ */
+static void _throttle(Mdfs_Scanner_Worker *w, unsigned int files,
+		unsigned long long bytes)
+{
+	Mdfs_Scanner *thiz = w->scanner;
+	metadatafs *mdfs = thiz->mdfs;
+	double wait = 0;
+
+	if (mdfs->scan_yield && __atomic_load_n(&mdfs->requests,
+			__ATOMIC_RELAXED))
+		wait = mdfs->scan_yield / 1000.0;
+	if ((files && mdfs->scan_rate) || (bytes && mdfs->scan_bandwidth))
+	{
+		double now = _now();
+		double d;
+
+		pthread_mutex_lock(&thiz->budget_lock);
+		if (files && mdfs->scan_rate)
+		{
+			d = _budget_take(&thiz->budget_files, now, files,
+					mdfs->scan_rate);
+			if (d > wait) wait = d;
+		}
+		if (bytes && mdfs->scan_bandwidth)
+		{
+			d = _budget_take(&thiz->budget_bytes, now, bytes,
+					mdfs->scan_bandwidth * 1024.0);
+			if (d > wait) wait = d;
+		}
+		pthread_mutex_unlock(&thiz->budget_lock);
+	}
+	while (wait > 0 && !thiz->cancel)
+	{
+		double step = wait < BUDGET_SLEEP_MAX ? wait : BUDGET_SLEEP_MAX;
+		struct timespec ts;
+
+		ts.tv_sec = step;
+		ts.tv_nsec = (step - ts.tv_sec) * 1000000000.0;
+		nanosleep(&ts, NULL);
+		wait -= step;
+	}
+}
+
+/* add a directory to the hints, must be called with the lock held */
+static void _hint_push(Mdfs_Scanner *thiz, char *path, int subdirs)
+{
+	if (thiz->nhints == thiz->hints_size)
+	{
+		thiz->hints_size = thiz->hints_size ? thiz->hints_size * 2 :
+				DEQUE_INITIAL_SIZE;
+		thiz->hints = realloc(thiz->hints,
+				sizeof(Mdfs_Scanner_Hint) * thiz->hints_size);
+	}
+	thiz->hints[thiz->nhints].path = path;
+	thiz->hints[thiz->nhints].subdirs = subdirs;
+	thiz->nhints++;
+	thiz->queued++;
+	thiz->pending++;
+}
+
+/* Mark the files of a directory as being examined on this walk. Returns 0
+ * if they already were
+ */
+static int _claim(Mdfs_Scanner *thiz, const char *path)
+{
+	uint64_t hash;
+	unsigned int i;
+	unsigned int mask;
+	int ret = 1;
+
+	hash = mdfs_index_hash(path);
+	pthread_mutex_lock(&thiz->lock);
+	if (thiz->claimed_count >= thiz->claimed_size / 2)
+	{
+		uint64_t *old = thiz->claimed;
+		unsigned int size = thiz->claimed_size;
+
+		thiz->claimed_size = size ? size * 2 : 1024;
+		thiz->claimed = calloc(thiz->claimed_size, sizeof(uint64_t));
+		mask = thiz->claimed_size - 1;
+		for (i = 0; i < size; i++)
+		{
+			unsigned int j;
+
+			if (!old[i]) continue;
+			for (j = old[i] & mask; thiz->claimed[j]; j = (j + 1) & mask);
+			thiz->claimed[j] = old[i];
+		}
+		free(old);
+	}
+	mask = thiz->claimed_size - 1;
+	for (i = hash & mask; thiz->claimed[i]; i = (i + 1) & mask)
+	{
+		if (thiz->claimed[i] == hash)
+		{
+			ret = 0;
+			goto done;
+		}
+	}
+	thiz->claimed[i] = hash;
+	thiz->claimed_count++;
+done:
+	pthread_mutex_unlock(&thiz->lock);
+	return ret;
+}
+
+/* the deque functions */
+static void _worker_push(Mdfs_Scanner_Worker *w, char *path)
+{
+	Mdfs_Scanner *thiz = w->scanner;
+
+	pthread_mutex_lock(&thiz->lock);
+	/* the subdirectories of a hinted directory are hinted too */
+	if (w->hinted)
+	{
+		_hint_push(thiz, path, 1);
+		pthread_mutex_unlock(&thiz->lock);
+		pthread_cond_signal(&thiz->cond);
+		return;
+	}
+	thiz->queued++;
+	thiz->pending++;
+	pthread_mutex_unlock(&thiz->lock);
+
+	pthread_mutex_lock(&w->lock);
+	if (w->count == w->size)
+	{
+		char **dirs;
+		unsigned int i;
+
+		/* unroll the ring on the bigger buffer */
+		dirs = malloc(sizeof(char *) * w->size * 2);
+		for (i = 0; i < w->count; i++)
+			dirs[i] = w->dirs[(w->head + i) % w->size];
+		free(w->dirs);
+		w->dirs = dirs;
+		w->head = 0;
+		w->size *= 2;
+	}
+	w->dirs[(w->head + w->count) % w->size] = path;
+	w->count++;
+	pthread_mutex_unlock(&w->lock);
+
+	pthread_cond_signal(&thiz->cond);
+}
+
+static char * _worker_pop(Mdfs_Scanner_Worker *w)
+{
+	char *path = NULL;
+
+	pthread_mutex_lock(&w->lock);
+	if (w->count)
+	{
+		w->count--;
+		path = w->dirs[(w->head + w->count) % w->size];
+	}
+	pthread_mutex_unlock(&w->lock);
+	return path;
+}
+
+static char * _worker_steal(Mdfs_Scanner_Worker *w)
+{
+	char *path = NULL;
+
+	pthread_mutex_lock(&w->lock);
+	if (w->count)
+	{
+		path = w->dirs[w->head];
+		w->head = (w->head + 1) % w->size;
+		w->count--;
+	}
+	pthread_mutex_unlock(&w->lock);
+	return path;
+}
+
+/* take a directory from the hints, our own deque or some other worker's */
+static char * _worker_take(Mdfs_Scanner_Worker *w)
+{
+	Mdfs_Scanner *thiz = w->scanner;
+	char *path;
+	unsigned int i;
+
+	/* what the users are waiting for goes first */
+	if (__atomic_load_n(&thiz->nhints, __ATOMIC_RELAXED))
+	{
+		pthread_mutex_lock(&thiz->lock);
+		if (thiz->nhints)
+		{
+			thiz->nhints--;
+			path = thiz->hints[thiz->nhints].path;
+			w->hinted_subdirs = thiz->hints[thiz->nhints].subdirs;
+			pthread_mutex_unlock(&thiz->lock);
+			w->hinted = 1;
+			return path;
+		}
+		pthread_mutex_unlock(&thiz->lock);
+	}
+	w->hinted = 0;
+	path = _worker_pop(w);
+	for (i = 1; !path && i < thiz->nworkers; i++)
+		path = _worker_steal(&thiz->workers[(w->index + i) % thiz->nworkers]);
+	return path;
+}
+
+/* get the next directory to scan. Returns NULL once the whole tree has been
+ * walked
+ */
+static char * _worker_next(Mdfs_Scanner_Worker *w)
+{
+	Mdfs_Scanner *thiz = w->scanner;
+	char *path;
+
+	for (;;)
+	{
+		if (thiz->cancel)
+			return NULL;
+		/* a directory is always either queued or current, so the
+		 * checkpoints never miss one
+		 */
+		pthread_rwlock_rdlock(&thiz->walk_lock);
+		path = _worker_take(w);
+		w->current = path;
+		pthread_rwlock_unlock(&thiz->walk_lock);
+
+		pthread_mutex_lock(&thiz->lock);
+		if (path)
+		{
+			thiz->queued--;
+			pthread_mutex_unlock(&thiz->lock);
+			return path;
+		}
+		while (!thiz->queued && thiz->pending && !thiz->cancel)
+			pthread_cond_wait(&thiz->cond, &thiz->lock);
+		if (!thiz->pending || thiz->cancel)
+		{
+			pthread_mutex_unlock(&thiz->lock);
+			return NULL;
+		}
+		pthread_mutex_unlock(&thiz->lock);
+	}
+}
+
+static void _worker_done(Mdfs_Scanner_Worker *w)
+{
+	Mdfs_Scanner *thiz = w->scanner;
+
+	pthread_mutex_lock(&thiz->lock);
+	thiz->pending--;
+	if (!thiz->pending)
+	{
+		pthread_cond_broadcast(&thiz->cond);
+		pthread_cond_broadcast(&thiz->done);
+	}
+	pthread_mutex_unlock(&thiz->lock);
+}
+
+/* parse the tags here, this is what actually runs in parallel, the catalog
+ * is updated by the writer
+ */
+static void _scan_tags(Mdfs_Scanner_Worker *w, const char *realfile,
+		struct stat *st, const void *header, size_t len)
+{
+	metadatafs *mdfs = w->scanner->mdfs;
+	libmetadatafs_tags tags;
+
+	if (!libmetadatafs_tags_get(realfile, header, len, &tags))
+	{
+		STAT_ADD(w->failed, 1);
+		return;
+	}
+	mdfs_writer_file_add(mdfs->writer, realfile, st, tags.artist,
+			tags.album, tags.title);
+	STAT_ADD(w->files, 1);
+	/* the header of the io_uring path and whatever the parser read */
+	STAT_ADD(w->bytes, tags.read > len ? tags.read : len);
+}
+
+/* check if the file has changed since the last scan */
+static int _scan_file_changed(Mdfs_Scanner_Worker *w, const char *realfile,
+		struct stat *st)
+{
+	Mdfs_Index *index = w->scanner->index;
+
+	STAT_ADD(w->seen, 1);
+	if (!index)
+		return 1;
+	if (!mdfs_index_changed(index, realfile, st->st_mtime, st->st_size))
+	{
+		mdfs_writer_file_touch(w->scanner->mdfs->writer, realfile, st);
+		STAT_ADD(w->unchanged, 1);
+		return 0;
+	}
+	/* a new path for the same untouched file, it has been moved, renamed
+	 * or linked, the tags are the same
+	 */
+	if (mdfs_index_identity_known(index, st->st_dev, st->st_ino,
+			st->st_mtime, st->st_size))
+	{
+		mdfs_writer_file_move(w->scanner->mdfs->writer, realfile, st);
+		STAT_ADD(w->moved, 1);
+		return 0;
+	}
+	return 1;
+}
+
+/* returns what is accounted as read from the file */
+static unsigned long long _scan_file(Mdfs_Scanner_Worker *w,
+		const char *realfile, struct stat *st)
+{
+	if (!_scan_file_changed(w, realfile, st))
+		return 0;
+	_scan_tags(w, realfile, st, NULL, 0);
+	return st->st_size < BUDGET_READ_SIZE ? st->st_size : BUDGET_READ_SIZE;
+}
+
+/* make the worker path buffer hold at least len bytes */
+static char * _worker_path_reserve(Mdfs_Scanner_Worker *w, size_t len)
+{
+	if (len > w->path_size)
+	{
+		while (w->path_size < len)
+			w->path_size = w->path_size ? w->path_size * 2 : 256;
+		w->path = realloc(w->path, w->path_size);
+	}
+	return w->path;
+}
+
+/* split a manifest line in its path, size and modification time, separated
+ * by tabs. The numbers are taken from the end so the path can have tabs too
+ */
+static int _manifest_parse(char *line, off_t *size, time_t *mtime)
+{
+	char *sep;
+	char *end;
+
+	sep = strrchr(line, '\t');
+	if (!sep) return 0;
+	*sep = '\0';
+	*mtime = strtoll(sep + 1, &end, 10);
+	/* the fraction of a second is not stored */
+	if (end == sep + 1 || (*end && *end != '.'))
+		return 0;
+	sep = strrchr(line, '\t');
+	if (!sep) return 0;
+	*sep = '\0';
+	*size = strtoll(sep + 1, &end, 10);
+	if (end == sep + 1 || *end)
+		return 0;
+	return *line != '\0';
+}
+
+/* Get the next supported file of the manifest on the worker path buffer.
+ * Relative paths are relative to the base path, absolute ones must be under
+ * it. Returns NULL once the manifest has been consumed
+ */
+static char * _manifest_next(Mdfs_Scanner_Worker *w, off_t *size,
+		time_t *mtime)
+{
+	Mdfs_Scanner *thiz = w->scanner;
+	const char *basepath = thiz->mdfs->basepath;
+	size_t blen = strlen(basepath);
+
+	while (!thiz->cancel)
+	{
+		unsigned long number;
+		ssize_t len;
+		char *line;
+
+		pthread_mutex_lock(&thiz->manifest_lock);
+		len = getline(&w->line, &w->line_size, thiz->manifest);
+		number = ++thiz->manifest_line;
+		pthread_mutex_unlock(&thiz->manifest_lock);
+		if (len < 0)
+			return NULL;
+
+		line = w->line;
+		while (len && (line[len - 1] == '\n' || line[len - 1] == '\r'))
+			line[--len] = '\0';
+		if (!len || *line == '#')
+			continue;
+		if (!_manifest_parse(line, size, mtime))
+		{
+			printf("manifest line %lu is malformed\n", number);
+			STAT_ADD(w->failed, 1);
+			thiz->incomplete = 1;
+			continue;
+		}
+		if (!libmetadatafs_supported(line))
+			continue;
+		if (*line == '/')
+		{
+			if (strncmp(line, basepath, blen) || line[blen] != '/')
+			{
+				printf("manifest line %lu is not under %s\n",
+						number, basepath);
+				STAT_ADD(w->failed, 1);
+				thiz->incomplete = 1;
+				continue;
+			}
+			len = strlen(line);
+			_worker_path_reserve(w, len + 1);
+			memcpy(w->path, line, len + 1);
+		}
+		else
+		{
+			len = strlen(line);
+			_worker_path_reserve(w, blen + len + 2);
+			memcpy(w->path, basepath, blen);
+			w->path[blen] = '/';
+			memcpy(w->path + blen + 1, line, len + 1);
+		}
+		return w->path;
+	}
+	return NULL;
+}
+
+/* Examine the files listed on the manifest. What has the same size and
+ * modification time as on the catalog is trusted without even a stat, the
+ * rest is examined as if it was found by a walk. With verify every listed
+ * file is examined
+ */
+static void _scan_manifest(Mdfs_Scanner_Worker *w)
+{
+	Mdfs_Scanner *thiz = w->scanner;
+	char *path;
+	off_t size;
+	time_t mtime;
+
+	while ((path = _manifest_next(w, &size, &mtime)))
+	{
+		struct stat st;
+
+		if (!thiz->verify && thiz->index &&
+				!mdfs_index_changed(thiz->index, path, mtime, size))
+		{
+			/* without an inode the identity on the catalog is kept */
+			memset(&st, 0, sizeof(st));
+			mdfs_writer_file_touch(thiz->mdfs->writer, path, &st);
+			STAT_ADD(w->seen, 1);
+			STAT_ADD(w->unchanged, 1);
+			_throttle(w, 1, 0);
+			continue;
+		}
+		if (stat(path, &st) < 0 || !S_ISREG(st.st_mode))
+		{
+			printf("cannot examine %s from the manifest\n", path);
+			STAT_ADD(w->seen, 1);
+			STAT_ADD(w->failed, 1);
+			continue;
+		}
+		_throttle(w, 1, _scan_file(w, path, &st));
+	}
+}
+
+/* check if a directory entry must be looked at, based only on what readdir
+ * tells us
+ */
+static int _entry_wanted(struct dirent *de, int files, int dirs,
+		int *supported)
+{
+	unsigned char type = de->d_type;
+
+	/* skip what we know in advance we do not need */
+	if (type != DT_REG && type != DT_DIR &&
+			type != DT_LNK && type != DT_UNKNOWN)
+		return 0;
+	if (type == DT_DIR)
+	{
+		*supported = 0;
+		return dirs;
+	}
+	*supported = libmetadatafs_supported(de->d_name);
+	if (type == DT_REG && (!files || !*supported))
+		return 0;
+	/* an unknown type with a supported name is most likely a file */
+	if (!files && *supported)
+		return 0;
+	return 1;
+}
+
+/* append the entry name to the directory path on the worker buffer */
+static void _entry_path(Mdfs_Scanner_Worker *w, size_t plen, const char *name)
+{
+	size_t nlen;
+
+	nlen = strlen(name);
+	_worker_path_reserve(w, plen + nlen + 1);
+	memcpy(w->path + plen, name, nlen + 1);
+}
+
+static int _entry_is_dots(struct dirent *de)
+{
+	return de->d_name[0] == '.' && (!de->d_name[1] ||
+			(de->d_name[1] == '.' && !de->d_name[2]));
+}
+
+/* the physical position of the data of a file, zero if unknown */
+static uint64_t _entry_physical(int dirfd, const char *name)
+{
+#if HAVE_FIEMAP
+	union
+	{
+		struct fiemap map;
+		char buf[sizeof(struct fiemap) + sizeof(struct fiemap_extent)];
+	} fm;
+	uint64_t physical = 0;
+	int fd;
+
+	fd = openat(dirfd, name, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return 0;
+	/* only the first extent, the tags are at the beginning */
+	memset(&fm, 0, sizeof(fm));
+	fm.map.fm_length = FIEMAP_MAX_OFFSET;
+	fm.map.fm_extent_count = 1;
+	if (!ioctl(fd, FS_IOC_FIEMAP, &fm.map) && fm.map.fm_mapped_extents)
+		physical = fm.map.fm_extents[0].fe_physical;
+	close(fd);
+	return physical;
+#else
+	return 0;
+#endif
+}
+
+/* by physical position first, the inode order is the next best guess */
+static int _entry_cmp(const void *a, const void *b)
+{
+	const Mdfs_Scanner_Entry *ea = a;
+	const Mdfs_Scanner_Entry *eb = b;
+
+	if (ea->physical != eb->physical)
+		return ea->physical < eb->physical ? -1 : 1;
+	if (ea->ino != eb->ino)
+		return ea->ino < eb->ino ? -1 : 1;
+	return 0;
+}
+
+static Mdfs_Scanner_Entry * _batch_add(Mdfs_Scanner_Worker *w,
+		struct dirent *de, int supported)
+{
+	Mdfs_Scanner_Entry *e;
+
+	if (w->nbatch == w->batch_size)
+	{
+		w->batch_size = w->batch_size ? w->batch_size * 2 :
+				DEQUE_INITIAL_SIZE;
+		w->batch = realloc(w->batch,
+				sizeof(Mdfs_Scanner_Entry) * w->batch_size);
+	}
+	e = &w->batch[w->nbatch++];
+	e->name = strdup(de->d_name);
+	e->supported = supported;
+	e->changed = 0;
+	e->ino = de->d_ino;
+	e->physical = 0;
+#if HAVE_IO_URING
+	e->fd = -1;
+#endif
+	return e;
+}
+
+static void _batch_clear(Mdfs_Scanner_Worker *w)
+{
+	unsigned int i;
+
+	for (i = 0; i < w->nbatch; i++)
+		free(w->batch[i].name);
+	w->nbatch = 0;
+}
+
+/* Go over the entries of a directory. The entries are looked up relative to
+ * the directory fd, the type is taken from d_type whenever the filesystem
+ * provides it and only the files the backend supports are stat'ed. The full
+ * path is only built for the entries we actually need it for. Returns the
+ * number of entries found
+ */
+static unsigned int _scan_entries(Mdfs_Scanner_Worker *w, DIR *dp, int fd,
+		size_t plen, int files, int dirs)
+{
+	struct dirent *de;
+	unsigned int count = 0;
+
+	while ((de = readdir(dp)) != NULL)
+	{
+		struct stat st;
+		int supported;
+
+		if (w->scanner->cancel)
+			break;
+		if (_entry_is_dots(de))
+			continue;
+		count++;
+		if (!_entry_wanted(de, files, dirs, &supported))
+			continue;
+
+		_entry_path(w, plen, de->d_name);
+		/* subdirs are scanned later, by us or by whoever steals them */
+		if (de->d_type == DT_DIR)
+		{
+			_worker_push(w, strdup(w->path));
+			continue;
+		}
+
+		if (fstatat(fd, de->d_name, &st, 0) < 0)
+		{
+			printf("err on stat %d %s\n", errno, w->path);
+			STAT_ADD(w->failed, 1);
+			continue;
+		}
+		if (S_ISDIR(st.st_mode))
+		{
+			if (dirs)
+				_worker_push(w, strdup(w->path));
+		}
+		else if (S_ISREG(st.st_mode) && files && supported)
+			_throttle(w, 1, _scan_file(w, w->path, &st));
+	}
+	return count;
+}
+
+/* Same as _scan_entries but the entries are examined in the order of their
+ * inodes instead of the readdir order, and with the extent order the changed
+ * files are parsed in the order of their data on the disk. On rotational
+ * storage the stats and the tag reads become a sweep instead of random seeks
+ */
+static unsigned int _scan_entries_ordered(Mdfs_Scanner_Worker *w, DIR *dp,
+		int fd, size_t plen, int files, int dirs)
+{
+	Mdfs_Scanner *thiz = w->scanner;
+	struct dirent *de;
+	unsigned int count = 0;
+	unsigned int changed = 0;
+	unsigned int i;
+
+	while ((de = readdir(dp)) != NULL)
+	{
+		int supported;
+
+		if (thiz->cancel)
+			break;
+		if (_entry_is_dots(de))
+			continue;
+		count++;
+		if (!_entry_wanted(de, files, dirs, &supported))
+			continue;
+
+		if (de->d_type == DT_DIR)
+		{
+			_entry_path(w, plen, de->d_name);
+			_worker_push(w, strdup(w->path));
+			continue;
+		}
+		_batch_add(w, de, supported);
+	}
+	qsort(w->batch, w->nbatch, sizeof(Mdfs_Scanner_Entry), _entry_cmp);
+
+	for (i = 0; i < w->nbatch && !thiz->cancel; i++)
+	{
+		Mdfs_Scanner_Entry *e = &w->batch[i];
+
+		_entry_path(w, plen, e->name);
+		if (fstatat(fd, e->name, &e->st, 0) < 0)
+		{
+			printf("err on stat %d %s\n", errno, w->path);
+			STAT_ADD(w->failed, 1);
+			continue;
+		}
+		if (S_ISDIR(e->st.st_mode))
+		{
+			if (dirs)
+				_worker_push(w, strdup(w->path));
+			continue;
+		}
+		if (!S_ISREG(e->st.st_mode) || !files || !e->supported)
+			continue;
+		if (thiz->order != MDFS_SCANNER_ORDER_EXTENT)
+		{
+			_throttle(w, 1, _scan_file(w, w->path, &e->st));
+			continue;
+		}
+		/* parse once we know where the data of every file is */
+		if (!_scan_file_changed(w, w->path, &e->st))
+		{
+			_throttle(w, 1, 0);
+			continue;
+		}
+		e->changed = 1;
+		e->physical = _entry_physical(fd, e->name);
+		changed++;
+	}
+	if (changed)
+		qsort(w->batch, w->nbatch, sizeof(Mdfs_Scanner_Entry),
+				_entry_cmp);
+	for (i = 0; changed && i < w->nbatch && !thiz->cancel; i++)
+	{
+		Mdfs_Scanner_Entry *e = &w->batch[i];
+
+		if (!e->changed)
+			continue;
+		_entry_path(w, plen, e->name);
+		_scan_tags(w, w->path, &e->st, NULL, 0);
+		_throttle(w, 1, e->st.st_size < BUDGET_READ_SIZE ?
+				e->st.st_size : BUDGET_READ_SIZE);
+	}
+	_batch_clear(w);
+	return count;
+}
+
+#if HAVE_IO_URING
+static void _uring_result(void *data, unsigned long id, int res)
+{
+	Mdfs_Scanner_Entry *entries = data;
+
+	if (id & URING_IGNORE)
+		return;
+	entries[id].res = res;
+}
+
+static void _uring_ignore(void *data, unsigned long id, int res)
+{
+}
+
+static void _statx_to_stat(struct statx *stx, struct stat *st)
+{
+	memset(st, 0, sizeof(struct stat));
+	st->st_dev = makedev(stx->stx_dev_major, stx->stx_dev_minor);
+	st->st_mode = stx->stx_mode;
+	st->st_ino = stx->stx_ino;
+	st->st_nlink = stx->stx_nlink;
+	st->st_size = stx->stx_size;
+	st->st_mtime = stx->stx_mtime.tv_sec;
+	st->st_ctime = stx->stx_ctime.tv_sec;
+}
+
+/* Process the batched entries with the io_uring engine. Instead of one
+ * blocking syscall per file, the stat of every entry is submitted at once,
+ * then the open of every changed file, then the read of their headers and
+ * finally their close. The tags are then parsed from the headers read, only
+ * the tags that do not fit on them need more reads
+ */
+static void _scan_batch(Mdfs_Scanner_Worker *w, Mdfs_Scanner_Entry *batch,
+		unsigned int count, int fd, size_t plen, int files, int dirs)
+{
+	Mdfs_Uring *uring = w->uring;
+	unsigned long long bytes = 0;
+	unsigned int changed = 0;
+	unsigned int i;
+
+	/* the whole batch is accounted at once */
+	_throttle(w, count, 0);
+	for (i = 0; i < count; i++)
+	{
+		Mdfs_Scanner_Entry *e = &batch[i];
+
+		e->res = -ECANCELED;
+		mdfs_uring_statx(uring, fd, e->name, &e->stx, STATX_TYPE |
+				STATX_MODE | STATX_NLINK | STATX_INO |
+				STATX_SIZE | STATX_MTIME | STATX_CTIME, i);
+	}
+	mdfs_uring_complete(uring, _uring_result, batch);
+
+	for (i = 0; i < count; i++)
+	{
+		Mdfs_Scanner_Entry *e = &batch[i];
+
+		e->changed = 0;
+		_entry_path(w, plen, e->name);
+		if (e->res < 0)
+		{
+			printf("err on stat %d %s\n", -e->res, w->path);
+			STAT_ADD(w->failed, 1);
+			continue;
+		}
+		_statx_to_stat(&e->stx, &e->st);
+		if (S_ISDIR(e->st.st_mode))
+		{
+			if (dirs)
+				_worker_push(w, strdup(w->path));
+			continue;
+		}
+		if (!S_ISREG(e->st.st_mode) || !files || !e->supported)
+			continue;
+		if (!_scan_file_changed(w, w->path, &e->st))
+			continue;
+		e->changed = 1;
+		e->res = -ECANCELED;
+		changed++;
+		mdfs_uring_openat(uring, fd, e->name, O_RDONLY | O_CLOEXEC |
+				(w->noatime ? O_NOATIME : 0), i);
+	}
+	if (!changed)
+		return;
+	mdfs_uring_complete(uring, _uring_result, batch);
+
+	for (i = 0; i < count; i++)
+	{
+		Mdfs_Scanner_Entry *e = &batch[i];
+
+		e->len = 0;
+		/* not our file, from now on do not even try */
+		if (e->changed && e->res == -EPERM && w->noatime)
+		{
+			w->noatime = 0;
+			e->res = openat(fd, e->name, O_RDONLY | O_CLOEXEC);
+			if (e->res < 0)
+				e->res = -errno;
+		}
+		if (!e->changed || e->res < 0)
+			continue;
+		e->fd = e->res;
+		e->res = -ECANCELED;
+		/* read exactly the header, nothing ahead of it */
+		mdfs_uring_fadvise(uring, e->fd, 0, 0, POSIX_FADV_RANDOM,
+				i | URING_IGNORE);
+		mdfs_uring_link(uring);
+		mdfs_uring_read(uring, e->fd, w->headers + i * URING_HEADER_SIZE,
+				URING_HEADER_SIZE, 0, i);
+	}
+	mdfs_uring_complete(uring, _uring_result, batch);
+	for (i = 0; i < count; i++)
+	{
+		Mdfs_Scanner_Entry *e = &batch[i];
+
+		if (!e->changed || e->fd < 0)
+			continue;
+		if (e->res > 0)
+			e->len = e->res;
+		bytes += e->len;
+		/* the header is on our buffer, leave the page cache as it was */
+		if (e->len && !w->scanner->mdfs->scan_keep_cache)
+		{
+			mdfs_uring_fadvise(uring, e->fd, 0, e->len,
+					POSIX_FADV_DONTNEED, i | URING_IGNORE);
+			mdfs_uring_link(uring);
+		}
+		mdfs_uring_close(uring, e->fd, i);
+		e->fd = -1;
+	}
+	mdfs_uring_complete(uring, _uring_ignore, NULL);
+	_throttle(w, 0, bytes);
+
+	for (i = 0; i < count; i++)
+	{
+		Mdfs_Scanner_Entry *e = &batch[i];
+
+		if (!e->changed)
+			continue;
+		_entry_path(w, plen, e->name);
+		_scan_tags(w, w->path, &e->st, w->headers + i * URING_HEADER_SIZE,
+				e->len);
+	}
+}
+
+/* same as _scan_entries but the entries that need a stat are batched and
+ * handled by the io_uring engine. To examine them in inode order the whole
+ * directory is batched and sorted first, the reads of a batch are submitted
+ * at once so the extent order is left to the I/O scheduler
+ */
+static unsigned int _scan_entries_uring(Mdfs_Scanner_Worker *w, DIR *dp,
+		int fd, size_t plen, int files, int dirs)
+{
+	struct dirent *de;
+	unsigned int count = 0;
+	unsigned int max;
+	unsigned int i;
+
+	/* every file takes two operations, the read or the close are linked
+	 * to a hint about the page cache
+	 */
+	max = mdfs_uring_entries(w->uring) / 2;
+	while ((de = readdir(dp)) != NULL)
+	{
+		int supported;
+
+		if (w->scanner->cancel)
+			break;
+		if (_entry_is_dots(de))
+			continue;
+		count++;
+		if (!_entry_wanted(de, files, dirs, &supported))
+			continue;
+
+		if (de->d_type == DT_DIR)
+		{
+			_entry_path(w, plen, de->d_name);
+			_worker_push(w, strdup(w->path));
+			continue;
+		}
+		_batch_add(w, de, supported);
+		if (w->nbatch == max &&
+				w->scanner->order == MDFS_SCANNER_ORDER_READDIR)
+		{
+			_scan_batch(w, w->batch, w->nbatch, fd, plen, files,
+					dirs);
+			_batch_clear(w);
+		}
+	}
+	if (w->scanner->order != MDFS_SCANNER_ORDER_READDIR)
+		qsort(w->batch, w->nbatch, sizeof(Mdfs_Scanner_Entry),
+				_entry_cmp);
+	for (i = 0; i < w->nbatch && !w->scanner->cancel; i += max)
+		_scan_batch(w, w->batch + i, w->nbatch - i < max ?
+				w->nbatch - i : max, fd, plen, files, dirs);
+	_batch_clear(w);
+	return count;
+}
+#endif
+
+static unsigned int _scan_dir_entries(Mdfs_Scanner_Worker *w, DIR *dp,
+		int fd, size_t plen, int files, int dirs)
+{
+#if HAVE_IO_URING
+	if (w->uring)
+		return _scan_entries_uring(w, dp, fd, plen, files, dirs);
+#endif
+	if (w->scanner->order != MDFS_SCANNER_ORDER_READDIR)
+		return _scan_entries_ordered(w, dp, fd, plen, files, dirs);
+	return _scan_entries(w, dp, fd, plen, files, dirs);
+}
+
+/* Walk a single directory. If neither the directory mtime nor its ctime
+ * changed since the last scan no entry has been added, removed or renamed
+ * so the files are not examined again, only the subdirectories are queued.
+ * Files modified in place are caught by the monitor or by a full verify
+ */
+static void _scan_dir(Mdfs_Scanner_Worker *w, const char *path)
+{
+	Mdfs_Scanner *thiz = w->scanner;
+	DIR *dp;
+	struct stat st;
+	size_t plen;
+	unsigned int children = 0;
+	unsigned int count;
+	int skip = 0;
+	int claimed;
+	int dirs;
+	int fd;
+
+	/* a hint might be only for the files of this directory */
+	dirs = !w->hinted || w->hinted_subdirs;
+	claimed = _claim(thiz, path);
+	if (!claimed && !dirs)
+		return;
+
+	fd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (fd < 0)
+	{
+		printf("cannot scan dir %s\n", path);
+		STAT_ADD(w->failed, 1);
+		thiz->incomplete = 1;
+		return;
+	}
+	if (fstat(fd, &st) < 0 || !(dp = fdopendir(fd)))
+	{
+		printf("cannot scan dir %s\n", path);
+		STAT_ADD(w->failed, 1);
+		thiz->incomplete = 1;
+		close(fd);
+		return;
+	}
+	STAT_ADD(w->directories, 1);
+
+	plen = strlen(path);
+	memcpy(_worker_path_reserve(w, plen + 2), path, plen);
+	w->path[plen++] = '/';
+
+	/* the files were already examined, only look for the subdirectories */
+	if (!claimed)
+	{
+		_scan_dir_entries(w, dp, fd, plen, 0, 1);
+		closedir(dp);
+		return;
+	}
+
+	if (!thiz->verify && thiz->index)
+		skip = !mdfs_index_dir_changed(thiz->index, path, st.st_mtime,
+				st.st_ctime, &children);
+
+	count = _scan_dir_entries(w, dp, fd, plen, !skip, dirs);
+	if (skip && count != children && !thiz->cancel)
+	{
+		/* it did change after all, go over the files again */
+		rewinddir(dp);
+		count = _scan_dir_entries(w, dp, fd, plen, 1, 0);
+	}
+	else if (skip)
+	{
+		STAT_ADD(w->skipped, 1);
+		closedir(dp);
+		if (!thiz->cancel)
+			mdfs_writer_dir_touch(thiz->mdfs->writer, path);
+		return;
+	}
+	closedir(dp);
+
+	/* the walk of this directory is incomplete */
+	if (thiz->cancel)
+		return;
+	mdfs_writer_dir_add(thiz->mdfs->writer, path, st.st_mtime, st.st_ctime,
+			count);
+}
+
+#if HAVE_IO_URING
+static void _worker_uring_cleanup(Mdfs_Scanner_Worker *w)
+{
+	free(w->headers);
+	mdfs_uring_free(w->uring);
+	w->headers = NULL;
+	w->uring = NULL;
+}
+
+static void _worker_uring_setup(Mdfs_Scanner_Worker *w)
+{
+	unsigned int entries;
+
+	w->uring = mdfs_uring_new(w->scanner->mdfs->uring_depth < 2 ? 2 :
+			w->scanner->mdfs->uring_depth);
+	if (!w->uring)
+	{
+		printf("scanner worker %u: io_uring not available (%d), "
+				"using the synchronous scanner\n", w->index, errno);
+		return;
+	}
+	entries = mdfs_uring_entries(w->uring);
+	w->headers = malloc(entries / 2 * URING_HEADER_SIZE);
+	if (!w->headers)
+		_worker_uring_cleanup(w);
+	w->noatime = 1;
+}
+#endif
+
+/* leave the disks and the processors to everyone else, both priorities are
+ * per thread on Linux
+ */
+static void _worker_idle(Mdfs_Scanner_Worker *w)
+{
+	pid_t tid = syscall(SYS_gettid);
+
+	if (syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, tid,
+			IOPRIO_CLASS_IDLE << IOPRIO_CLASS_SHIFT) < 0)
+		printf("scanner worker %u: cannot set the idle I/O class (%d)\n",
+				w->index, errno);
+	if (setpriority(PRIO_PROCESS, tid, 19) < 0)
+		printf("scanner worker %u: cannot lower the priority (%d)\n",
+				w->index, errno);
+}
+
+static void * _worker_run(void *data)
+{
+	Mdfs_Scanner_Worker *w = data;
+	char *path;
+	double secs;
+
+	if (w->scanner->mdfs->scan_idle)
+		_worker_idle(w);
+#if HAVE_IO_URING
+	if (w->scanner->mdfs->io_uring)
+		_worker_uring_setup(w);
+#endif
+	clock_gettime(CLOCK_MONOTONIC, &w->start);
+	if (w->scanner->manifest)
+	{
+		_scan_manifest(w);
+		_worker_done(w);
+	}
+	else while ((path = _worker_next(w)))
+	{
+		_scan_dir(w, path);
+		pthread_rwlock_rdlock(&w->scanner->walk_lock);
+		w->current = NULL;
+		/* an interrupted directory is walked again on the next scan */
+		if (w->scanner->cancel)
+			_worker_push(w, path);
+		else
+			free(path);
+		pthread_rwlock_unlock(&w->scanner->walk_lock);
+		_worker_done(w);
+	}
+	clock_gettime(CLOCK_MONOTONIC, &w->end);
+
+#if HAVE_IO_URING
+	if (w->uring)
+		_worker_uring_cleanup(w);
+#endif
+	free(w->batch);
+	w->batch = NULL;
+	w->batch_size = 0;
+	free(w->line);
+	w->line = NULL;
+	w->line_size = 0;
+	secs = _timespec_diff(&w->start, &w->end);
+	printf("scanner worker %u: %lu dirs (%lu unchanged) %lu files in %.2fs (%.1f files/s)\n",
+			w->index, w->directories, w->skipped, w->files, secs,
+			secs > 0 ? w->files / secs : 0.0);
+	return NULL;
+}
+/*============================================================================*
+ *                                 Global                                     *
+ *============================================================================*/
+Mdfs_Scanner * mdfs_scanner_new(metadatafs *mdfs, unsigned int workers)
+{
+	Mdfs_Scanner *thiz;
+	unsigned int i;
+
+	if (!workers) workers = 1;
+
+	thiz = calloc(1, sizeof(Mdfs_Scanner));
+	if (!thiz) return NULL;
+	thiz->mdfs = mdfs;
+	thiz->nworkers = workers;
+	if (!mdfs->scan_order || !strcmp(mdfs->scan_order, "readdir"))
+		thiz->order = MDFS_SCANNER_ORDER_READDIR;
+	else if (!strcmp(mdfs->scan_order, "inode"))
+		thiz->order = MDFS_SCANNER_ORDER_INODE;
+	else if (!strcmp(mdfs->scan_order, "extent"))
+		thiz->order = MDFS_SCANNER_ORDER_EXTENT;
+	else
+		printf("unknown scan order %s, using the readdir order\n",
+				mdfs->scan_order);
+	thiz->workers = calloc(workers, sizeof(Mdfs_Scanner_Worker));
+	pthread_mutex_init(&thiz->lock, NULL);
+	pthread_cond_init(&thiz->cond, NULL);
+	pthread_cond_init(&thiz->done, NULL);
+	pthread_rwlock_init(&thiz->walk_lock, NULL);
+	pthread_mutex_init(&thiz->budget_lock, NULL);
+	pthread_mutex_init(&thiz->manifest_lock, NULL);
+	for (i = 0; i < workers; i++)
+	{
+		Mdfs_Scanner_Worker *w = &thiz->workers[i];
+
+		w->scanner = thiz;
+		w->index = i;
+		w->size = DEQUE_INITIAL_SIZE;
+		w->dirs = malloc(sizeof(char *) * w->size);
+		pthread_mutex_init(&w->lock, NULL);
+	}
+	return thiz;
+}
+
+/* take a consistent view of the directories left to walk, the queued ones
+ * and the ones being scanned, and send it to the writer
+ */
+static void _checkpoint(Mdfs_Scanner *thiz)
+{
+	char **paths;
+	unsigned int count = 0;
+	unsigned int size;
+	unsigned int i;
+
+	pthread_rwlock_wrlock(&thiz->walk_lock);
+	pthread_mutex_lock(&thiz->lock);
+	size = thiz->nhints + thiz->nworkers;
+	for (i = 0; i < thiz->nworkers; i++)
+		size += thiz->workers[i].count;
+	paths = malloc(sizeof(char *) * (size ? size : 1));
+	for (i = 0; i < thiz->nhints; i++)
+		paths[count++] = strdup(thiz->hints[i].path);
+	for (i = 0; i < thiz->nworkers; i++)
+	{
+		Mdfs_Scanner_Worker *w = &thiz->workers[i];
+		unsigned int j;
+
+		pthread_mutex_lock(&w->lock);
+		for (j = 0; j < w->count; j++)
+			paths[count++] = strdup(w->dirs[(w->head + j) % w->size]);
+		pthread_mutex_unlock(&w->lock);
+		if (w->current)
+			paths[count++] = strdup(w->current);
+	}
+	pthread_mutex_unlock(&thiz->lock);
+	pthread_rwlock_unlock(&thiz->walk_lock);
+
+	mdfs_writer_checkpoint(thiz->mdfs->writer, paths, count, thiz->verify);
+}
+
+/* wait for the walk to finish, taking a checkpoint every checkpoint interval
+ * if the walk can be resumed and moving the snapshot the requests are served
+ * from every snapshot refresh, when set
+ */
+static void _wait(Mdfs_Scanner *thiz, int resumable)
+{
+	metadatafs *mdfs = thiz->mdfs;
+	unsigned int checkpoint = resumable ? mdfs->checkpoint_interval : 0;
+	unsigned int refresh = mdfs->snapshot_refresh;
+	time_t next_checkpoint;
+	time_t next_refresh;
+	time_t now;
+
+	now = time(NULL);
+	next_checkpoint = now + checkpoint;
+	next_refresh = now + refresh;
+	pthread_mutex_lock(&thiz->lock);
+	while (thiz->pending && !thiz->cancel)
+	{
+		struct timespec ts;
+
+		if (!checkpoint && !refresh)
+		{
+			pthread_cond_wait(&thiz->done, &thiz->lock);
+			continue;
+		}
+		if (!refresh || (checkpoint && next_checkpoint < next_refresh))
+			ts.tv_sec = next_checkpoint;
+		else
+			ts.tv_sec = next_refresh;
+		ts.tv_nsec = 0;
+		if (pthread_cond_timedwait(&thiz->done, &thiz->lock, &ts) != ETIMEDOUT)
+			continue;
+		if (!thiz->pending || thiz->cancel)
+			break;
+		pthread_mutex_unlock(&thiz->lock);
+		now = time(NULL);
+		if (checkpoint && now >= next_checkpoint)
+		{
+			_checkpoint(thiz);
+			next_checkpoint = now + checkpoint;
+		}
+		if (refresh && now >= next_refresh)
+		{
+			metadatafs_snapshot_refresh(mdfs);
+			next_refresh = now + refresh;
+		}
+		pthread_mutex_lock(&thiz->lock);
+	}
+	pthread_mutex_unlock(&thiz->lock);
+}
+
+/* forget what is queued, nobody is going to walk it */
+static void _drain(Mdfs_Scanner *thiz)
+{
+	unsigned int i;
+	char *path;
+
+	for (i = 0; i < thiz->nworkers; i++)
+	{
+		while ((path = _worker_pop(&thiz->workers[i])))
+			free(path);
+	}
+	pthread_mutex_lock(&thiz->lock);
+	thiz->queued = 0;
+	thiz->pending = 0;
+	pthread_mutex_unlock(&thiz->lock);
+}
+
+static int _run(Mdfs_Scanner *thiz, char **paths, unsigned int count,
+		int verify)
+{
+	metadatafs *mdfs = thiz->mdfs;
+	unsigned int started = 0;
+	unsigned int i;
+	struct timespec start;
+	struct timespec end;
+	unsigned long files = 0;
+	double secs;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	thiz->verify = verify;
+	thiz->incomplete = 0;
+	/* what we already know about, to skip the unchanged files */
+	mdfs_writer_flush(mdfs->writer);
+	thiz->index = mdfs_index_new(mdfs_writer_db_get(mdfs->writer));
+
+	pthread_mutex_lock(&thiz->lock);
+	for (i = 0; i < thiz->nworkers; i++)
+	{
+		Mdfs_Scanner_Worker *w = &thiz->workers[i];
+
+		w->seen = w->files = w->unchanged = w->failed = 0;
+		w->moved = 0;
+		w->bytes = 0;
+		w->directories = w->skipped = 0;
+	}
+	/* the files found on the previous walk are our best guess */
+	thiz->expected = thiz->index ? mdfs_index_files_count(thiz->index) : 0;
+	thiz->start = start;
+	thiz->sample_time = start;
+	thiz->sample_seen = 0;
+	thiz->rate = 0;
+	thiz->running = 1;
+	thiz->claimed_count = 0;
+	if (thiz->claimed)
+		memset(thiz->claimed, 0, sizeof(uint64_t) * thiz->claimed_size);
+	/* every worker reads the manifest until its end */
+	if (thiz->manifest)
+	{
+		thiz->manifest_line = 0;
+		thiz->pending = thiz->nworkers;
+	}
+	pthread_mutex_unlock(&thiz->lock);
+	/* spread the starting points among the workers */
+	for (i = 0; i < count; i++)
+		_worker_push(&thiz->workers[i % thiz->nworkers], strdup(paths[i]));
+	for (i = 0; i < thiz->nworkers; i++)
+	{
+		Mdfs_Scanner_Worker *w = &thiz->workers[i];
+
+		if (pthread_create(&w->thread, NULL, _worker_run, w))
+		{
+			perror("pthread_create");
+			/* its share of the manifest is read by the rest, the
+			 * directories on its deque are stolen
+			 */
+			if (thiz->manifest)
+				_worker_done(w);
+			continue;
+		}
+		w->running = 1;
+		started++;
+	}
+	/* there is nothing to resume a manifest or some subtrees from */
+	if (started)
+		_wait(thiz, !thiz->manifest && !thiz->partial);
+	else
+	{
+		printf("scanner: no worker could be started\n");
+		thiz->incomplete = 1;
+	}
+	for (i = 0; i < thiz->nworkers; i++)
+	{
+		Mdfs_Scanner_Worker *w = &thiz->workers[i];
+
+		if (!w->running) continue;
+		pthread_join(w->thread, NULL);
+		w->running = 0;
+		files += w->files;
+	}
+	/* whatever is left is on the deques and the hints, a walk of some
+	 * subtrees does not touch the checkpoint of the whole tree
+	 */
+	if ((thiz->cancel || !started) && !thiz->manifest && !thiz->partial)
+		_checkpoint(thiz);
+	else if (!thiz->partial)
+		mdfs_writer_checkpoint(mdfs->writer, NULL, 0, 0);
+	if (!started)
+		_drain(thiz);
+	mdfs_writer_flush(mdfs->writer);
+	if (thiz->index)
+	{
+		mdfs_index_free(thiz->index);
+		thiz->index = NULL;
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	pthread_mutex_lock(&thiz->lock);
+	thiz->end = end;
+	thiz->running = 0;
+	/* the hints left by a cancelled walk */
+	while (thiz->nhints)
+		free(thiz->hints[--thiz->nhints].path);
+	pthread_mutex_unlock(&thiz->lock);
+
+	secs = _timespec_diff(&start, &end);
+	printf("scanner: %lu files with %u workers in %.2fs (%.1f files/s)\n",
+			files, thiz->nworkers, secs, secs > 0 ? files / secs : 0.0);
+	if (thiz->cancel || thiz->incomplete)
+		return 0;
+
+	/* the directories are not looked at, keep what we know about them
+	 * for the next walk
+	 */
+	if (thiz->manifest)
+		mdfs_writer_dirs_touch(mdfs->writer);
+	printf("scanner: %lu files removed\n",
+			mdfs_writer_sweep(mdfs->writer,
+					thiz->partial ? paths : NULL,
+					thiz->partial ? count : 0));
+	return 1;
+}
+
+/* walk the whole tree under path, returns once every worker is done. With
+ * verify every file is checked, even those on unchanged directories. Once
+ * the walk is completed whatever was not found is swept from the catalog,
+ * if it is cancelled a checkpoint is left to resume it.
+ * Returns 1 if the walk was completed
+ */
+int mdfs_scanner_run(Mdfs_Scanner *thiz, const char *path, int verify)
+{
+	return _run(thiz, (char **)&path, 1, verify);
+}
+
+/* continue an interrupted walk from the directories of its checkpoint, the
+ * scan generation must be the one of the interrupted walk
+ */
+int mdfs_scanner_resume(Mdfs_Scanner *thiz, char **paths, unsigned int count,
+		int verify)
+{
+	return _run(thiz, paths, count, verify);
+}
+
+/* Walk again only the directories at paths and everything under them, for
+ * when their changes might have been missed. Every file is checked and what
+ * is not found under them is swept, the rest of the catalog is left as is.
+ * No checkpoint is left if cancelled.
+ * Returns 1 if the walk was completed
+ */
+int mdfs_scanner_subtrees(Mdfs_Scanner *thiz, char **paths,
+		unsigned int count)
+{
+	int ret;
+
+	thiz->partial = 1;
+	ret = _run(thiz, paths, count, 1);
+	thiz->partial = 0;
+	return ret;
+}
+
+/* Examine the files listed on a manifest instead of walking the tree, one
+ * per line with its path, size and modification time separated by tabs. The
+ * manifest must list every file under the base path, once it is consumed
+ * whatever was not on it is swept from the catalog.
+ * Returns 1 if the whole manifest was consumed
+ */
+int mdfs_scanner_manifest(Mdfs_Scanner *thiz, FILE *manifest, int verify)
+{
+	int ret;
+
+	thiz->manifest = manifest;
+	ret = _run(thiz, NULL, 0, verify);
+	thiz->manifest = NULL;
+	return ret;
+}
+
+/* whether a walk is running that takes hints, so they can be skipped without
+ * even looking at the disk
+ */
+int mdfs_scanner_walking(Mdfs_Scanner *thiz)
+{
+	int ret;
+
+	pthread_mutex_lock(&thiz->lock);
+	ret = thiz->running && thiz->pending && !thiz->cancel &&
+			!thiz->manifest;
+	pthread_mutex_unlock(&thiz->lock);
+	return ret;
+}
+
+/* Scan a directory of the source tree and its subdirectories before anything
+ * else, so what the users are looking for shows up first. Without subdirs
+ * only the files of the directory are examined. Only works while a walk is
+ * running. Returns 1 if the hint was taken
+ */
+int mdfs_scanner_hint(Mdfs_Scanner *thiz, const char *path, int subdirs)
+{
+	int ret = 0;
+
+	pthread_mutex_lock(&thiz->lock);
+	if (thiz->running && thiz->pending && !thiz->cancel && !thiz->manifest)
+	{
+		_hint_push(thiz, strdup(path), subdirs);
+		ret = 1;
+	}
+	pthread_mutex_unlock(&thiz->lock);
+	if (ret)
+		pthread_cond_signal(&thiz->cond);
+	return ret;
+}
+
+/* get the progress of the current walk, or of the last one if there is none
+ * running
+ */
+void mdfs_scanner_stats_get(Mdfs_Scanner *thiz, Mdfs_Scanner_Stats *stats)
+{
+	struct timespec now;
+	unsigned int i;
+	double secs;
+
+	memset(stats, 0, sizeof(Mdfs_Scanner_Stats));
+	for (i = 0; i < thiz->nworkers; i++)
+	{
+		Mdfs_Scanner_Worker *w = &thiz->workers[i];
+
+		stats->seen += STAT_GET(w->seen);
+		stats->parsed += STAT_GET(w->files);
+		stats->unchanged += STAT_GET(w->unchanged);
+		stats->moved += STAT_GET(w->moved);
+		stats->failed += STAT_GET(w->failed);
+		stats->bytes += STAT_GET(w->bytes);
+		stats->directories += STAT_GET(w->directories);
+		stats->skipped += STAT_GET(w->skipped);
+	}
+
+	pthread_mutex_lock(&thiz->lock);
+	stats->running = thiz->running;
+	stats->expected = thiz->expected;
+	if (!thiz->start.tv_sec && !thiz->start.tv_nsec)
+		goto done;
+	if (thiz->running)
+		clock_gettime(CLOCK_MONOTONIC, &now);
+	else
+		now = thiz->end;
+	stats->elapsed = _timespec_diff(&thiz->start, &now);
+	/* the current rate is taken over the last second or more */
+	secs = _timespec_diff(&thiz->sample_time, &now);
+	if (thiz->running && secs >= 1.0)
+	{
+		thiz->rate = (stats->seen - thiz->sample_seen) / secs;
+		thiz->sample_time = now;
+		thiz->sample_seen = stats->seen;
+	}
+	else if (!thiz->running || !thiz->rate)
+	{
+		thiz->rate = stats->elapsed > 0 ? stats->seen / stats->elapsed : 0;
+	}
+	stats->rate = thiz->rate;
+	if (thiz->running && stats->rate > 0 && stats->expected > stats->seen)
+		stats->eta = (stats->expected - stats->seen) / stats->rate;
+	else if (thiz->running)
+		stats->eta = -1;
+done:
+	pthread_mutex_unlock(&thiz->lock);
+}
+
+/* Ask the walk to stop, the workers finish at the next directory entry and
+ * the run stores a checkpoint with whatever is left before returning. Nothing
+ * is killed, so no thread is left holding the database lock
+ */
+void mdfs_scanner_cancel(Mdfs_Scanner *thiz)
+{
+	pthread_mutex_lock(&thiz->lock);
+	thiz->cancel = 1;
+	pthread_cond_broadcast(&thiz->cond);
+	pthread_cond_broadcast(&thiz->done);
+	pthread_mutex_unlock(&thiz->lock);
+}
+
+void mdfs_scanner_free(Mdfs_Scanner *thiz)
+{
+	unsigned int i;
+
+	for (i = 0; i < thiz->nworkers; i++)
+	{
+		Mdfs_Scanner_Worker *w = &thiz->workers[i];
+
+		while (w->count)
+		{
+			w->count--;
+			free(w->dirs[(w->head + w->count) % w->size]);
+		}
+		free(w->dirs);
+		free(w->path);
+		pthread_mutex_destroy(&w->lock);
+	}
+	free(thiz->workers);
+	while (thiz->nhints)
+		free(thiz->hints[--thiz->nhints].path);
+	free(thiz->hints);
+	free(thiz->claimed);
+	pthread_mutex_destroy(&thiz->lock);
+	pthread_cond_destroy(&thiz->cond);
+	pthread_cond_destroy(&thiz->done);
+	pthread_rwlock_destroy(&thiz->walk_lock);
+	pthread_mutex_destroy(&thiz->budget_lock);
+	pthread_mutex_destroy(&thiz->manifest_lock);
+	free(thiz);
+}
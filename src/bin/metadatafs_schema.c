@@ -0,0 +1,214 @@
+/* MetadataFS -
+ * Copyright (C) 2010 Jorge Luis Zapata
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library.
+ * If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * The migrations of a catalog written by a previous version of the schema.
+ * The version is kept on the info table, a new catalog is created on the
+ * current one and an old one goes through every migration after its
+ * version, each on a transaction of its own. What the tables of the models
+ * can not get with an ALTER TABLE is done by rebuilding the table in place:
+ * the old one is renamed, the model creates it again and the rows are
+ * copied back.
+ */
+#include "metadatafs.h"
+
+#include <stdarg.h>
+#include <time.h>
+/*============================================================================*
+ *                                  Local                                     *
+ *============================================================================*/
+typedef struct _Mdfs_Schema_Migration
+{
+	const char *description;
+	int (*run)(sqlite3 *db);
+} Mdfs_Schema_Migration;
+
+static int _exec(sqlite3 *db, const char *fmt, ...)
+{
+	va_list args;
+	char *str;
+	int error;
+
+	va_start(args, fmt);
+	str = sqlite3_vmprintf(fmt, args);
+	va_end(args);
+	error = sqlite3_exec(db, str, NULL, NULL, NULL);
+	sqlite3_free(str);
+	if (error != SQLITE_OK)
+	{
+		printf("migration failed: %s\n", sqlite3_errmsg(db));
+		return 0;
+	}
+	return 1;
+}
+
+/* add the column unless the table already has it, the catalogs before the
+ * versions got the columns at different times
+ */
+static int _column_add(sqlite3 *db, const char *table, const char *column,
+		const char *type)
+{
+	sqlite3_stmt *stmt;
+	int found;
+
+	if (sqlite3_prepare_v2(db, "SELECT 1 FROM pragma_table_info(?) "
+			"WHERE name = ?;", -1, &stmt, NULL) != SQLITE_OK)
+	{
+		printf("migration failed: %s\n", sqlite3_errmsg(db));
+		return 0;
+	}
+	sqlite3_bind_text(stmt, 1, table, -1, SQLITE_STATIC);
+	sqlite3_bind_text(stmt, 2, column, -1, SQLITE_STATIC);
+	found = sqlite3_step(stmt) == SQLITE_ROW;
+	sqlite3_finalize(stmt);
+	if (found)
+		return 1;
+	printf("  adding %s.%s\n", table, column);
+	return _exec(db, "ALTER TABLE %s ADD COLUMN %s %s;", table, column,
+			type);
+}
+
+/* Create the table again through its model and copy the rows back, the
+ * ones with the same keys are merged on the first one by order and the
+ * column of the child table pointing to them is moved to it
+ */
+static int _table_rebuild(sqlite3 *db, const char *table,
+		int (*init)(sqlite3 *db), const char *columns, const char *keys,
+		const char *order, const char *child, const char *child_column)
+{
+	int merged;
+
+	printf("  rebuilding %s\n", table);
+	if (!_exec(db, "ALTER TABLE %s RENAME TO %s_old;", table, table))
+		return 0;
+	if (!init(db))
+		return 0;
+	if (!_exec(db, "CREATE TEMP TABLE %s_merged(id INTEGER PRIMARY KEY, "
+			"keep INTEGER);"
+			"INSERT INTO temp.%s_merged (id, keep) "
+			"SELECT id, keep FROM (SELECT id, first_value(id) OVER "
+			"(PARTITION BY %s ORDER BY id %s) AS keep FROM %s_old) "
+			"WHERE id != keep;",
+			table, table, keys, order, table))
+		return 0;
+	merged = sqlite3_changes(db);
+	if (!_exec(db, "INSERT INTO %s (%s) SELECT %s FROM %s_old "
+			"WHERE id NOT IN (SELECT id FROM temp.%s_merged);",
+			table, columns, columns, table, table))
+		return 0;
+	printf("  %s: %d rows, %d duplicates merged\n", table,
+			sqlite3_changes(db), merged);
+	if (child && !_exec(db, "UPDATE %s SET %s = "
+			"(SELECT keep FROM temp.%s_merged WHERE id = %s.%s) "
+			"WHERE %s IN (SELECT id FROM temp.%s_merged);",
+			child, child_column, table, child, child_column,
+			child_column, table))
+		return 0;
+	return _exec(db, "DROP TABLE %s_old; DROP TABLE temp.%s_merged;",
+			table, table);
+}
+
+/* Unique names on their parent and the path of the files unique, until now
+ * every album and title was added again for each of its files and every
+ * changed file got a row of its own. The albums are merged first as that
+ * makes more titles equal
+ */
+static int _version_1(sqlite3 *db)
+{
+	/* the size, the generations and the identity of the files and the
+	 * directories, the rebuild copies them
+	 */
+	if (!_column_add(db, "files", "size", "INTEGER DEFAULT 0") ||
+			!_column_add(db, "files", "gen", "INTEGER DEFAULT 0") ||
+			!_column_add(db, "files", "dev", "INTEGER DEFAULT 0") ||
+			!_column_add(db, "files", "ino", "INTEGER DEFAULT 0") ||
+			!_column_add(db, "dirs", "gen", "INTEGER DEFAULT 0") ||
+			!_column_add(db, "dirs", "examined", "INTEGER DEFAULT 0"))
+		return 0;
+	if (!_table_rebuild(db, "album", mdfs_album_init, "id, name, artist",
+			"name, artist", "ASC", "title", "album"))
+		return 0;
+	if (!_table_rebuild(db, "title", mdfs_title_init, "id, name, album",
+			"name, album", "ASC", "files", "title"))
+		return 0;
+	/* the last row of a path is the one with the current tags */
+	if (!_table_rebuild(db, "files", mdfs_file_init,
+			"id, file, dbfile, mtime, size, title, gen, dev, ino",
+			"file", "DESC", NULL, NULL))
+		return 0;
+	/* whatever was left without files */
+	printf("  removing the empty titles, albums and artists\n");
+	return _exec(db, "DELETE FROM title WHERE id NOT IN "
+			"(SELECT title FROM files);"
+			"DELETE FROM album WHERE id NOT IN "
+			"(SELECT album FROM title);"
+			"DELETE FROM artist WHERE id NOT IN "
+			"(SELECT artist FROM album);");
+}
+
+/* one for each version, the first brings a catalog to version 1 */
+static Mdfs_Schema_Migration _migrations[MDFS_SCHEMA_VERSION] = {
+	{ "unique names on every parent", _version_1 },
+};
+/*============================================================================*
+ *                                 Global                                     *
+ *============================================================================*/
+/* bring the catalog from the version on info to the current one */
+int mdfs_schema_migrate(sqlite3 *db, Mdfs_Info *info)
+{
+	int version;
+
+	if (info->version > MDFS_SCHEMA_VERSION)
+	{
+		printf("the catalog has a newer version %d than %d\n",
+				info->version, MDFS_SCHEMA_VERSION);
+		return 0;
+	}
+	if (info->version == MDFS_SCHEMA_VERSION)
+		return 1;
+	/* the other tables keep pointing to the renamed ones */
+	sqlite3_exec(db, "PRAGMA legacy_alter_table=ON;", NULL, NULL, NULL);
+	for (version = info->version; version < MDFS_SCHEMA_VERSION; version++)
+	{
+		Mdfs_Schema_Migration *m = &_migrations[version];
+		time_t start = time(NULL);
+
+		printf("migrating the catalog to version %d, %s\n",
+				version + 1, m->description);
+		if (!_exec(db, "BEGIN IMMEDIATE;"))
+			break;
+		if (!m->run(db))
+		{
+			sqlite3_exec(db, "ROLLBACK;", NULL, NULL, NULL);
+			break;
+		}
+		info->version = version + 1;
+		mdfs_info_update(db, info);
+		if (!_exec(db, "COMMIT;"))
+		{
+			sqlite3_exec(db, "ROLLBACK;", NULL, NULL, NULL);
+			info->version = version;
+			break;
+		}
+		printf("catalog migrated to version %d in %lds\n",
+				info->version, (long)(time(NULL) - start));
+	}
+	sqlite3_exec(db, "PRAGMA legacy_alter_table=OFF;", NULL, NULL, NULL);
+
+	return info->version == MDFS_SCHEMA_VERSION;
+}
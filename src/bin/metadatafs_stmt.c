@@ -0,0 +1,168 @@
+/* MetadataFS -
+ * Copyright (C) 2010 Jorge Luis Zapata
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library.
+ * If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * The prepared statements of every connection to the catalog, so the SQL is
+ * parsed and planned once and not on every lookup. Each statement has a key,
+ * it is taken from the cache, its parameters bound, stepped and then given
+ * back reset. Every thread keeps the statements it prepared on each
+ * connection it uses, so nothing is shared nor locked, and they are finalized
+ * when the thread is gone. A statement taken twice on the same thread, while
+ * walking the results of another lookup, gets a new one kept afterwards if
+ * the slot is free again.
+ */
+#include "metadatafs.h"
+/*============================================================================*
+ *                                  Local                                     *
+ *============================================================================*/
+typedef struct _Mdfs_Stmt_Cache Mdfs_Stmt_Cache;
+
+struct _Mdfs_Stmt_Cache
+{
+	sqlite3 *db;
+	sqlite3_stmt *stmts[MDFS_STMTS];
+	Mdfs_Stmt_Cache *next;
+};
+
+/* the caches of the calling thread */
+static pthread_key_t _key;
+static pthread_once_t _once = PTHREAD_ONCE_INIT;
+
+static void _cache_free(Mdfs_Stmt_Cache *c)
+{
+	int i;
+
+	for (i = 0; i < MDFS_STMTS; i++)
+	{
+		if (c->stmts[i])
+			sqlite3_finalize(c->stmts[i]);
+	}
+	free(c);
+}
+
+/* the thread is gone, so are its statements */
+static void _caches_free(void *data)
+{
+	Mdfs_Stmt_Cache *c = data;
+	Mdfs_Stmt_Cache *next;
+
+	for (; c; c = next)
+	{
+		next = c->next;
+		_cache_free(c);
+	}
+}
+
+static void _key_init(void)
+{
+	pthread_key_create(&_key, _caches_free);
+}
+
+/* the cache of db on the calling thread, created if asked to */
+static Mdfs_Stmt_Cache * _cache_get(sqlite3 *db, int create)
+{
+	Mdfs_Stmt_Cache *c;
+
+	pthread_once(&_once, _key_init);
+	for (c = pthread_getspecific(_key); c; c = c->next)
+	{
+		if (c->db == db)
+			return c;
+	}
+	if (!create)
+		return NULL;
+	c = calloc(1, sizeof(Mdfs_Stmt_Cache));
+	if (!c) return NULL;
+	c->db = db;
+	c->next = pthread_getspecific(_key);
+	pthread_setspecific(_key, c);
+	return c;
+}
+/*============================================================================*
+ *                                 Global                                     *
+ *============================================================================*/
+/* the statement of key prepared on db, NULL if there is none */
+sqlite3_stmt * mdfs_stmt_take(sqlite3 *db, int key)
+{
+	Mdfs_Stmt_Cache *c;
+	sqlite3_stmt *stmt = NULL;
+
+	c = _cache_get(db, 0);
+	if (c)
+	{
+		stmt = c->stmts[key];
+		c->stmts[key] = NULL;
+	}
+	return stmt;
+}
+
+/* the statement of key prepared on db, sql is prepared if there is none.
+ * With the second version of the interface a statement whose schema has
+ * changed is prepared again on its own when stepped
+ */
+sqlite3_stmt * mdfs_stmt_get(sqlite3 *db, int key, const char *sql)
+{
+	sqlite3_stmt *stmt;
+
+	stmt = mdfs_stmt_take(db, key);
+	if (stmt)
+		return stmt;
+	if (sqlite3_prepare_v2(db, sql, -1, &stmt, NULL) != SQLITE_OK)
+		return NULL;
+	return stmt;
+}
+
+/* give back a statement once done with it */
+void mdfs_stmt_put(sqlite3 *db, int key, sqlite3_stmt *stmt)
+{
+	Mdfs_Stmt_Cache *c;
+
+	sqlite3_reset(stmt);
+	sqlite3_clear_bindings(stmt);
+	c = _cache_get(db, 1);
+	if (c && !c->stmts[key])
+	{
+		c->stmts[key] = stmt;
+		return;
+	}
+	sqlite3_finalize(stmt);
+}
+
+/* finalize the statements the calling thread has on db, once it is done
+ * with it
+ */
+void mdfs_stmt_cache_free(sqlite3 *db)
+{
+	Mdfs_Stmt_Cache **prev;
+	Mdfs_Stmt_Cache *c;
+
+	pthread_once(&_once, _key_init);
+	c = pthread_getspecific(_key);
+	for (prev = &c; *prev; prev = &(*prev)->next)
+	{
+		if ((*prev)->db == db)
+		{
+			Mdfs_Stmt_Cache *found = *prev;
+
+			*prev = found->next;
+			_cache_free(found);
+			break;
+		}
+	}
+	pthread_setspecific(_key, c);
+}
@@ -37,100 +37,85 @@ static Mdfs_Title * mdfs_title_new_internal(unsigned int id, const char *name,
  *============================================================================*/
 Mdfs_Title * mdfs_title_get_from_id(sqlite3 *db, unsigned int id)
 {
-	Mdfs_Title *title;
-	char *str;
+	Mdfs_Title *title = NULL;
 	sqlite3_stmt *stmt;
-	const char *tail;
-	int error;
 	const unsigned char *name;
 	unsigned int album;
 
-	str = sqlite3_mprintf("SELECT name,album FROM title WHERE id = %d",
-			id);
-	error = sqlite3_prepare(db, str, -1, &stmt, &tail);
-	sqlite3_free(str);
-	if (error != SQLITE_OK)
+	stmt = mdfs_stmt_get(db, MDFS_STMT_TITLE_GET_FROM_ID,
+			"SELECT name,album FROM title WHERE id = ?;");
+	if (!stmt)
 		return NULL;
-	if (sqlite3_step(stmt) != SQLITE_ROW)
-		return NULL;
-	name = sqlite3_column_text(stmt, 0);
-	album = sqlite3_column_int(stmt, 1);
-
-	title = mdfs_title_new_internal(id, name, album);
-	sqlite3_finalize(stmt);
+	sqlite3_bind_int(stmt, 1, id);
+	if (sqlite3_step(stmt) == SQLITE_ROW)
+	{
+		name = sqlite3_column_text(stmt, 0);
+		album = sqlite3_column_int(stmt, 1);
+		title = mdfs_title_new_internal(id, name, album);
+	}
+	mdfs_stmt_put(db, MDFS_STMT_TITLE_GET_FROM_ID, stmt);
 
 	return title;
 }
 
 Mdfs_Title * mdfs_title_get_from_name(sqlite3 *db, const char *name)
 {
-	Mdfs_Title *title;
-	char *str;
+	Mdfs_Title *title = NULL;
 	sqlite3_stmt *stmt;
-	const char *tail;
-	int error;
 	int id;
 	unsigned int album;
 
-	str = sqlite3_mprintf("SELECT id,album FROM title WHERE name = '%q'",
-			name);
-	error = sqlite3_prepare(db, str, -1, &stmt, &tail);
-	sqlite3_free(str);
-	if (error != SQLITE_OK)
-		return NULL;
-	if (sqlite3_step(stmt) != SQLITE_ROW)
+	stmt = mdfs_stmt_get(db, MDFS_STMT_TITLE_GET_FROM_NAME,
+			"SELECT id,album FROM title WHERE name = ?;");
+	if (!stmt)
 		return NULL;
-	id = sqlite3_column_int(stmt, 0);
-	album = sqlite3_column_int(stmt, 1);
-	sqlite3_finalize(stmt);
-
-	title = mdfs_title_new_internal(id, name, album);
+	sqlite3_bind_text(stmt, 1, name, -1, SQLITE_STATIC);
+	if (sqlite3_step(stmt) == SQLITE_ROW)
+	{
+		id = sqlite3_column_int(stmt, 0);
+		album = sqlite3_column_int(stmt, 1);
+		title = mdfs_title_new_internal(id, name, album);
+	}
+	mdfs_stmt_put(db, MDFS_STMT_TITLE_GET_FROM_NAME, stmt);
 
 	return title;
 }
 
 Mdfs_Title * mdfs_title_get(sqlite3 *db, const char *name, unsigned int album)
 {
-	Mdfs_Title *title;
-	char *str;
+	Mdfs_Title *title = NULL;
 	sqlite3_stmt *stmt;
-	const char *tail;
-	int error;
 	int id;
 
-	str = sqlite3_mprintf("SELECT id FROM title WHERE name = '%q' AND album = %d;",
-			name, album);
-	error = sqlite3_prepare(db, str, -1, &stmt, &tail);
-	sqlite3_free(str);
-	if (error != SQLITE_OK)
-		return NULL;
-	if (sqlite3_step(stmt) != SQLITE_ROW)
+	stmt = mdfs_stmt_get(db, MDFS_STMT_TITLE_GET,
+			"SELECT id FROM title WHERE name = ? AND album = ?;");
+	if (!stmt)
 		return NULL;
-	id = sqlite3_column_int(stmt, 0);
-	sqlite3_finalize(stmt);
-
-	title = mdfs_title_new_internal(id, name, album);
+	sqlite3_bind_text(stmt, 1, name, -1, SQLITE_STATIC);
+	sqlite3_bind_int(stmt, 2, album);
+	if (sqlite3_step(stmt) == SQLITE_ROW)
+	{
+		id = sqlite3_column_int(stmt, 0);
+		title = mdfs_title_new_internal(id, name, album);
+	}
+	mdfs_stmt_put(db, MDFS_STMT_TITLE_GET, stmt);
 
 	return title;
 }
 
 Mdfs_Title * mdfs_title_new(sqlite3 *db, const char *name, unsigned int album)
 {
-	char *str;
 	sqlite3_stmt *stmt;
-	const char *tail;
-	int error;
-	int id = -1;
 
-	/* insert the new artist */
-	str = sqlite3_mprintf("INSERT OR IGNORE INTO title (name, album) VALUES ('%q',%d);",
-			name, album);
-	error = sqlite3_prepare(db, str, -1, &stmt, &tail);
-	sqlite3_free(str);
-	if (error != SQLITE_OK)
-		return NULL;	
+	/* insert the new title */
+	stmt = mdfs_stmt_get(db, MDFS_STMT_TITLE_NEW,
+			"INSERT OR IGNORE INTO title (name, album) VALUES (?,?);");
+	if (!stmt)
+		return NULL;
+	sqlite3_bind_text(stmt, 1, name, -1, SQLITE_STATIC);
+	sqlite3_bind_int(stmt, 2, album);
 	sqlite3_step(stmt);
-	sqlite3_finalize(stmt);
+	mdfs_stmt_put(db, MDFS_STMT_TITLE_NEW, stmt);
 
 	return mdfs_title_get(db, name, album);
 }
@@ -151,6 +136,7 @@ int mdfs_title_init(sqlite3 *db)
 	error = sqlite3_prepare(db,
 			"CREATE TABLE IF NOT EXISTS "
 			"title(id INTEGER PRIMARY KEY AUTOINCREMENT, name TEXT, album INTEGER, "
+			"UNIQUE (name, album), "
 			"FOREIGN KEY (album) REFERENCES album (id));",
 			-1, &stmt, &tail);
 	if (error != SQLITE_OK)
@@ -164,3 +150,14 @@ int mdfs_title_init(sqlite3 *db)
 	return 1;
 }
 
+int mdfs_title_indexes_init(sqlite3 *db)
+{
+	/* to join the albums with their titles */
+	if (sqlite3_exec(db, "CREATE INDEX IF NOT EXISTS title_album ON title (album, name);",
+			NULL, NULL, NULL) != SQLITE_OK)
+	{
+		printf("error title indexes\n");
+		return 0;
+	}
+	return 1;
+}
@@ -0,0 +1,272 @@
+/* MetadataFS -
+ * Copyright (C) 2010 Jorge Luis Zapata
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library.
+ * If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * A minimal io_uring engine for the scanner, used directly through the
+ * syscalls so we do not depend on liburing. The operations are queued on the
+ * submission ring and submitted all at once, the caller then gets every
+ * completion back. Each scanner worker owns its own ring, so no locking is
+ * done here.
+ */
+#include "metadatafs.h"
+
+#if HAVE_IO_URING
+#include <sys/mman.h>
+#include <sys/syscall.h>
+/*============================================================================*
+ *                                  Local                                     *
+ *============================================================================*/
+struct _Mdfs_Uring
+{
+	int fd;
+	unsigned int entries;
+	/* the submission ring */
+	void *sq_ring;
+	size_t sq_ring_size;
+	unsigned int *sq_head;
+	unsigned int *sq_tail;
+	unsigned int *sq_mask;
+	unsigned int *sq_array;
+	struct io_uring_sqe *sqes;
+	/* the completion ring */
+	void *cq_ring;
+	size_t cq_ring_size;
+	unsigned int *cq_head;
+	unsigned int *cq_tail;
+	unsigned int *cq_mask;
+	struct io_uring_cqe *cqes;
+	/* the last operation queued */
+	struct io_uring_sqe *last;
+	/* queued but not submitted */
+	unsigned int queued;
+	/* submitted but not completed */
+	unsigned int inflight;
+};
+
+static struct io_uring_sqe * _sqe_get(Mdfs_Uring *thiz, int opcode, int fd,
+		const void *addr, unsigned int len, __u64 off, unsigned long id)
+{
+	struct io_uring_sqe *sqe;
+	unsigned int tail;
+	unsigned int index;
+
+	/* the ring is full, the caller must complete before queueing more */
+	if (thiz->queued + thiz->inflight >= thiz->entries)
+		return NULL;
+	tail = *thiz->sq_tail;
+	index = tail & *thiz->sq_mask;
+	sqe = &thiz->sqes[index];
+	memset(sqe, 0, sizeof(struct io_uring_sqe));
+	sqe->opcode = opcode;
+	sqe->fd = fd;
+	sqe->addr = (unsigned long)addr;
+	sqe->len = len;
+	sqe->off = off;
+	sqe->user_data = id;
+	thiz->sq_array[index] = index;
+	__atomic_store_n(thiz->sq_tail, tail + 1, __ATOMIC_RELEASE);
+	thiz->queued++;
+	thiz->last = sqe;
+
+	return sqe;
+}
+
+static int _enter(int fd, unsigned int submit, unsigned int wait)
+{
+	return syscall(__NR_io_uring_enter, fd, submit, wait,
+			wait ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+}
+/*============================================================================*
+ *                                 Global                                     *
+ *============================================================================*/
+Mdfs_Uring * mdfs_uring_new(unsigned int entries)
+{
+	Mdfs_Uring *thiz;
+	struct io_uring_params p;
+	void *ptr;
+
+	thiz = calloc(1, sizeof(Mdfs_Uring));
+	if (!thiz) return NULL;
+
+	memset(&p, 0, sizeof(p));
+	thiz->fd = syscall(__NR_io_uring_setup, entries, &p);
+	if (thiz->fd < 0)
+		goto setup_err;
+	thiz->entries = p.sq_entries;
+
+	thiz->sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+	thiz->cq_ring_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	if (p.features & IORING_FEAT_SINGLE_MMAP)
+	{
+		if (thiz->cq_ring_size > thiz->sq_ring_size)
+			thiz->sq_ring_size = thiz->cq_ring_size;
+		thiz->cq_ring_size = thiz->sq_ring_size;
+	}
+	thiz->sq_ring = mmap(NULL, thiz->sq_ring_size, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_POPULATE, thiz->fd, IORING_OFF_SQ_RING);
+	if (thiz->sq_ring == MAP_FAILED)
+		goto sq_err;
+	if (p.features & IORING_FEAT_SINGLE_MMAP)
+	{
+		thiz->cq_ring = thiz->sq_ring;
+	}
+	else
+	{
+		thiz->cq_ring = mmap(NULL, thiz->cq_ring_size,
+				PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+				thiz->fd, IORING_OFF_CQ_RING);
+		if (thiz->cq_ring == MAP_FAILED)
+			goto cq_err;
+	}
+	ptr = mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe),
+			PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+			thiz->fd, IORING_OFF_SQES);
+	if (ptr == MAP_FAILED)
+		goto sqes_err;
+	thiz->sqes = ptr;
+
+	thiz->sq_head = (unsigned int *)((char *)thiz->sq_ring + p.sq_off.head);
+	thiz->sq_tail = (unsigned int *)((char *)thiz->sq_ring + p.sq_off.tail);
+	thiz->sq_mask = (unsigned int *)((char *)thiz->sq_ring + p.sq_off.ring_mask);
+	thiz->sq_array = (unsigned int *)((char *)thiz->sq_ring + p.sq_off.array);
+	thiz->cq_head = (unsigned int *)((char *)thiz->cq_ring + p.cq_off.head);
+	thiz->cq_tail = (unsigned int *)((char *)thiz->cq_ring + p.cq_off.tail);
+	thiz->cq_mask = (unsigned int *)((char *)thiz->cq_ring + p.cq_off.ring_mask);
+	thiz->cqes = (struct io_uring_cqe *)((char *)thiz->cq_ring + p.cq_off.cqes);
+
+	return thiz;
+sqes_err:
+	if (thiz->cq_ring != thiz->sq_ring)
+		munmap(thiz->cq_ring, thiz->cq_ring_size);
+cq_err:
+	munmap(thiz->sq_ring, thiz->sq_ring_size);
+sq_err:
+	close(thiz->fd);
+setup_err:
+	free(thiz);
+	return NULL;
+}
+
+/* the number of operations that can be queued before completing them */
+unsigned int mdfs_uring_entries(Mdfs_Uring *thiz)
+{
+	return thiz->entries;
+}
+
+int mdfs_uring_statx(Mdfs_Uring *thiz, int dirfd, const char *name,
+		struct statx *stx, unsigned int mask, unsigned long id)
+{
+	struct io_uring_sqe *sqe;
+
+	sqe = _sqe_get(thiz, IORING_OP_STATX, dirfd, name, mask,
+			(unsigned long)stx, id);
+	if (!sqe) return 0;
+	/* AT_STATX_SYNC_AS_STAT, just what stat() does */
+	sqe->statx_flags = 0;
+	return 1;
+}
+
+int mdfs_uring_openat(Mdfs_Uring *thiz, int dirfd, const char *name,
+		int flags, unsigned long id)
+{
+	struct io_uring_sqe *sqe;
+
+	sqe = _sqe_get(thiz, IORING_OP_OPENAT, dirfd, name, 0, 0, id);
+	if (!sqe) return 0;
+	sqe->open_flags = flags;
+	return 1;
+}
+
+int mdfs_uring_read(Mdfs_Uring *thiz, int fd, void *buf, size_t len,
+		off_t offset, unsigned long id)
+{
+	return _sqe_get(thiz, IORING_OP_READ, fd, buf, len, offset, id) != NULL;
+}
+
+int mdfs_uring_close(Mdfs_Uring *thiz, int fd, unsigned long id)
+{
+	return _sqe_get(thiz, IORING_OP_CLOSE, fd, NULL, 0, 0, id) != NULL;
+}
+
+int mdfs_uring_fadvise(Mdfs_Uring *thiz, int fd, off_t offset, off_t len,
+		int advice, unsigned long id)
+{
+	struct io_uring_sqe *sqe;
+
+	sqe = _sqe_get(thiz, IORING_OP_FADVISE, fd, NULL, len, offset, id);
+	if (!sqe) return 0;
+	sqe->fadvise_advice = advice;
+	return 1;
+}
+
+/* the next operation queued does not start until the last one is completed,
+ * whatever its result
+ */
+void mdfs_uring_link(Mdfs_Uring *thiz)
+{
+	if (thiz->last)
+		thiz->last->flags |= IOSQE_IO_HARDLINK;
+}
+
+/* submit everything queued and wait for all of it, cb is called with the id
+ * of every operation and its result (a negative errno on failure)
+ */
+int mdfs_uring_complete(Mdfs_Uring *thiz, Mdfs_Uring_Cb cb, void *data)
+{
+	while (thiz->queued || thiz->inflight)
+	{
+		unsigned int head;
+		unsigned int tail;
+		int ret;
+
+		ret = _enter(thiz->fd, thiz->queued, 1);
+		if (ret < 0)
+		{
+			if (errno == EINTR)
+				continue;
+			return 0;
+		}
+		thiz->queued -= ret;
+		thiz->inflight += ret;
+
+		head = *thiz->cq_head;
+		tail = __atomic_load_n(thiz->cq_tail, __ATOMIC_ACQUIRE);
+		while (head != tail)
+		{
+			struct io_uring_cqe *cqe;
+
+			cqe = &thiz->cqes[head & *thiz->cq_mask];
+			cb(data, cqe->user_data, cqe->res);
+			head++;
+			thiz->inflight--;
+		}
+		__atomic_store_n(thiz->cq_head, head, __ATOMIC_RELEASE);
+	}
+	return 1;
+}
+
+void mdfs_uring_free(Mdfs_Uring *thiz)
+{
+	munmap(thiz->sqes, thiz->entries * sizeof(struct io_uring_sqe));
+	if (thiz->cq_ring != thiz->sq_ring)
+		munmap(thiz->cq_ring, thiz->cq_ring_size);
+	munmap(thiz->sq_ring, thiz->sq_ring_size);
+	close(thiz->fd);
+	free(thiz);
+}
+#endif
@@ -0,0 +1,967 @@
+/* MetadataFS -
+ * Copyright (C) 2010 Jorge Luis Zapata
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library.
+ * If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * The catalog writer. Every mutation coming from the scanner is queued here
+ * and applied by a single thread, grouping them on transactions of at most
+ * batch_size operations or batch_time milliseconds, whatever comes first.
+ * The queue is bounded, producers block when it is full.
+ *
+ * Every scan has a generation number, the writer stamps it on the files and
+ * directories it stores or touches so once a walk is complete whatever has
+ * an older generation can be swept from the catalog.
+ */
+#include "metadatafs.h"
+#include <time.h>
+/*============================================================================*
+ *                                  Local                                     *
+ *============================================================================*/
+typedef struct _Mdfs_Writer_Op Mdfs_Writer_Op;
+
+struct _Mdfs_Writer_Op
+{
+	Mdfs_Writer_Cb cb;
+	void *data;
+	/* the order it was queued on */
+	unsigned long seq;
+	Mdfs_Writer_Op *next;
+};
+
+typedef struct _Mdfs_Writer_File
+{
+	unsigned int generation;
+	char *path;
+	time_t mtime;
+	off_t size;
+	dev_t dev;
+	ino_t ino;
+	char *artist;
+	char *album;
+	char *title;
+} Mdfs_Writer_File;
+
+typedef struct _Mdfs_Writer_Rename
+{
+	char *from;
+	char *to;
+} Mdfs_Writer_Rename;
+
+typedef struct _Mdfs_Writer_Dir
+{
+	unsigned int generation;
+	int touch;
+	char *path;
+	time_t mtime;
+	time_t ctime;
+	unsigned int children;
+} Mdfs_Writer_Dir;
+
+typedef struct _Mdfs_Writer_Category
+{
+	const char *artist;
+	const char *album;
+	const char *title;
+	int added;
+} Mdfs_Writer_Category;
+
+typedef struct _Mdfs_Writer_Checkpoint
+{
+	unsigned int generation;
+	char **paths;
+	unsigned int count;
+	int verify;
+} Mdfs_Writer_Checkpoint;
+
+typedef struct _Mdfs_Writer_Sweep
+{
+	unsigned int generation;
+	int limit;
+	int removed;
+	/* the conditions to only sweep under some directories */
+	char *files_under;
+	char *dirs_under;
+} Mdfs_Writer_Sweep;
+
+struct _Mdfs_Writer
+{
+	sqlite3 *db;
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t not_empty;
+	pthread_cond_t not_full;
+	pthread_cond_t flushed;
+	Mdfs_Writer_Op *head;
+	Mdfs_Writer_Op *tail;
+	unsigned int count;
+	unsigned int max;
+	unsigned int batch_size;
+	unsigned int batch_time;
+	/* the last operation queued and the last one committed */
+	unsigned long queued;
+	unsigned long committed;
+	/* threads waiting on a flush */
+	int flushing;
+	/* a restart of the write ahead log was requested */
+	int restart;
+	int stop;
+	/* the current scan generation, stamped on what gets stored */
+	unsigned int generation;
+	/* statistics */
+	unsigned long ops;
+	unsigned long commits;
+};
+
+static void _exec(sqlite3 *db, const char *sql)
+{
+	int error;
+
+	while ((error = sqlite3_exec(db, sql, NULL, NULL, NULL)) == SQLITE_BUSY)
+		usleep(1000);
+	if (error != SQLITE_OK)
+		printf("writer: %s failed: %s\n", sql, sqlite3_errmsg(db));
+}
+
+static void _deadline_get(struct timespec *ts, unsigned int ms)
+{
+	clock_gettime(CLOCK_REALTIME, ts);
+	ts->tv_sec += ms / 1000;
+	ts->tv_nsec += (ms % 1000) * 1000000;
+	if (ts->tv_nsec >= 1000000000)
+	{
+		ts->tv_sec++;
+		ts->tv_nsec -= 1000000000;
+	}
+}
+
+static int _deadline_passed(struct timespec *deadline)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_REALTIME, &now);
+	if (now.tv_sec != deadline->tv_sec)
+		return now.tv_sec > deadline->tv_sec;
+	return now.tv_nsec >= deadline->tv_nsec;
+}
+
+static void _file_insert(sqlite3 *db, void *data)
+{
+	Mdfs_Writer_File *f = data;
+	Mdfs_Artist *artist;
+	Mdfs_Album *album;
+	Mdfs_Title *title;
+	Mdfs_File *file;
+
+	artist = mdfs_artist_new(db, f->artist);
+	if (!artist) goto end_artist;
+	album = mdfs_album_new(db, f->album, artist->id);
+	if (!album) goto end_album;
+	title = mdfs_title_new(db, f->title, album->id);
+	if (!title) goto end_title;
+
+	file = mdfs_file_new(db, f->path, f->mtime, f->size, f->dev, f->ino,
+			title->id, f->generation);
+	if (file) mdfs_file_free(file);
+	mdfs_title_free(title);
+end_title:
+	mdfs_album_free(album);
+end_album:
+	mdfs_artist_free(artist);
+end_artist:
+	free(f->path);
+	free(f->artist);
+	free(f->album);
+	free(f->title);
+	free(f);
+}
+
+/* remove the titles, albums and artists left without files, of the titles
+ * on the temporary table name. Only those that had files are considered,
+ * the empty ones created through mkdir stay
+ */
+static void _cascade(sqlite3 *db, const char *name)
+{
+	char *str;
+
+	str = sqlite3_mprintf("CREATE TEMP TABLE IF NOT EXISTS "
+			"%s_titles(title INTEGER PRIMARY KEY);"
+			"CREATE TEMP TABLE %s_albums AS "
+			"SELECT id,album FROM title WHERE "
+			"id IN (SELECT title FROM temp.%s_titles) AND "
+			"id NOT IN (SELECT title FROM files);"
+			"DELETE FROM title WHERE id IN (SELECT id FROM temp.%s_albums);"
+			"CREATE TEMP TABLE %s_artists AS "
+			"SELECT id,artist FROM album WHERE "
+			"id IN (SELECT album FROM temp.%s_albums) AND "
+			"id NOT IN (SELECT album FROM title);"
+			"DELETE FROM album WHERE id IN (SELECT id FROM temp.%s_artists);"
+			"DELETE FROM artist WHERE "
+			"id IN (SELECT artist FROM temp.%s_artists) AND "
+			"id NOT IN (SELECT artist FROM album);"
+			"DROP TABLE IF EXISTS temp.%s;"
+			"DROP TABLE temp.%s_titles;"
+			"DROP TABLE temp.%s_albums;"
+			"DROP TABLE temp.%s_artists;",
+			name, name, name, name, name, name, name, name, name,
+			name, name, name);
+	sqlite3_exec(db, str, NULL, NULL, NULL);
+	sqlite3_free(str);
+}
+
+/* the tags of a cataloged file might have changed, keep its row */
+static void _file_update(sqlite3 *db, void *data)
+{
+	Mdfs_Writer_File *f = data;
+	Mdfs_Artist *artist;
+	Mdfs_Album *album;
+	Mdfs_Title *title;
+	Mdfs_File *file;
+	int retitled;
+
+	/* the path is unique on the catalog */
+	file = mdfs_file_get_from_path(db, f->path);
+	if (!file)
+	{
+		_file_insert(db, f);
+		return;
+	}
+	artist = mdfs_artist_new(db, f->artist);
+	if (!artist) goto end_artist;
+	album = mdfs_album_new(db, f->album, artist->id);
+	if (!album) goto end_album;
+	title = mdfs_title_new(db, f->title, album->id);
+	if (!title) goto end_title;
+
+	retitled = file->title != title->id;
+	if (retitled)
+	{
+		char *str;
+
+		str = sqlite3_mprintf("CREATE TEMP TABLE IF NOT EXISTS "
+				"updated_titles(title INTEGER PRIMARY KEY);"
+				"INSERT OR IGNORE INTO temp.updated_titles "
+				"VALUES (%d);", file->title);
+		sqlite3_exec(db, str, NULL, NULL, NULL);
+		sqlite3_free(str);
+	}
+	mdfs_file_update(file, db, f->path, f->mtime, f->size, title->id);
+	mdfs_file_touch(db, f->path, f->dev, f->ino, f->generation);
+	/* the old title might be left alone */
+	if (retitled)
+		_cascade(db, "updated");
+	mdfs_title_free(title);
+end_title:
+	mdfs_album_free(album);
+end_album:
+	mdfs_artist_free(artist);
+end_artist:
+	mdfs_file_free(file);
+	free(f->path);
+	free(f->artist);
+	free(f->album);
+	free(f->title);
+	free(f);
+}
+
+/* remove a file or a whole directory */
+static void _remove(sqlite3 *db, const char *path)
+{
+	char *str;
+	int len;
+
+	len = strlen(path) + 1;
+	str = sqlite3_mprintf("CREATE TEMP TABLE IF NOT EXISTS "
+			"removed_titles(title INTEGER PRIMARY KEY);"
+			"INSERT OR IGNORE INTO temp.removed_titles "
+			"SELECT title FROM files WHERE file = '%q' OR "
+			"substr(file, 1, %d) = '%q/';"
+			"DELETE FROM files WHERE file = '%q' OR "
+			"substr(file, 1, %d) = '%q/';"
+			"DELETE FROM dirs WHERE path = '%q' OR "
+			"substr(path, 1, %d) = '%q/';",
+			path, len, path, path, len, path, path, len, path);
+	sqlite3_exec(db, str, NULL, NULL, NULL);
+	sqlite3_free(str);
+	_cascade(db, "removed");
+}
+
+static void _file_remove(sqlite3 *db, void *data)
+{
+	Mdfs_Writer_File *f = data;
+
+	_remove(db, f->path);
+	free(f->path);
+	free(f);
+}
+
+/* rewrite the path of a file, or the prefix of everything under a
+ * directory, replacing whatever was at the destination
+ */
+static void _file_rename(sqlite3 *db, void *data)
+{
+	Mdfs_Writer_Rename *r = data;
+	char *str;
+	int len;
+
+	_remove(db, r->to);
+	len = strlen(r->from) + 1;
+	str = sqlite3_mprintf("UPDATE files SET file = '%q' || substr(file, %d) "
+			"WHERE file = '%q' OR substr(file, 1, %d) = '%q/';"
+			"UPDATE dirs SET path = '%q' || substr(path, %d) "
+			"WHERE path = '%q' OR substr(path, 1, %d) = '%q/';",
+			r->to, len, r->from, len, r->from,
+			r->to, len, r->from, len, r->from);
+	sqlite3_exec(db, str, NULL, NULL, NULL);
+	sqlite3_free(str);
+	free(r->from);
+	free(r->to);
+	free(r);
+}
+
+static void _dir_add(sqlite3 *db, void *data)
+{
+	Mdfs_Writer_Dir *d = data;
+	Mdfs_Dir *dir;
+
+	if (d->touch)
+	{
+		mdfs_dir_touch(db, d->path, d->generation);
+		goto end;
+	}
+	dir = mdfs_dir_new(db, d->path, d->mtime, d->ctime, d->children,
+			d->generation);
+	if (dir) mdfs_dir_free(dir);
+end:
+	free(d->path);
+	free(d);
+}
+
+static void _file_touch(sqlite3 *db, void *data)
+{
+	Mdfs_Writer_File *f = data;
+
+	mdfs_file_touch(db, f->path, f->dev, f->ino, f->generation);
+	free(f->path);
+	free(f);
+}
+static void _file_move(sqlite3 *db, void *data)
+{
+	Mdfs_Writer_File *f = data;
+	Mdfs_File *file;
+	Mdfs_File *other;
+	struct stat st;
+
+	file = mdfs_file_get_from_identity(db, f->dev, f->ino, f->mtime,
+			f->size);
+	if (!file)
+	{
+		printf("no file with the identity of %s\n", f->path);
+		goto end;
+	}
+	/* whatever was cataloged on the new path is replaced */
+	if (strcmp(file->path, f->path) &&
+			(other = mdfs_file_get_from_path(db, f->path)))
+	{
+		mdfs_file_free(other);
+		_remove(db, f->path);
+	}
+	/* if the cataloged path still leads to the same file we have a hard
+	 * link, otherwise the file has been moved or renamed
+	 */
+	if (strcmp(file->path, f->path) && !stat(file->path, &st) &&
+			st.st_dev == f->dev && st.st_ino == f->ino)
+		mdfs_file_link(file, db, f->path, f->generation);
+	else
+		mdfs_file_move(file, db, f->path, f->generation);
+	mdfs_file_free(file);
+end:
+	free(f->path);
+	free(f);
+}
+
+static void _checkpoint(sqlite3 *db, void *data)
+{
+	Mdfs_Writer_Checkpoint *c = data;
+	unsigned int i;
+
+	if (c->paths)
+		mdfs_checkpoint_save(db, c->paths, c->count, c->generation,
+				c->verify);
+	else
+		mdfs_checkpoint_clear(db);
+	for (i = 0; i < c->count; i++)
+		free(c->paths[i]);
+	free(c->paths);
+	free(c);
+}
+
+/* an empty category created through mkdir, under a parent already there */
+static void _category_add(sqlite3 *db, void *data)
+{
+	Mdfs_Writer_Category *c = data;
+	Mdfs_Artist *artist = NULL;
+	Mdfs_Album *album = NULL;
+	Mdfs_Title *title = NULL;
+
+	if (c->title)
+	{
+		album = mdfs_album_get_from_name(db, c->album);
+		if (album)
+			title = mdfs_title_new(db, c->title, album->id);
+		c->added = title != NULL;
+	}
+	else if (c->album)
+	{
+		artist = mdfs_artist_get(db, c->artist);
+		if (artist)
+			album = mdfs_album_new(db, c->album, artist->id);
+		c->added = album != NULL;
+	}
+	else
+	{
+		artist = mdfs_artist_new(db, c->artist);
+		c->added = artist != NULL;
+	}
+	if (title) mdfs_title_free(title);
+	if (album) mdfs_album_free(album);
+	if (artist) mdfs_artist_free(artist);
+}
+
+static void _stmts_free(sqlite3 *db, void *data)
+{
+	mdfs_stmt_cache_free(data);
+}
+
+/* Remove at most sweep->limit files not seen on the current generation,
+ * either because their directory was examined and they were not found or
+ * because their directory is gone. Their titles are kept aside for the
+ * cascade. The directory of a file is what rtrim() leaves once every
+ * character but the slashes is stripped from its end
+ */
+static void _sweep_files(sqlite3 *db, void *data)
+{
+	Mdfs_Writer_Sweep *sweep = data;
+	char *str;
+
+	sqlite3_exec(db, "CREATE TEMP TABLE IF NOT EXISTS "
+			"swept(id INTEGER PRIMARY KEY, title INTEGER);"
+			"DELETE FROM temp.swept;", NULL, NULL, NULL);
+	str = sqlite3_mprintf("INSERT INTO temp.swept (id, title) "
+			"SELECT id,title FROM files WHERE gen < %u AND ("
+			"rtrim(file, replace(file, '/', '')) IN "
+			"(SELECT path || '/' FROM dirs WHERE examined = %u) OR "
+			"rtrim(file, replace(file, '/', '')) NOT IN "
+			"(SELECT path || '/' FROM dirs WHERE gen = %u))%s LIMIT %d;",
+			sweep->generation, sweep->generation,
+			sweep->generation, sweep->files_under, sweep->limit);
+	if (sqlite3_exec(db, str, NULL, NULL, NULL) != SQLITE_OK)
+	{
+		printf("writer: sweep failed: %s\n", sqlite3_errmsg(db));
+		sweep->removed = 0;
+		goto end;
+	}
+	sweep->removed = sqlite3_changes(db);
+	sqlite3_exec(db, "CREATE TEMP TABLE IF NOT EXISTS "
+			"swept_titles(title INTEGER PRIMARY KEY);"
+			"INSERT OR IGNORE INTO temp.swept_titles "
+			"SELECT title FROM temp.swept;"
+			"DELETE FROM files WHERE id IN (SELECT id FROM temp.swept);",
+			NULL, NULL, NULL);
+end:
+	sqlite3_free(str);
+}
+
+static void _sweep_cascade(sqlite3 *db, void *data)
+{
+	Mdfs_Writer_Sweep *sweep = data;
+	char *str;
+
+	_cascade(db, "swept");
+	str = sqlite3_mprintf("DELETE FROM dirs WHERE gen < %u%s;",
+			sweep->generation, sweep->dirs_under);
+	sqlite3_exec(db, str, NULL, NULL, NULL);
+	sqlite3_free(str);
+}
+
+static void _dirs_touch(sqlite3 *db, void *data)
+{
+	Mdfs_Writer_Dir *d = data;
+	char *str;
+
+	str = sqlite3_mprintf("UPDATE dirs SET gen = %u, examined = %u;",
+			d->generation, d->generation);
+	sqlite3_exec(db, str, NULL, NULL, NULL);
+	sqlite3_free(str);
+	free(d);
+}
+
+/* copy the log back to the catalog and truncate it, a reader still on an
+ * older transaction keeps it from being restarted until the next time
+ */
+static void _wal_restart(sqlite3 *db)
+{
+	int error;
+
+	error = sqlite3_wal_checkpoint_v2(db, NULL, SQLITE_CHECKPOINT_TRUNCATE,
+			NULL, NULL);
+	if (error != SQLITE_OK && error != SQLITE_BUSY)
+		printf("writer: the log checkpoint failed: %s\n",
+				sqlite3_errmsg(db));
+}
+
+static void * _writer_run(void *data)
+{
+	Mdfs_Writer *thiz = data;
+	/* the catalog of the current transaction */
+	sqlite3 *db = NULL;
+	struct timespec deadline;
+	int in_transaction = 0;
+	unsigned int batch = 0;
+	/* the last operation applied */
+	unsigned long last = 0;
+
+	pthread_mutex_lock(&thiz->lock);
+	for (;;)
+	{
+		Mdfs_Writer_Op *op;
+		int timeout = 0;
+
+		while (!thiz->head && !thiz->stop && !thiz->flushing &&
+				!thiz->restart && !timeout)
+		{
+			if (in_transaction)
+				timeout = pthread_cond_timedwait(&thiz->not_empty,
+						&thiz->lock, &deadline) == ETIMEDOUT;
+			else
+				pthread_cond_wait(&thiz->not_empty, &thiz->lock);
+		}
+		/* the log can only be restarted between transactions */
+		if (thiz->restart && !in_transaction)
+		{
+			pthread_mutex_unlock(&thiz->lock);
+			_wal_restart(thiz->db);
+			pthread_mutex_lock(&thiz->lock);
+			thiz->restart = 0;
+			pthread_cond_broadcast(&thiz->flushed);
+			continue;
+		}
+		if ((!thiz->head || thiz->restart) && in_transaction)
+		{
+			/* nothing else arrived in time or someone is waiting
+			 * for it, commit what we have
+			 */
+			pthread_mutex_unlock(&thiz->lock);
+			_exec(db, "COMMIT");
+			pthread_mutex_lock(&thiz->lock);
+			in_transaction = 0;
+			batch = 0;
+			thiz->commits++;
+			thiz->committed = last;
+			pthread_cond_broadcast(&thiz->flushed);
+			continue;
+		}
+		if (!thiz->head && !thiz->stop)
+		{
+			/* a flush with nothing to commit */
+			pthread_cond_broadcast(&thiz->flushed);
+			pthread_cond_wait(&thiz->not_empty, &thiz->lock);
+			continue;
+		}
+		if (!thiz->head)
+		{
+			/* stopped and everything committed */
+			break;
+		}
+		op = thiz->head;
+		thiz->head = op->next;
+		if (!thiz->head) thiz->tail = NULL;
+		thiz->count--;
+		last = op->seq;
+		pthread_cond_signal(&thiz->not_full);
+		if (!in_transaction)
+			db = thiz->db;
+		pthread_mutex_unlock(&thiz->lock);
+
+		if (!in_transaction)
+		{
+			_exec(db, "BEGIN");
+			_deadline_get(&deadline, thiz->batch_time);
+			in_transaction = 1;
+		}
+		op->cb(db, op->data);
+		free(op);
+		batch++;
+
+		pthread_mutex_lock(&thiz->lock);
+		thiz->ops++;
+		if (batch >= thiz->batch_size || _deadline_passed(&deadline))
+		{
+			pthread_mutex_unlock(&thiz->lock);
+			_exec(db, "COMMIT");
+			pthread_mutex_lock(&thiz->lock);
+			in_transaction = 0;
+			batch = 0;
+			thiz->commits++;
+			thiz->committed = last;
+			if (thiz->flushing)
+				pthread_cond_broadcast(&thiz->flushed);
+		}
+	}
+	pthread_mutex_unlock(&thiz->lock);
+	return NULL;
+}
+/*============================================================================*
+ *                                 Global                                     *
+ *============================================================================*/
+Mdfs_Writer * mdfs_writer_new(sqlite3 *db, unsigned int batch_size,
+		unsigned int batch_time)
+{
+	Mdfs_Writer *thiz;
+
+	thiz = calloc(1, sizeof(Mdfs_Writer));
+	if (!thiz) return NULL;
+	thiz->db = db;
+	thiz->batch_size = batch_size ? batch_size : 1;
+	thiz->batch_time = batch_time;
+	/* let the producers get a full batch ahead of the writer */
+	thiz->max = thiz->batch_size * 2;
+	pthread_mutex_init(&thiz->lock, NULL);
+	pthread_cond_init(&thiz->not_empty, NULL);
+	pthread_cond_init(&thiz->not_full, NULL);
+	pthread_cond_init(&thiz->flushed, NULL);
+	if (pthread_create(&thiz->thread, NULL, _writer_run, thiz))
+	{
+		perror("pthread_create");
+		free(thiz);
+		return NULL;
+	}
+	return thiz;
+}
+
+/* queue a catalog operation, cb is called from the writer thread inside a
+ * transaction and owns data. Blocks while the queue is full
+ */
+void mdfs_writer_push(Mdfs_Writer *thiz, Mdfs_Writer_Cb cb, void *data)
+{
+	Mdfs_Writer_Op *op;
+
+	op = malloc(sizeof(Mdfs_Writer_Op));
+	op->cb = cb;
+	op->data = data;
+	op->next = NULL;
+
+	pthread_mutex_lock(&thiz->lock);
+	while (thiz->count >= thiz->max)
+		pthread_cond_wait(&thiz->not_full, &thiz->lock);
+	if (thiz->tail)
+		thiz->tail->next = op;
+	else
+		thiz->head = op;
+	thiz->tail = op;
+	thiz->count++;
+	op->seq = ++thiz->queued;
+	pthread_cond_signal(&thiz->not_empty);
+	pthread_mutex_unlock(&thiz->lock);
+}
+
+/* add a file with its tags to the catalog, or replace them if the path is
+ * already there. The tag strings are owned by the writer from now on
+ */
+void mdfs_writer_file_add(Mdfs_Writer *thiz, const char *path,
+		struct stat *st, char *artist, char *album, char *title)
+{
+	Mdfs_Writer_File *f;
+
+	f = malloc(sizeof(Mdfs_Writer_File));
+	f->generation = thiz->generation;
+	f->path = strdup(path);
+	f->mtime = st->st_mtime;
+	f->size = st->st_size;
+	f->dev = st->st_dev;
+	f->ino = st->st_ino;
+	f->artist = artist;
+	f->album = album;
+	f->title = title;
+	mdfs_writer_push(thiz, _file_update, f);
+}
+
+/* remove a file that is gone from the source, with a directory everything
+ * under it is removed
+ */
+void mdfs_writer_file_remove(Mdfs_Writer *thiz, const char *path)
+{
+	Mdfs_Writer_File *f;
+
+	f = calloc(1, sizeof(Mdfs_Writer_File));
+	f->path = strdup(path);
+	mdfs_writer_push(thiz, _file_remove, f);
+}
+
+/* a source file or directory has been renamed, its files keep their tags */
+void mdfs_writer_file_rename(Mdfs_Writer *thiz, const char *from,
+		const char *to)
+{
+	Mdfs_Writer_Rename *r;
+
+	r = malloc(sizeof(Mdfs_Writer_Rename));
+	r->from = strdup(from);
+	r->to = strdup(to);
+	mdfs_writer_push(thiz, _file_rename, r);
+}
+
+/* mark a file already on the catalog as seen on the current generation */
+void mdfs_writer_file_touch(Mdfs_Writer *thiz, const char *path,
+		struct stat *st)
+{
+	Mdfs_Writer_File *f;
+
+	f = calloc(1, sizeof(Mdfs_Writer_File));
+	f->generation = thiz->generation;
+	f->path = strdup(path);
+	f->dev = st->st_dev;
+	f->ino = st->st_ino;
+	mdfs_writer_push(thiz, _file_touch, f);
+}
+
+/* the file at path is already on the catalog with another path, as found by
+ * its identity, update it instead of parsing it again
+ */
+void mdfs_writer_file_move(Mdfs_Writer *thiz, const char *path,
+		struct stat *st)
+{
+	Mdfs_Writer_File *f;
+
+	f = calloc(1, sizeof(Mdfs_Writer_File));
+	f->generation = thiz->generation;
+	f->path = strdup(path);
+	f->mtime = st->st_mtime;
+	f->size = st->st_size;
+	f->dev = st->st_dev;
+	f->ino = st->st_ino;
+	mdfs_writer_push(thiz, _file_move, f);
+}
+
+/* store the state of a scanned source directory, queue it once all of its
+ * files are queued so it is never committed before them
+ */
+void mdfs_writer_dir_add(Mdfs_Writer *thiz, const char *path, time_t mtime,
+		time_t ctime, unsigned int children)
+{
+	Mdfs_Writer_Dir *d;
+
+	d = calloc(1, sizeof(Mdfs_Writer_Dir));
+	d->generation = thiz->generation;
+	d->path = strdup(path);
+	d->mtime = mtime;
+	d->ctime = ctime;
+	d->children = children;
+	mdfs_writer_push(thiz, _dir_add, d);
+}
+
+/* mark a directory whose files were not examined as seen on the current
+ * generation
+ */
+void mdfs_writer_dir_touch(Mdfs_Writer *thiz, const char *path)
+{
+	Mdfs_Writer_Dir *d;
+
+	d = calloc(1, sizeof(Mdfs_Writer_Dir));
+	d->generation = thiz->generation;
+	d->touch = 1;
+	d->path = strdup(path);
+	mdfs_writer_push(thiz, _dir_add, d);
+}
+
+/* Add an artist, an album of an artist or a title of an album with no
+ * files yet. Waits for it to be committed, returns 0 if the parent is not
+ * there
+ */
+int mdfs_writer_category_add(Mdfs_Writer *thiz, const char *artist,
+		const char *album, const char *title)
+{
+	Mdfs_Writer_Category c;
+
+	c.artist = artist;
+	c.album = album;
+	c.title = title;
+	c.added = 0;
+	mdfs_writer_push(thiz, _category_add, &c);
+	mdfs_writer_flush(thiz);
+	return c.added;
+}
+
+/* mark every directory on the catalog as seen on the current generation with
+ * its files examined, for when the files are known by other means than a walk
+ */
+void mdfs_writer_dirs_touch(Mdfs_Writer *thiz)
+{
+	Mdfs_Writer_Dir *d;
+
+	d = calloc(1, sizeof(Mdfs_Writer_Dir));
+	d->generation = thiz->generation;
+	mdfs_writer_push(thiz, _dirs_touch, d);
+}
+
+/* Store the directories the current scan has left to walk. As it goes
+ * through the queue it is committed together with everything the scanner
+ * did before taking it. Takes ownership of the paths, with no paths the
+ * checkpoint is removed
+ */
+void mdfs_writer_checkpoint(Mdfs_Writer *thiz, char **paths,
+		unsigned int count, int verify)
+{
+	Mdfs_Writer_Checkpoint *c;
+
+	c = malloc(sizeof(Mdfs_Writer_Checkpoint));
+	c->generation = thiz->generation;
+	c->paths = paths;
+	c->count = count;
+	c->verify = verify;
+	mdfs_writer_push(thiz, _checkpoint, c);
+}
+
+/* set the generation stamped on everything stored from now on */
+void mdfs_writer_generation_set(Mdfs_Writer *thiz, unsigned int generation)
+{
+	pthread_mutex_lock(&thiz->lock);
+	thiz->generation = generation;
+	pthread_mutex_unlock(&thiz->lock);
+}
+
+/* the catalog the operations are applied on */
+sqlite3 * mdfs_writer_db_get(Mdfs_Writer *thiz)
+{
+	sqlite3 *db;
+
+	pthread_mutex_lock(&thiz->lock);
+	db = thiz->db;
+	pthread_mutex_unlock(&thiz->lock);
+	return db;
+}
+
+/* apply the operations queued from now on to another catalog, whatever was
+ * queued before is committed on the current one
+ */
+void mdfs_writer_db_set(Mdfs_Writer *thiz, sqlite3 *db)
+{
+	/* the statements of the writer thread on the current one */
+	mdfs_writer_push(thiz, _stmts_free, thiz->db);
+	mdfs_writer_flush(thiz);
+	pthread_mutex_lock(&thiz->lock);
+	thiz->db = db;
+	pthread_mutex_unlock(&thiz->lock);
+}
+
+/* the condition for a column to be one of the paths or under them */
+static char * _sweep_under(const char *column, char **paths,
+		unsigned int count)
+{
+	char *str;
+	unsigned int i;
+
+	if (!count)
+		return sqlite3_mprintf("");
+	str = sqlite3_mprintf(" AND (0");
+	for (i = 0; i < count; i++)
+	{
+		char *tmp = str;
+
+		str = sqlite3_mprintf("%s OR %s = '%q' OR "
+				"substr(%s, 1, %d) = '%q/'", tmp, column,
+				paths[i], column, (int)strlen(paths[i]) + 1,
+				paths[i]);
+		sqlite3_free(tmp);
+	}
+	return sqlite3_mprintf("%z)", str);
+}
+
+/* Remove from the catalog whatever was not seen on the current generation,
+ * it must only be called once a full walk has been completed. With roots
+ * only what is under them is considered, for a walk of those directories
+ * alone. The files are removed on transactions of at most batch_size rows.
+ * Returns the number of removed files
+ */
+unsigned long mdfs_writer_sweep(Mdfs_Writer *thiz, char **roots,
+		unsigned int count)
+{
+	Mdfs_Writer_Sweep sweep;
+	unsigned long removed = 0;
+
+	sweep.generation = thiz->generation;
+	sweep.limit = thiz->batch_size;
+	sweep.files_under = _sweep_under("file", roots, count);
+	sweep.dirs_under = _sweep_under("path", roots, count);
+	do
+	{
+		mdfs_writer_push(thiz, _sweep_files, &sweep);
+		mdfs_writer_flush(thiz);
+		removed += sweep.removed;
+	} while (sweep.removed);
+	mdfs_writer_push(thiz, _sweep_cascade, &sweep);
+	mdfs_writer_flush(thiz);
+	sqlite3_free(sweep.files_under);
+	sqlite3_free(sweep.dirs_under);
+
+	return removed;
+}
+
+/* wait until everything queued so far is committed, not what is queued
+ * meanwhile
+ */
+void mdfs_writer_flush(Mdfs_Writer *thiz)
+{
+	unsigned long seq;
+
+	pthread_mutex_lock(&thiz->lock);
+	seq = thiz->queued;
+	thiz->flushing++;
+	pthread_cond_signal(&thiz->not_empty);
+	while (thiz->committed < seq)
+		pthread_cond_wait(&thiz->flushed, &thiz->lock);
+	thiz->flushing--;
+	pthread_mutex_unlock(&thiz->lock);
+}
+
+/* commit what is queued so far and restart the write ahead log, it grows
+ * for as long as a reader keeps a transaction open on it
+ */
+void mdfs_writer_wal_restart(Mdfs_Writer *thiz)
+{
+	pthread_mutex_lock(&thiz->lock);
+	thiz->restart = 1;
+	pthread_cond_signal(&thiz->not_empty);
+	while (thiz->restart)
+		pthread_cond_wait(&thiz->flushed, &thiz->lock);
+	pthread_mutex_unlock(&thiz->lock);
+}
+
+void mdfs_writer_free(Mdfs_Writer *thiz)
+{
+	pthread_mutex_lock(&thiz->lock);
+	thiz->stop = 1;
+	pthread_cond_signal(&thiz->not_empty);
+	pthread_mutex_unlock(&thiz->lock);
+	pthread_join(thiz->thread, NULL);
+
+	printf("writer: %lu operations in %lu transactions\n", thiz->ops,
+			thiz->commits);
+	pthread_mutex_destroy(&thiz->lock);
+	pthread_cond_destroy(&thiz->not_empty);
+	pthread_cond_destroy(&thiz->not_full);
+	pthread_cond_destroy(&thiz->flushed);
+	free(thiz);
+}
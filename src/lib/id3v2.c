@@ -0,0 +1,463 @@
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include "libmetadatafs.h"
+
+/*
+ * A read only ID3v2 (2.2, 2.3 and 2.4) parser. Only the tag at the start of
+ * the file is looked for, the frames are walked one by one and only those we
+ * need are read, so big frames like the attached pictures are skipped
+ * without touching them. Whatever we do not understand, like compressed or
+ * encrypted frames, is left to the caller to handle in some other way.
+ */
+/*============================================================================*
+ *                                  Local                                     *
+ *============================================================================*/
+#define ID3V2_HEADER_SIZE 10
+/* the first read covers the header and the usual text frames */
+#define ID3V2_FIRST_READ 4096
+/* how much of the rest of a big tag is read ahead while the first frames are
+ * parsed
+ */
+#define ID3V2_READAHEAD 16384
+
+typedef enum _id3v2_field
+{
+	ID3V2_ARTIST,
+	ID3V2_ALBUM,
+	ID3V2_TITLE,
+	ID3V2_FIELDS,
+} id3v2_field;
+
+typedef struct _id3v2_frame
+{
+	const char *id;
+	id3v2_field field;
+	/* lower is preferred */
+	int priority;
+} id3v2_frame;
+
+static const id3v2_frame _frames[] = {
+	{ "TPE1", ID3V2_ARTIST, 0 },
+	{ "TPE2", ID3V2_ARTIST, 1 },
+	{ "TALB", ID3V2_ALBUM, 0 },
+	{ "TIT2", ID3V2_TITLE, 0 },
+	/* version 2.2 */
+	{ "TP1", ID3V2_ARTIST, 0 },
+	{ "TP2", ID3V2_ARTIST, 1 },
+	{ "TAL", ID3V2_ALBUM, 0 },
+	{ "TT2", ID3V2_TITLE, 0 },
+	{ NULL, 0, 0 },
+};
+
+typedef struct _id3v2_reader
+{
+	const char *file;
+	int fd;
+	/* what we have of the start of the file */
+	const unsigned char *cache;
+	size_t cache_len;
+	unsigned char first[ID3V2_FIRST_READ];
+	/* the frames out of the cache are read here */
+	unsigned char *scratch;
+	size_t scratch_size;
+	/* the end of what has been read of the file */
+	size_t read;
+} id3v2_reader;
+
+/* get len bytes at offset of the file, from the cache if possible */
+static const unsigned char * _fetch(id3v2_reader *r, size_t offset, size_t len)
+{
+	ssize_t ret;
+
+	if (offset + len <= r->cache_len)
+		return r->cache + offset;
+	if (r->fd < 0)
+	{
+		r->fd = libmetadatafs_tags_open(r->file);
+		if (r->fd < 0)
+			return NULL;
+	}
+	if (len > r->scratch_size)
+	{
+		unsigned char *tmp;
+
+		tmp = realloc(r->scratch, len);
+		if (!tmp) return NULL;
+		r->scratch = tmp;
+		r->scratch_size = len;
+	}
+	ret = pread(r->fd, r->scratch, len, offset);
+	if (ret > 0 && offset + ret > r->read)
+		r->read = offset + ret;
+	if (ret < 0 || (size_t)ret != len)
+		return NULL;
+	return r->scratch;
+}
+
+static unsigned int _synchsafe(const unsigned char *b)
+{
+	return ((b[0] & 0x7f) << 21) | ((b[1] & 0x7f) << 14) |
+			((b[2] & 0x7f) << 7) | (b[3] & 0x7f);
+}
+
+static unsigned int _be32(const unsigned char *b)
+{
+	return (b[0] << 24) | (b[1] << 16) | (b[2] << 8) | b[3];
+}
+
+/* undo the unsynchronisation, every 0xff 0x00 becomes 0xff. Returns the new
+ * length
+ */
+static size_t _unsync(unsigned char *b, size_t len)
+{
+	size_t i;
+	size_t j;
+
+	for (i = 0, j = 0; i < len; i++)
+	{
+		b[j++] = b[i];
+		if (b[i] == 0xff && i + 1 < len && b[i + 1] == 0x00)
+			i++;
+	}
+	return j;
+}
+
+static char * _utf8_put(char *dst, unsigned int c)
+{
+	if (c < 0x80)
+	{
+		*dst++ = c;
+	}
+	else if (c < 0x800)
+	{
+		*dst++ = 0xc0 | (c >> 6);
+		*dst++ = 0x80 | (c & 0x3f);
+	}
+	else if (c < 0x10000)
+	{
+		*dst++ = 0xe0 | (c >> 12);
+		*dst++ = 0x80 | ((c >> 6) & 0x3f);
+		*dst++ = 0x80 | (c & 0x3f);
+	}
+	else
+	{
+		*dst++ = 0xf0 | (c >> 18);
+		*dst++ = 0x80 | ((c >> 12) & 0x3f);
+		*dst++ = 0x80 | ((c >> 6) & 0x3f);
+		*dst++ = 0x80 | (c & 0x3f);
+	}
+	return dst;
+}
+
+/* Decode a text frame into UTF-8. A frame might have several strings
+ * separated by a NUL, they are joined with a space
+ */
+static char * _text_decode(const unsigned char *b, size_t len)
+{
+	unsigned char enc;
+	char *str;
+	char *dst;
+	size_t i;
+	int le = 0;
+
+	if (!len) return NULL;
+	enc = b[0];
+	b++;
+	len--;
+	/* the worst case is a latin1 or UTF-16 char to three bytes */
+	str = malloc(len * 3 + 1);
+	if (!str) return NULL;
+	dst = str;
+
+	switch (enc)
+	{
+		case 0:
+		case 3:
+		for (i = 0; i < len; i++)
+		{
+			if (!b[i])
+				*dst++ = ' ';
+			else if (enc == 0)
+				dst = _utf8_put(dst, b[i]);
+			else
+				*dst++ = b[i];
+		}
+		break;
+
+		case 1:
+		case 2:
+		le = 0;
+		for (i = 0; i + 1 < len; i += 2)
+		{
+			unsigned int c;
+
+			/* every string on a UTF-16 frame has its own BOM */
+			if (enc == 1 && b[i] == 0xff && b[i + 1] == 0xfe)
+			{
+				le = 1;
+				continue;
+			}
+			if (enc == 1 && b[i] == 0xfe && b[i + 1] == 0xff)
+			{
+				le = 0;
+				continue;
+			}
+			c = le ? b[i] | (b[i + 1] << 8) : (b[i] << 8) | b[i + 1];
+			if (c >= 0xd800 && c < 0xdc00 && i + 3 < len)
+			{
+				unsigned int c2;
+
+				c2 = le ? b[i + 2] | (b[i + 3] << 8) :
+						(b[i + 2] << 8) | b[i + 3];
+				if (c2 >= 0xdc00 && c2 < 0xe000)
+				{
+					c = 0x10000 + ((c - 0xd800) << 10) +
+							(c2 - 0xdc00);
+					i += 2;
+				}
+			}
+			if (!c)
+				*dst++ = ' ';
+			else
+				dst = _utf8_put(dst, c);
+		}
+		break;
+
+		default:
+		free(str);
+		return NULL;
+	}
+	/* the separators and terminators left at the end */
+	while (dst > str && dst[-1] == ' ')
+		dst--;
+	*dst = '\0';
+	if (!*str)
+	{
+		free(str);
+		return NULL;
+	}
+	return str;
+}
+
+static const id3v2_frame * _frame_find(const unsigned char *id, int version)
+{
+	const id3v2_frame *f;
+	size_t len = version == 2 ? 3 : 4;
+
+	for (f = _frames; f->id; f++)
+	{
+		if (strlen(f->id) == len && !memcmp(f->id, id, len))
+			return f;
+	}
+	return NULL;
+}
+
+/* Walk the frames of the tag. Returns 0 if something we need could not be
+ * understood
+ */
+static int _frames_parse(id3v2_reader *r, int version, size_t pos, size_t end,
+		char *values[ID3V2_FIELDS])
+{
+	int priority[ID3V2_FIELDS] = { 2, 2, 2 };
+	size_t hlen = version == 2 ? 6 : 10;
+
+	while (pos + hlen <= end)
+	{
+		const unsigned char *h;
+		const unsigned char *data;
+		const id3v2_frame *f;
+		unsigned char *copy = NULL;
+		unsigned int flags = 0;
+		size_t size;
+		char *text;
+
+		/* everything we need is already there */
+		if (!priority[ID3V2_ARTIST] && !priority[ID3V2_ALBUM] &&
+				!priority[ID3V2_TITLE])
+			break;
+		h = _fetch(r, pos, hlen);
+		if (!h) return 0;
+		/* the padding */
+		if (!h[0])
+			break;
+		if (version == 2)
+			size = (h[3] << 16) | (h[4] << 8) | h[5];
+		else if (version == 3)
+			size = _be32(h + 4);
+		else
+			size = _synchsafe(h + 4);
+		if (version > 2)
+			flags = (h[8] << 8) | h[9];
+		if (size > end - pos - hlen)
+			break;
+		f = _frame_find(h, version);
+		pos += hlen;
+		if (!f || priority[f->field] <= f->priority)
+		{
+			pos += size;
+			continue;
+		}
+		/* compressed or encrypted */
+		if ((version == 3 && (flags & 0x00c0)) ||
+				(version == 4 && (flags & 0x000c)))
+			return 0;
+
+		data = _fetch(r, pos, size);
+		if (!data) return 0;
+		pos += size;
+		if (version == 4 && (flags & 0x0043))
+		{
+			copy = malloc(size ? size : 1);
+			if (!copy) return 0;
+			memcpy(copy, data, size);
+			data = copy;
+			/* the grouping identity and the data length indicator */
+			if (flags & 0x0040)
+			{
+				data++;
+				size = size ? size - 1 : 0;
+			}
+			if (flags & 0x0001)
+			{
+				data += size >= 4 ? 4 : size;
+				size = size >= 4 ? size - 4 : 0;
+			}
+			if (flags & 0x0002)
+				size = _unsync((unsigned char *)data, size);
+		}
+		else if (version == 3 && (flags & 0x0020))
+		{
+			data++;
+			size = size ? size - 1 : 0;
+		}
+		text = _text_decode(data, size);
+		free(copy);
+		if (!text)
+			continue;
+		free(values[f->field]);
+		values[f->field] = text;
+		priority[f->field] = f->priority;
+	}
+	return 1;
+}
+/*============================================================================*
+ *                                 Global                                     *
+ *============================================================================*/
+/* Read the ID3v2 tag at the start of a file. If the caller already has the
+ * first len bytes of the file they are passed on header. Returns 0 if the
+ * file has no such tag or it can not be parsed here
+ */
+int libmetadatafs_id3v2_read(const char *file, const void *header, size_t len,
+		libmetadatafs_tags *tags)
+{
+	id3v2_reader r;
+	const unsigned char *h;
+	char *values[ID3V2_FIELDS] = { NULL, NULL, NULL };
+	size_t pos = ID3V2_HEADER_SIZE;
+	size_t end;
+	int version;
+	int flags;
+	int ret = 0;
+
+	memset(&r, 0, sizeof(id3v2_reader));
+	r.file = file;
+	r.fd = -1;
+	if (header && len >= ID3V2_HEADER_SIZE)
+	{
+		r.cache = header;
+		r.cache_len = len;
+	}
+	else
+	{
+		ssize_t rlen;
+
+		r.fd = libmetadatafs_tags_open(file);
+		if (r.fd < 0)
+			return 0;
+		rlen = pread(r.fd, r.first, ID3V2_FIRST_READ, 0);
+		if (rlen > 0)
+			r.read = rlen;
+		if (rlen < ID3V2_HEADER_SIZE)
+			goto end;
+		r.cache = r.first;
+		r.cache_len = rlen;
+	}
+
+	h = r.cache;
+	if (memcmp(h, "ID3", 3) || h[3] < 2 || h[3] > 4 || h[4] == 0xff)
+		goto end;
+	version = h[3];
+	flags = h[5];
+	end = ID3V2_HEADER_SIZE + _synchsafe(h + 6);
+	/* on 2.2 this flag is the compression of the whole tag */
+	if (version == 2 && (flags & 0x40))
+		goto end;
+	/* the kernel does not read ahead on its own, ask for what comes next
+	 * of the tag while we parse what we have
+	 */
+	if (r.fd >= 0 && end > r.cache_len)
+	{
+		size_t ahead = end - r.cache_len < ID3V2_READAHEAD ?
+				end - r.cache_len : ID3V2_READAHEAD;
+
+		posix_fadvise(r.fd, r.cache_len, ahead, POSIX_FADV_WILLNEED);
+		r.read = r.cache_len + ahead;
+	}
+	/* on 2.3 the whole tag is unsynchronised, so the frame sizes can not
+	 * be used to skip over the file, read it all and undo it
+	 */
+	if (version == 3 && (flags & 0x80))
+	{
+		const unsigned char *data;
+		unsigned char *tag;
+		size_t size = end - ID3V2_HEADER_SIZE;
+
+		data = _fetch(&r, ID3V2_HEADER_SIZE, size);
+		if (!data) goto end;
+		tag = malloc(ID3V2_HEADER_SIZE + size);
+		if (!tag) goto end;
+		memcpy(tag, r.cache, ID3V2_HEADER_SIZE);
+		memcpy(tag + ID3V2_HEADER_SIZE, data, size);
+		end = ID3V2_HEADER_SIZE + _unsync(tag + ID3V2_HEADER_SIZE, size);
+		free(r.scratch);
+		r.scratch = tag;
+		r.scratch_size = end;
+		r.cache = tag;
+		r.cache_len = end;
+	}
+	/* skip the extended header */
+	if (version > 2 && (flags & 0x40))
+	{
+		const unsigned char *ext;
+
+		ext = _fetch(&r, pos, 4);
+		if (!ext) goto end;
+		if (version == 3)
+			pos += 4 + _be32(ext);
+		else
+			pos += _synchsafe(ext);
+	}
+	if (!_frames_parse(&r, version, pos, end, values))
+		goto end;
+
+	tags->artist = values[ID3V2_ARTIST];
+	tags->album = values[ID3V2_ALBUM];
+	tags->title = values[ID3V2_TITLE];
+	values[ID3V2_ARTIST] = values[ID3V2_ALBUM] = values[ID3V2_TITLE] = NULL;
+	ret = 1;
+end:
+	free(values[ID3V2_ARTIST]);
+	free(values[ID3V2_ALBUM]);
+	free(values[ID3V2_TITLE]);
+	if (r.fd >= 0)
+		libmetadatafs_tags_close(r.fd, r.read);
+	free(r.scratch);
+	tags->read = r.read;
+	return ret;
+}
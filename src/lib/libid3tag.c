@@ -4,6 +4,8 @@
 #include <limits.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <unistd.h>
+#include <sys/stat.h>
 /*============================================================================*
  *                                  Local                                     *
  *============================================================================*/
@@ -66,26 +68,21 @@ end:
 	return;
 }
 
-/* TODO rename this to set data */
-static char * _tag_get_text(struct id3_tag *tag, const char *name)
+/* The text of a frame whatever its encoding, libid3tag gives it already
+ * decoded. NULL if there is no such frame or it is empty
+ */
+static char * _tag_text(struct id3_tag *tag, const char *name)
 {
 	struct id3_frame *frame;
 	union id3_field *field;
-	enum id3_field_textencoding enc;
 	char *title = NULL;
 
 	frame = id3_tag_findframe(tag, name, 0);
 	if (!frame) goto end;
 
-	field = id3_frame_field(frame, 0);
-	enc = id3_field_gettextencoding(field);
-
 	field = id3_frame_field(frame, 1);
 	if (!field) goto end;
 
-	if (enc != ID3_FIELD_TEXTENCODING_ISO_8859_1 && enc != ID3_FIELD_TEXTENCODING_UTF_8)
-		goto end;
-
 	switch (id3_field_type(field))
 	{
 		case ID3_FIELD_TYPE_STRING:
@@ -125,14 +122,34 @@ static char * _tag_get_text(struct id3_tag *tag, const char *name)
 end:
 	if (title && !libmetadatafs_name_is_empty(title))
 		return title;
-	else
-		return strdup(unknown);
+	free(title);
+	return NULL;
+}
+
+/* TODO rename this to set data */
+static char * _tag_get_text(struct id3_tag *tag, const char *name)
+{
+	char *text;
+
+	text = _tag_text(tag, name);
+	return text ? text : strdup(unknown);
+}
+
+/* the lead performer or the band, in the order of our own parser */
+static char * _tag_get_artist(struct id3_tag *tag)
+{
+	char *text;
+
+	text = _tag_text(tag, ID3_FRAME_ARTIST);
+	if (!text)
+		text = _tag_text(tag, "TPE2");
+	return text ? text : strdup(unknown);
 }
 
 /******************************************************************************
  *                       Metadatafs backend interface                         *
  ******************************************************************************/
-static int _supported(char *file)
+static int _supported(const char *file)
 {
 	char *extension;
 
@@ -142,7 +159,7 @@ static int _supported(char *file)
 	return 0;
 }
 
-static void * _open(char *file)
+static void * _open(const char *file)
 {
 	struct id3_file *id3;
 	id3 = id3_file_open(file, ID3_FILE_MODE_READWRITE);
@@ -163,7 +180,7 @@ static char * _artist_get(void *handle)
 	struct id3_tag *tag;
 
 	tag = id3_file_tag(id3);
-	return _tag_get_text(tag, ID3_FRAME_ARTIST);
+	return _tag_get_artist(tag);
 }
 
 static char * _title_get(void *handle)
@@ -204,6 +221,75 @@ static void _title_set(void *handle, char *title)
 	id3_file_update(id3);
 }
 
+static char * _tags_value(char *value)
+{
+	if (value && !libmetadatafs_name_is_empty(value))
+		return value;
+	free(value);
+	return strdup(unknown);
+}
+
+/* the scanner only reads, so try first our own parser which only reads the
+ * frames we need. Whatever it does not handle, or the frames missing on the
+ * ID3v2 tag that might be on the ID3v1 one, goes through libid3tag opening
+ * the file read only. Both find the same text on the same frames
+ */
+static int _tags_get(const char *file, const void *header, size_t len,
+		libmetadatafs_tags *tags)
+{
+	struct id3_file *id3;
+	struct id3_tag *tag;
+	struct stat st;
+	unsigned char *resident;
+	int parsed;
+	int fd;
+	int dfd;
+
+	memset(tags, 0, sizeof(libmetadatafs_tags));
+	parsed = libmetadatafs_id3v2_read(file, header, len, tags);
+	if (parsed && tags->artist && tags->album && tags->title)
+		goto done;
+	/* libid3tag closes what it is given, keep our own descriptor to drop
+	 * the file from the page cache once done. It reads the tags from both
+	 * ends of the file and how much is not known, so only what was not
+	 * cached before is dropped
+	 */
+	fd = libmetadatafs_tags_open(file);
+	if (fd < 0)
+		goto done;
+	if (fstat(fd, &st) < 0)
+		st.st_size = 0;
+	resident = libmetadatafs_tags_resident(fd, st.st_size);
+	dfd = dup(fd);
+	id3 = dfd < 0 ? NULL : id3_file_fdopen(dfd, ID3_FILE_MODE_READONLY);
+	if (!id3)
+	{
+		if (dfd >= 0)
+			close(dfd);
+		free(resident);
+		libmetadatafs_tags_close(fd, 0);
+		goto done;
+	}
+	/* the ID3v1 tag is merged with the ID3v2 one */
+	tag = id3_file_tag(id3);
+	if (!tags->artist)
+		tags->artist = _tag_get_artist(tag);
+	if (!tags->album)
+		tags->album = _tag_get_text(tag, ID3_FRAME_ALBUM);
+	if (!tags->title)
+		tags->title = _tag_get_text(tag, ID3_FRAME_TITLE);
+	id3_file_close(id3);
+	libmetadatafs_tags_close_resident(fd, st.st_size, resident);
+	parsed = 1;
+done:
+	if (!parsed)
+		return 0;
+	tags->artist = _tags_value(tags->artist);
+	tags->album = _tags_value(tags->album);
+	tags->title = _tags_value(tags->title);
+	return 1;
+}
+
 static void _album_set(void *handle, char *album)
 {
 	struct id3_file *id3 = handle;
@@ -227,4 +313,5 @@ libmetadatafs_backend libid3tag_backend = {
 	.artist_set = _artist_set,
 	.album_set = _album_set,
 	.title_set = _title_set,
+	.tags_get = _tags_get,
 };
@@ -4,6 +4,10 @@
 
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/mman.h>
 #include "libmetadatafs.h"
 
 extern libmetadatafs_backend libid3tag_backend;
@@ -11,6 +15,9 @@ extern libmetadatafs_backend libid3tag_backend;
  *                                  Local                                     *
  *============================================================================*/
 static libmetadatafs_backend *_backend = &libid3tag_backend;
+static int _cache_drop = 1;
+/* not allowed on files we do not own, not asked again once refused */
+static int _noatime = O_NOATIME;
 /*============================================================================*
  *                                 Global                                     *
  *============================================================================*/
@@ -29,18 +36,126 @@ int libmetadatafs_name_is_empty(char *str)
 	else return 0;
 }
 
-char * libmetadatafs_path_last_char(char *path, char token)
+char * libmetadatafs_path_last_char(const char *path, char token)
 {
 	char *tmp;
 
-	tmp = path + strlen(path) - 1;
+	tmp = (char *)path + strlen(path) - 1;
 	while (tmp >= path && *tmp != token) tmp--;
 
 	return tmp + 1;
 }
+
+/* Open a file only to read its tags. Its access time is not touched if we
+ * are allowed to (we must own it), and the kernel is told not to read ahead
+ * of what is asked, the tags are a few KB on files of several MB
+ */
+int libmetadatafs_tags_open(const char *file)
+{
+	int fd;
+
+	fd = open(file, O_RDONLY | O_CLOEXEC | _noatime);
+	if (fd < 0 && errno == EPERM && _noatime)
+	{
+		_noatime = 0;
+		fd = open(file, O_RDONLY | O_CLOEXEC);
+	}
+	if (fd < 0)
+		return fd;
+	posix_fadvise(fd, 0, 0, POSIX_FADV_RANDOM);
+	return fd;
+}
+
+/* Close a file opened with libmetadatafs_tags_open(). The first len bytes,
+ * what was read of it, are dropped from the page cache so reading the tags
+ * does not evict what others need
+ */
+void libmetadatafs_tags_close(int fd, size_t len)
+{
+	if (_cache_drop && len)
+		posix_fadvise(fd, 0, len, POSIX_FADV_DONTNEED);
+	close(fd);
+}
+
+/* Which pages of the first len bytes of a file are on the page cache right
+ * now, one byte per page as mincore() gives them. NULL if nothing is going to
+ * be dropped or it can not be known
+ */
+unsigned char * libmetadatafs_tags_resident(int fd, size_t len)
+{
+	unsigned char *vec;
+	long page;
+	void *map;
+
+	if (!_cache_drop || !len)
+		return NULL;
+	page = sysconf(_SC_PAGESIZE);
+	/* nothing is read by mapping it */
+	map = mmap(NULL, len, PROT_READ, MAP_SHARED, fd, 0);
+	if (map == MAP_FAILED)
+		return NULL;
+	vec = malloc((len + page - 1) / page);
+	if (vec && mincore(map, len, vec) < 0)
+	{
+		free(vec);
+		vec = NULL;
+	}
+	munmap(map, len);
+	return vec;
+}
+
+/* As libmetadatafs_tags_close() for when what was read is not known, only
+ * the pages that were not on the page cache before, as resident tells, are
+ * dropped. What others were reading stays there
+ */
+void libmetadatafs_tags_close_resident(int fd, size_t len,
+		unsigned char *resident)
+{
+	size_t page;
+	size_t pages;
+	size_t i;
+
+	if (!resident)
+	{
+		close(fd);
+		return;
+	}
+	page = sysconf(_SC_PAGESIZE);
+	pages = (len + page - 1) / page;
+	for (i = 0; i < pages; )
+	{
+		size_t start;
+
+		if (resident[i] & 1)
+		{
+			i++;
+			continue;
+		}
+		for (start = i; i < pages && !(resident[i] & 1); i++)
+			;
+		posix_fadvise(fd, start * page, (i - start) * page,
+				POSIX_FADV_DONTNEED);
+	}
+	free(resident);
+	close(fd);
+}
+
+/* keep on the page cache what is read of the files, it is dropped by default */
+void libmetadatafs_cache_drop_set(int drop)
+{
+	_cache_drop = drop;
+}
 /******************************************************************************
  *                                 Backend                                    *
  ******************************************************************************/
+/* check, based only on the name, if the file can be handled. This is cheap
+ * so it can be called before even doing a stat() on the file
+ */
+int libmetadatafs_supported(const char *file)
+{
+	return _backend->supported(file);
+}
+
 void * libmetadatafs_open(const char *file)
 {
 	if (!_backend->supported(file)) return NULL;
@@ -85,3 +200,27 @@ void libmetadatafs_title_set(void *handle, char *title)
 	return _backend->title_set(handle, title);
 }
 
+/* Read the artist, album and title of a file, the caller owns the strings.
+ * This is what the scanner uses, if the caller already has the first len
+ * bytes of the file it can pass them on header. Returns 0 if the file can
+ * not be read
+ */
+int libmetadatafs_tags_get(const char *file, const void *header, size_t len,
+		libmetadatafs_tags *tags)
+{
+	void *handle;
+
+	if (!_backend->supported(file)) return 0;
+	tags->read = 0;
+	if (_backend->tags_get)
+		return _backend->tags_get(file, header, len, tags);
+
+	handle = _backend->open(file);
+	if (!handle) return 0;
+	tags->artist = _backend->artist_get(handle);
+	tags->album = _backend->album_get(handle);
+	tags->title = _backend->title_get(handle);
+	_backend->close(handle);
+	return 1;
+}
+
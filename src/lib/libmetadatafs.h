@@ -1,10 +1,25 @@
 #ifndef _LIBMETADATAFS_H
 #define _LIBMETADATAFS_H
 
+#include <stddef.h>
+
+typedef struct _libmetadatafs_tags
+{
+	char *artist;
+	char *album;
+	char *title;
+	/* how much of the file was read to find them, 0 if not known */
+	size_t read;
+} libmetadatafs_tags;
+
+/* A backend must be reentrant, every call works only on the handle it
+ * receives so the scanner can parse several files at once from different
+ * threads
+ */
 typedef struct _libmetadatafs_backend
 {
-	int (*supported)(char *file);
-	void * (*open)(char *file);
+	int (*supported)(const char *file);
+	void * (*open)(const char *file);
 	void (*close)(void *handle);
 	char * (*artist_get)(void *handle);
 	char * (*title_get)(void *handle);
@@ -12,8 +27,15 @@ typedef struct _libmetadatafs_backend
 	void (*artist_set)(void *handle, char *artist);
 	void (*title_set)(void *handle, char *title);
 	void (*album_set)(void *handle, char *album);
+	/* optional, read every tag in one go without opening the file for
+	 * writing, header has the first len bytes of the file if the caller
+	 * already read them
+	 */
+	int (*tags_get)(const char *file, const void *header, size_t len,
+			libmetadatafs_tags *tags);
 } libmetadatafs_backend;
 
+int libmetadatafs_supported(const char *file);
 void * libmetadatafs_open(const char *file);
 void libmetadatafs_close(void *handle);
 char * libmetadatafs_artist_get(void *handle);
@@ -22,8 +44,20 @@ char * libmetadatafs_title_get(void *handle);
 void libmetadatafs_artist_set(void *handle, char *artist);
 void libmetadatafs_album_set(void *handle, char *album);
 void libmetadatafs_title_set(void *handle, char *title);
+int libmetadatafs_tags_get(const char *file, const void *header, size_t len,
+		libmetadatafs_tags *tags);
+
+int libmetadatafs_name_is_empty(char *str);
+char * libmetadatafs_path_last_char(const char *path, char token);
+int libmetadatafs_tags_open(const char *file);
+void libmetadatafs_tags_close(int fd, size_t len);
+unsigned char * libmetadatafs_tags_resident(int fd, size_t len);
+void libmetadatafs_tags_close_resident(int fd, size_t len,
+		unsigned char *resident);
+void libmetadatafs_cache_drop_set(int drop);
 
-int metadatafs_name_is_empty(char *str);
-char * metadatafs_path_last_char(char *path, char token);
+/* native parsers */
+int libmetadatafs_id3v2_read(const char *file, const void *header, size_t len,
+		libmetadatafs_tags *tags);
 
 #endif